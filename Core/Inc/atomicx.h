@@ -0,0 +1,215 @@
+// ****************************************************************************
+/// \file      atomicx.h
+///
+/// \brief     atomic access module
+///
+/// \details   Header only module with the atomic primitives used by the
+///            lock-free modules (queuex). On the target the primitives are
+///            built with the LDREX/STREX exclusive access instructions and
+///            DMB barriers of the cortex-m4. With HOST_BUILD defined the C11
+///            atomics are used instead, so the modules can be compiled and
+///            stressed with threads on a pc.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning   Only 32 bit objects are supported, the cortex-m4 has no
+///            exclusive access for wider types.
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __ATOMICX_H
+#define __ATOMICX_H
+
+// Include ********************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(HOST_BUILD)
+#include <stdatomic.h>
+#else
+#include "stm32f4xx.h"
+#endif
+
+// Exported types *************************************************************
+#if defined(HOST_BUILD)
+typedef _Atomic uint32_t   atomicx_t;
+#else
+typedef volatile uint32_t  atomicx_t;
+#endif
+
+// Exported functions *********************************************************
+
+// ----------------------------------------------------------------------------
+/// \brief     Relaxed load, used for objects owned by the calling context.
+///
+/// \param     [in] atomicx_t *object
+///
+/// \return    uint32_t value
+static inline uint32_t atomicx_load( atomicx_t *object )
+{
+#if defined(HOST_BUILD)
+   return atomic_load_explicit( object, memory_order_relaxed );
+#else
+   return *object;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Load with acquire semantic. Memory accesses after the load can
+///            not be reordered in front of it.
+///
+/// \param     [in] atomicx_t *object
+///
+/// \return    uint32_t value
+static inline uint32_t atomicx_loadAcquire( atomicx_t *object )
+{
+#if defined(HOST_BUILD)
+   return atomic_load_explicit( object, memory_order_acquire );
+#else
+   uint32_t value = *object;
+   __DMB();
+   return value;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Relaxed store, used for objects owned by the calling context.
+///
+/// \param     [in/out] atomicx_t *object
+/// \param     [in]     uint32_t value
+///
+/// \return    none
+static inline void atomicx_store( atomicx_t *object, uint32_t value )
+{
+#if defined(HOST_BUILD)
+   atomic_store_explicit( object, value, memory_order_relaxed );
+#else
+   *object = value;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Store with release semantic. Memory accesses in front of the
+///            store are visible before the stored value.
+///
+/// \param     [in/out] atomicx_t *object
+/// \param     [in]     uint32_t value
+///
+/// \return    none
+static inline void atomicx_storeRelease( atomicx_t *object, uint32_t value )
+{
+#if defined(HOST_BUILD)
+   atomic_store_explicit( object, value, memory_order_release );
+#else
+   __DMB();
+   *object = value;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Compare and exchange with acquire/release semantic. The object
+///            is only written if it still contains the expected value.
+///
+/// \param     [in/out] atomicx_t *object
+/// \param     [in]     uint32_t expected
+/// \param     [in]     uint32_t desired
+///
+/// \return    true = exchanged, false = object has been changed by someone
+///            else
+static inline bool atomicx_compareExchange( atomicx_t *object, uint32_t expected, uint32_t desired )
+{
+#if defined(HOST_BUILD)
+   return atomic_compare_exchange_strong_explicit( object, &expected, desired, memory_order_acq_rel, memory_order_acquire );
+#else
+   __DMB();
+   do
+   {
+      if( __LDREXW( object ) != expected )
+      {
+         __CLREX();
+         return false;
+      }
+   } while( __STREXW( desired, object ) != 0u );
+   __DMB();
+   return true;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Relaxed atomic add, used for statistic counters which are
+///            incremented from several contexts.
+///
+/// \param     [in/out] atomicx_t *object
+/// \param     [in]     uint32_t value
+///
+/// \return    uint32_t value before the addition
+static inline uint32_t atomicx_fetchAdd( atomicx_t *object, uint32_t value )
+{
+#if defined(HOST_BUILD)
+   return atomic_fetch_add_explicit( object, value, memory_order_relaxed );
+#else
+   uint32_t oldValue;
+   do
+   {
+      oldValue = __LDREXW( object );
+   } while( __STREXW( oldValue + value, object ) != 0u );
+   return oldValue;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Raises the object to value if value is bigger (peak tracking).
+///
+/// \param     [in/out] atomicx_t *object
+/// \param     [in]     uint32_t value
+///
+/// \return    none
+static inline void atomicx_max( atomicx_t *object, uint32_t value )
+{
+   uint32_t oldValue = atomicx_load( object );
+   while( value > oldValue )
+   {
+      if( atomicx_compareExchange( object, oldValue, value ) )
+      {
+         return;
+      }
+      oldValue = atomicx_load( object );
+   }
+}
+
+#endif // __ATOMICX_H
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,107 @@
+// ****************************************************************************
+/// \file      bufferpool.h
+///
+/// \brief     buffer pool module
+///
+/// \details   Module which manages the frame buffers shared by all
+///            communication interfaces. The buffers are split into size
+///            classes, so short frames do not occupy a full ethernet frame
+///            buffer. Each interface draws its buffers through a quota with a
+///            guaranteed minimum and a burst ceiling per size class.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __BUFFERPOOL_H
+#define __BUFFERPOOL_H
+
+// Include ********************************************************************
+#include "atomicx.h"
+
+// Exported defines ***********************************************************
+#define BUFFERPOOL_SMALL_LENGTH           ( 176u )    // arp, tcp ack, short modbus/tcp polls: 128 byte frame with usb header and padding byte (46 + 1), word aligned
+#define BUFFERPOOL_SMALL_BUFFERS          ( 112u )
+#define BUFFERPOOL_MEDIUM_LENGTH          ( 512u )
+#define BUFFERPOOL_MEDIUM_BUFFERS         ( 16u )
+#define BUFFERPOOL_LARGE_LENGTH           ( 1562u )   // ethernet frame with usb header
+#define BUFFERPOOL_LARGE_BUFFERS          ( 22u )
+#define BUFFERPOOL_BUFFERLENGTH           BUFFERPOOL_LARGE_LENGTH
+#define BUFFERPOOL_BUFFERS                ( BUFFERPOOL_SMALL_BUFFERS + BUFFERPOOL_MEDIUM_BUFFERS + BUFFERPOOL_LARGE_BUFFERS )
+
+// Exported types *************************************************************
+typedef enum
+{
+   BUFFERPOOL_SMALL = 0,
+   BUFFERPOOL_MEDIUM,
+   BUFFERPOOL_LARGE,
+   BUFFERPOOL_CLASSES
+} bufferpool_class_t;
+
+typedef struct bufferpool_quota
+{
+   uint32_t             minBuffers[BUFFERPOOL_CLASSES];        // guaranteed number of buffers
+   uint32_t             maxBuffers[BUFFERPOOL_CLASSES];        // burst ceiling
+   atomicx_t            usedBuffers[BUFFERPOOL_CLASSES];
+   atomicx_t            usedBuffersPeak[BUFFERPOOL_CLASSES];
+   atomicx_t            allocFail;
+   bool                 registered;
+} bufferpool_quota_t;
+
+typedef struct bufferpool_stat
+{
+   uint32_t             length;
+   uint32_t             buffers;
+   uint32_t             used;
+   uint32_t             usedPeak;
+   uint32_t             allocFail;
+} bufferpool_stat_t;
+
+// Exported functions *********************************************************
+void     bufferpool_init         ( void );
+uint8_t  bufferpool_register     ( bufferpool_quota_t *quota );
+uint8_t* bufferpool_alloc        ( uint32_t length, bufferpool_quota_t *quota );
+uint8_t* bufferpool_shrink       ( uint8_t* buffer, uint32_t length, bufferpool_quota_t *quota );
+void     bufferpool_free         ( uint8_t* buffer, bufferpool_quota_t *quota );
+uint32_t bufferpool_getLength    ( uint8_t* buffer );
+void     bufferpool_getStat      ( bufferpool_class_t sizeClass, bufferpool_stat_t *stat );
+
+#endif // __BUFFERPOOL_H
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -46,15 +46,29 @@
 // ****************************************************************************
 
 /* Includes ------------------------------------------------------------------*/
-#include "stm32f4xx.h"
+#include "atomicx.h"
+#include "bufferpool.h"
 
 /* Define to prevent recursive inclusion -------------------------------------*/
 #ifndef __QUEUE_H
 #define __QUEUE_H
 
 // Exported defines ***********************************************************
-#define QUEUEBUFFERLENGTH                 ( 1562u )
-#define QUEUELENGTH                       ( 30u )
+#define QUEUE_BACKEND_SLOT                ( 0u )      // ringbuffer of slots referencing buffer pool buffers
+#define QUEUE_BACKEND_BIP                 ( 1u )      // contiguous byte ring with length prefixed frames (bip-buffer)
+#ifndef QUEUE_BACKEND
+#define QUEUE_BACKEND                     QUEUE_BACKEND_SLOT
+#endif
+
+#define QUEUEBUFFERLENGTH                 BUFFERPOOL_BUFFERLENGTH
+#define QUEUELENGTH                       ( BUFFERPOOL_BUFFERS + 1u )
+#define QUEUERINGLENGTH                   ( 24u*1024u )  // bytes of the ring of each queue, bip backend only
+#define QUEUEBATCHLENGTH                  ( 8u )      // max. frames handed to outputBatch at once
+#define QUEUEFRAMEALIGN                   ( 2u )      // frames start 2 bytes past a word, the ip header behind the ethernet header is word aligned
+#define QUEUE_FRAMEOFFSET( headroom )     ( (headroom) + ( ( QUEUEFRAMEALIGN - (headroom) ) & 3u ) )  // first aligned frame start behind the headroom
+#define QUEUECODELTARGET                  ( 5000u )   // default codel target sojourn time, us
+#define QUEUECODELINTERVAL                ( 100000u ) // default codel interval, us
+#define QUEUEHISTOGRAMBUCKETS             ( 124u )    // four buckets per power of two, 32 bit range
 
 // Exported types *************************************************************
 typedef enum
@@ -73,6 +87,41 @@ typedef enum
    TAIL_BLOCKED
 } queue_status_t;
 
+// Priority classes of the slot backend, the lower the value the higher the
+// priority with strict service.
+typedef enum
+{
+   PRIORITY_HIGH = 0,                       // network control, arp, pcp 6-7, dscp cs6/cs7/ef
+   PRIORITY_NORMAL,
+   PRIORITY_LOW,                            // background, pcp 1-2, dscp cs1
+   PRIORITY_CLASSES
+} queue_priority_t;
+
+typedef enum
+{
+   SERVICE_STRICT = 0,                      // highest class with a ready frame first
+   SERVICE_WEIGHTED                         // round robin, up to weight frames per class and round
+} queue_service_t;
+
+// Overload policy of the slot backend. The bip backend always drops the new
+// frame.
+typedef enum
+{
+   POLICY_TAILDROP = 0,                     // drop the new frame if its class is full
+   POLICY_DROPOLDEST,                       // drop the oldest frame of the class for the new one
+   POLICY_CODEL                             // tail drop, plus codel drops on the sojourn time at the output
+} queue_droppolicy_t;
+
+typedef enum
+{
+   DROP_FULL = 0,                           // class or ring full, new frame dropped
+   DROP_NOBUFFER,                           // quota of the queue exhausted, new frame dropped
+   DROP_OLDEST,                             // oldest frame dropped for a new one
+   DROP_SOJOURN,                            // frame dropped by codel
+   DROP_FLUSH,                              // waiting frame dropped by queue_flush
+   DROP_REASONS
+} queue_dropreason_t;
+
 typedef enum
 {
    EMPTY_TX = 0,
@@ -81,40 +130,156 @@ typedef enum
    RECEIVING_RX
 } message_status_t;
 
+// Reservation of a producer, see queue_reserve. The buffer stays with the
+// producer until it is committed or aborted.
+typedef struct queue_reservation
+{
+   uint8_t*             buffer;             // reserved buffer, NULL = no reservation
+   uint16_t             length;             // reserved bytes
+} queue_reservation_t;
+
+// Frame handed to the batch output of a peripheral.
+typedef struct queue_frame
+{
+   uint8_t*             dataStart;
+   uint16_t             dataLength;
+} queue_frame_t;
+
+// Histogram of sojourn times in cpu cycles, see queue_histogramAdd.
+typedef struct queue_histogram
+{
+   uint32_t             bucket[QUEUEHISTOGRAMBUCKETS];
+   uint32_t             count;
+   uint32_t             max;
+} queue_histogram_t;
+
+// Read-out of a sojourn time histogram, cpu cycles.
+typedef struct queue_sojourn
+{
+   uint32_t             count;
+   uint32_t             p50;
+   uint32_t             p99;
+   uint32_t             max;
+} queue_sojourn_t;
+
 typedef struct queue_obj{
-    uint8_t             data[QUEUEBUFFERLENGTH];
-    uint8_t*            dataStart;
+    uint8_t*            data;               // buffer from the buffer pool
+    uint16_t            dataOffset;         // start of the frame in data
     uint16_t            dataLength;
-    message_status_t    messageStatus;
+    uint32_t            timestamp;          // enqueue time, cpu cycles
+    atomicx_t           messageStatus;      // message_status_t, published with release semantic
 } queue_obj_t;
 
+// Priority class of the slot backend with its own ringbuffer. The depth limit
+// keeps a flooding class from taking all the buffers of the queue quota.
+typedef struct queue_class
+{
+   queue_obj_t          queue[QUEUELENGTH];
+   atomicx_t            headIndex;
+   atomicx_t            tailIndex;
+   uint32_t             depthLimit;         // max. queued frames, 0 = QUEUELENGTH-1
+   uint32_t             weight;             // frames per round with weighted service, 0 = 1
+   uint32_t             credit;             // frames left in the current round
+   atomicx_t            dataPacketsIN;
+   uint32_t             dataPacketsOUT;
+   atomicx_t            queueFull;
+   atomicx_t            queueLengthPeak;
+   uint32_t             waitMax;            // longest wait of a frame until the output, cpu cycles
+   uint32_t             codelFirstAbove;    // time the sojourn time may stay above target, 0 = below
+   uint32_t             codelDropNext;      // time of the next codel drop
+   uint32_t             codelCount;         // codel drops in the current dropping state
+   bool                 codelDropping;
+} queue_class_t;
+
+// The head index is written by the producer(s), the tail index only by the
+// consumer (queue manager and tx complete callback). Counters which are
+// written by more than one context are atomics.
+// Slot backend: each priority class has its own ringbuffer, both indexes run
+// from 0 to QUEUELENGTH-1, one slot always stays free to tell a full from an
+// empty ringbuffer. The slots only hold references to buffers of the shared
+// buffer pool, the buffers are drawn through the quota of the queue. The
+// class of a frame is given by the classifier, without classifier all frames
+// go into the normal class.
+// Bip backend: both indexes are byte offsets into the ring. The frames are
+// stored back to back behind a record header, the head buffer is a
+// reservation of QUEUEBUFFERLENGTH contiguous bytes at the reserve index.
 typedef struct queue 
 {
-   queue_status_t       queueStatus;
-   uint32_t             dataPacketsIN; 
-   uint32_t             bytesIN;
+   atomicx_t            queueStatus;        // queue_status_t
+   atomicx_t            dataPacketsIN; 
+   atomicx_t            bytesIN;
    uint32_t             dataPacketsOUT;
    uint32_t             bytesOUT;
-   uint32_t             frameCounter;
-   uint32_t             queueFull;
-   uint32_t             queueLength;
-   uint32_t             queueLengthPeak;
+   atomicx_t            frameCounter;
+   atomicx_t            queueFull;          // new frames dropped (DROP_FULL and DROP_NOBUFFER)
+   atomicx_t            queueLengthPeak;
+   atomicx_t            dropCounter[DROP_REASONS];
    message_direction_t  messageDirection;   
-   queue_obj_t          queue[QUEUELENGTH];
-   uint32_t             headIndex;
-   uint32_t             tailIndex;
+   uint16_t             headroom;           // bytes the output writes in front of a frame, e.g. its header
+   uint16_t             tailroom;           // bytes the output may send behind a frame, e.g. a padding byte
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   queue_class_t        priorityClass[PRIORITY_CLASSES];
+   queue_service_t      service;
+   uint32_t             serviceClass;       // class in turn with weighted service
+   uint32_t             txClass;            // class of the frames handed to the output
+   atomicx_t            queueLength;        // frames of all classes
+   queue_priority_t     (*classify)( const uint8_t*, uint16_t );  // optional, e.g. queue_classify
+   queue_droppolicy_t   dropPolicy;
+   uint32_t             codelTarget;        // us, 0 = QUEUECODELTARGET
+   uint32_t             codelInterval;      // us, 0 = QUEUECODELINTERVAL
+#else
+   uint32_t             ring[QUEUERINGLENGTH/4u];  // word aligned for dma
+   uint32_t             reserveIndex;       // record of the head buffer, owned by the producer
+   atomicx_t            headIndex;
+   atomicx_t            tailIndex;
+#endif
+   uint8_t*             headBuffer;         // receive buffer of the zero copy producer
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   bufferpool_quota_t   bufferQuota;
+#endif
    uint32_t             tailError;
    uint32_t             spuriousError;
+   atomicx_t            txFrames;           // frames handed to the output and not yet released
+   queue_frame_t        txBatch[QUEUEBATCHLENGTH];
+   uint32_t             txTimestamp;        // output start of the frames in transmission
+   queue_histogram_t    waitHistogram;      // enqueue to output start
+   queue_histogram_t    serviceHistogram;   // output start to tx complete
    uint8_t              (*output)( uint8_t*, uint16_t );
+   void                 (*outputAbort)( uint8_t* );  // optional, ends a frame of queue_commitStream with a framing error
+   void                 (*outputProgress)( uint8_t*, uint16_t );  // optional, bytes of a frame of queue_commitStream received so far
+   void                 (*outputDrop)( uint8_t* );  // optional, a frame is dropped or flushed before its output has sent it, e.g. to forget a frame of queue_commitStream
+   uint16_t             (*outputBatch)( queue_frame_t*, uint16_t );  // optional, returns the number of frames taken, 0 = busy
+   void                 (*inputResume)( void );  // optional, called after slots are released, e.g. to re-arm a paused input
+   void                 (*inputDrop)( uint8_t* );  // optional, a frame is dropped or flushed, the producer stops writing into a frame of queue_commitStream
+   void                 (*wakeup)( struct queue* );  // optional, called from any context when the queue manager has work
 } queue_handle_t;
 
 // Exported functions *********************************************************
-void     queue_init              ( queue_handle_t *queueHandle );
+uint8_t  queue_init              ( queue_handle_t *queueHandle );
+void     queue_flush             ( queue_handle_t *queueHandle, uint16_t aborted );
 void     queue_manager           ( queue_handle_t *queueHandle );
 void     queue_dequeue           ( queue_handle_t *queueHandle );
+void     queue_dequeueBatch      ( queue_handle_t *queueHandle, uint16_t count );
 uint8_t* queue_enqueue           ( uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle );
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+uint8_t  queue_enqueueMulti      ( const uint8_t* data, uint16_t dataLength, queue_handle_t *queueHandle );
+#endif
+uint8_t* queue_reserve           ( queue_reservation_t *reservation, uint16_t maxLength, queue_handle_t *queueHandle );
+uint8_t  queue_commit            ( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle );
+uint8_t  queue_commitStream      ( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle );
+void     queue_abortStream       ( uint8_t* dataStart, queue_handle_t *queueHandle );
+void     queue_progressStream    ( uint8_t* dataStart, uint16_t received, queue_handle_t *queueHandle );
+uint8_t* queue_getFrameStart     ( queue_reservation_t *reservation, uint16_t *maxLength, queue_handle_t *queueHandle );
+void     queue_abort             ( queue_reservation_t *reservation, queue_handle_t *queueHandle );
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+queue_priority_t queue_classify  ( const uint8_t* frame, uint16_t length );
+#endif
+uint32_t queue_getLength         ( queue_handle_t *queueHandle );
 uint8_t* queue_getHeadBuffer     ( queue_handle_t *queueHandle );
 uint8_t* queue_getTailBuffer     ( queue_handle_t *queueHandle );
+uint32_t queue_getTimestamp      ( void );
+void     queue_histogramAdd      ( queue_histogram_t *histogram, uint32_t value );
+void     queue_getSojourn        ( queue_handle_t *queueHandle, queue_sojourn_t *wait, queue_sojourn_t *service );
 
 #endif /* __QUEUE_H */
 
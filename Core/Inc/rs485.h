@@ -50,9 +50,12 @@
 #define __RS485_H
 
 // Include ********************************************************************
+#include <stdbool.h>
 #include "stm32f4xx.h"
 
 // Exported defines ***********************************************************
+#define RS485_TX_HEADROOM        ( 0u )   // rs485_output sends the frame as it is
+#define RS485_TX_TAILROOM        ( 0u )
 
 // Exported types *************************************************************
 
@@ -60,9 +63,17 @@
 void     rs485_init              ( void );
 void     rs485_deinit            ( void );
 uint8_t  rs485_output            ( uint8_t* buffer, uint16_t length );
+void     rs485_outputAbort       ( uint8_t* buffer );
+void     rs485_outputProgress    ( uint8_t* buffer, uint16_t received );
+void     rs485_outputDrop        ( uint8_t* buffer );
 uint8_t  rs485_receive           ( uint8_t* buffer, uint16_t length );
-void     rs485_rxCplt            ( void );
+void     rs485_rxCplt            ( uint16_t length );
+void     rs485_rxLength          ( uint16_t length );
+void     rs485_rxProgress        ( uint16_t received );
 void     rs485_txCplt            ( void );
+void     rs485_rxResume          ( void );
+void     rs485_rxDrop            ( uint8_t* buffer );
+void     rs485_linkChanged       ( bool up );
 #endif // __RS485_H
 
 /********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
\ No newline at end of file
@@ -0,0 +1,119 @@
+// ****************************************************************************
+/// \file      stats.h
+///
+/// \brief     statistics module
+///
+/// \details   Module which collects the counters of the usb interface in
+///            one registry. The counters are 64 bit wide and written by the
+///            irq's and the task, the snapshot adds the statistics the queues
+///            keep themselves, so a host tool can read everything in one
+///            control transfer.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __STATS_H
+#define __STATS_H
+
+// Include ********************************************************************
+#include "queuex.h"
+
+// Exported defines ***********************************************************
+#define STATS_VERSION                     ( 2u )      // layout of stats_snapshot_t
+
+// Exported types *************************************************************
+typedef enum
+{
+   STATS_USB_TX_FRAMES = 0,                 // frames sent to the host
+   STATS_USB_TX_BYTES,
+   STATS_USB_TX_ERRORS,                     // frames the usb class refused
+   STATS_USB_RX_FRAMES,                     // frames from the host put into the usb queue
+   STATS_USB_RX_BYTES,
+   STATS_USB_RX_ERRORS,                     // malformed transfers
+   STATS_USB_RX_NOBUFFER,                   // transfers received without room in the usb queue
+   STATS_USB_RX_FILTERED,                   // frames rejected by the packet filter
+   STATS_USB_RX_LINKDOWN,                   // frames dropped while the backend link is down
+   STATS_USB_LL_DATAOUT,                    // out stage callbacks of the usb driver
+   STATS_USB_LL_DATAIN,                     // in stage callbacks of the usb driver
+   STATS_USB_TX_TRANSFERS,                  // in transfers completed on the data endpoint
+   STATS_USB_TX_PADDED,                     // in transfers of a multiple of the endpoint size, padded within the transfer
+   STATS_USB_TX_ZLP,                        // zero length packets, each an extra in round trip
+   STATS_COUNTERS
+} stats_counter_t;
+
+typedef enum
+{
+   STATS_UARTQUEUE = 0,
+   STATS_USBQUEUE,
+   STATS_QUEUES
+} stats_queue_index_t;
+
+typedef struct stats_queue
+{
+   uint32_t             length;
+   uint32_t             lengthPeak;
+   uint32_t             packetsIn;
+   uint32_t             packetsOut;
+   uint32_t             full;
+   uint32_t             drop[DROP_REASONS];
+   uint32_t             tailError;
+   uint32_t             spuriousError;
+   queue_sojourn_t      wait;               // enqueue to output start, cpu cycles
+   queue_sojourn_t      service;            // output start to tx complete, cpu cycles
+} stats_queue_t;
+
+// Snapshot of all statistics, read out with one vendor oid. The host checks
+// version and length before it interprets the rest.
+typedef struct stats_snapshot
+{
+   uint32_t             version;
+   uint32_t             length;
+   uint64_t             counter[STATS_COUNTERS];
+   stats_queue_t        queue[STATS_QUEUES];
+} stats_snapshot_t;
+
+// Exported functions *********************************************************
+void     stats_add               ( stats_counter_t counter, uint32_t value );
+uint64_t stats_get               ( stats_counter_t counter );
+void     stats_getSnapshot       ( stats_snapshot_t *snapshot );
+
+#endif // __STATS_H
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
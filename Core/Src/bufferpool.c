@@ -0,0 +1,432 @@
+// ****************************************************************************
+/// \file      bufferpool.c
+///
+/// \brief     buffer pool module
+///
+/// \details   This is the bufferpool c source file. All frame buffers of the
+///            communication interfaces are taken from one static pool, so a
+///            bursty direction can use the buffers an idle direction does not
+///            need. The buffers come in size classes (128, 512 and 1562 bytes),
+///            a frame occupies the smallest buffer it fits in. Each interface
+///            draws its buffers through a quota per size class: minBuffers
+///            are guaranteed and held back from the other interfaces, up to
+///            maxBuffers can be used when the pool has buffers which are not
+///            guaranteed to someone else.
+///            The pool is lock-free, the buffers are managed with a bitmap and
+///            the budget with atomic counters. Alloc and free may be called
+///            from any irq or task.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre       bufferpool_init has to be called once before any quota is
+///            registered.
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Include ********************************************************************
+#include "bufferpool.h"
+#include <stddef.h>
+#include <string.h>
+
+// Private define *************************************************************
+#define BUFFERPOOL_WORDS( length )        ( ( (length) + 3u ) / 4u )
+#define BUFFERPOOL_MAPWORDS               ( ( BUFFERPOOL_SMALL_BUFFERS + 31u ) / 32u )
+
+// Private types     **********************************************************
+typedef struct bufferpool_class
+{
+   uint32_t*            storage;
+   uint32_t             length;             // buffer length in bytes
+   uint32_t             words;              // distance between two buffers in words
+   uint32_t             buffers;
+} bufferpool_class_desc_t;
+
+// Private variables **********************************************************
+static uint32_t   poolSmall[BUFFERPOOL_SMALL_BUFFERS][BUFFERPOOL_WORDS(BUFFERPOOL_SMALL_LENGTH)];     // word aligned frame buffers
+static uint32_t   poolMedium[BUFFERPOOL_MEDIUM_BUFFERS][BUFFERPOOL_WORDS(BUFFERPOOL_MEDIUM_LENGTH)];
+static uint32_t   poolLarge[BUFFERPOOL_LARGE_BUFFERS][BUFFERPOOL_WORDS(BUFFERPOOL_LARGE_LENGTH)];
+
+static const bufferpool_class_desc_t classDesc[BUFFERPOOL_CLASSES] =
+{
+   { poolSmall[0],  BUFFERPOOL_SMALL_LENGTH,  BUFFERPOOL_WORDS(BUFFERPOOL_SMALL_LENGTH),  BUFFERPOOL_SMALL_BUFFERS  },
+   { poolMedium[0], BUFFERPOOL_MEDIUM_LENGTH, BUFFERPOOL_WORDS(BUFFERPOOL_MEDIUM_LENGTH), BUFFERPOOL_MEDIUM_BUFFERS },
+   { poolLarge[0],  BUFFERPOOL_LARGE_LENGTH,  BUFFERPOOL_WORDS(BUFFERPOOL_LARGE_LENGTH),  BUFFERPOOL_LARGE_BUFFERS  },
+};
+
+static atomicx_t  freeMap[BUFFERPOOL_CLASSES][BUFFERPOOL_MAPWORDS];  // bit set = buffer is free
+static atomicx_t  freeBuffers[BUFFERPOOL_CLASSES];
+static atomicx_t  unreservedBuffers[BUFFERPOOL_CLASSES];             // free buffers not guaranteed to a quota
+static atomicx_t  usedPeak[BUFFERPOOL_CLASSES];
+static atomicx_t  allocFail[BUFFERPOOL_CLASSES];
+
+// Private functions **********************************************************
+static bool                bufferpool_account         ( bufferpool_class_t sizeClass, bufferpool_quota_t *quota );
+static bool                bufferpool_takeUnreserved  ( bufferpool_class_t sizeClass );
+static uint8_t*            bufferpool_takeBuffer      ( bufferpool_class_t sizeClass );
+static bufferpool_class_t  bufferpool_getClass        ( uint8_t* buffer );
+static uint32_t            bufferpool_bitIndex        ( uint32_t bit );
+
+// ----------------------------------------------------------------------------
+/// \brief     Buffer pool init. Marks all buffers as free.
+///
+/// \param     none
+///
+/// \return    none
+void bufferpool_init( void )
+{
+   for( uint32_t c = 0; c < BUFFERPOOL_CLASSES; c++ )
+   {
+      for( uint32_t i = 0; i < BUFFERPOOL_MAPWORDS; i++ )
+      {
+         uint32_t buffers = ( classDesc[c].buffers > i*32u ) ? classDesc[c].buffers - i*32u : 0u;
+         atomicx_store( &freeMap[c][i], ( buffers >= 32u ) ? 0xFFFFFFFFu : ( ( 1u << buffers ) - 1u ) );
+      }
+      atomicx_store( &freeBuffers[c], classDesc[c].buffers );
+      atomicx_store( &usedPeak[c], 0 );
+      atomicx_store( &allocFail[c], 0 );
+      atomicx_storeRelease( &unreservedBuffers[c], classDesc[c].buffers );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Registers the quota of an interface. The guaranteed buffers of
+///            the quota are held back from the other interfaces. Registering
+///            a quota twice has no effect.
+///
+/// \param     [in/out] bufferpool_quota_t *quota
+///
+/// \return    1 = registered, 0 = minimum can not be guaranteed
+uint8_t bufferpool_register( bufferpool_quota_t *quota )
+{
+   uint32_t unreserved;
+   uint32_t c;
+
+   if( quota->registered )
+   {
+      return 1;
+   }
+
+   for( c = 0; c < BUFFERPOOL_CLASSES; c++ )
+   {
+      if( quota->minBuffers[c] > quota->maxBuffers[c] )
+      {
+         return 0;
+      }
+   }
+
+   // take the guaranteed buffers out of the shared budget
+   for( c = 0; c < BUFFERPOOL_CLASSES; c++ )
+   {
+      do
+      {
+         unreserved = atomicx_load( &unreservedBuffers[c] );
+         if( unreserved < quota->minBuffers[c] )
+         {
+            // give back what has been taken so far
+            while( c-- > 0 )
+            {
+               atomicx_fetchAdd( &unreservedBuffers[c], quota->minBuffers[c] );
+            }
+            return 0;
+         }
+      } while( !atomicx_compareExchange( &unreservedBuffers[c], unreserved, unreserved - quota->minBuffers[c] ) );
+
+      atomicx_store( &quota->usedBuffers[c], 0 );
+      atomicx_store( &quota->usedBuffersPeak[c], 0 );
+   }
+   atomicx_store( &quota->allocFail, 0 );
+   quota->registered = true;
+
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Allocates a buffer of at least length bytes on the quota. The
+///            smallest size class with a buffer left on the quota is used.
+///            Below the minimum of the quota the buffer is taken from its
+///            guarantee, above from the shared budget.
+///
+/// \param     [in]     uint32_t length
+/// \param     [in/out] bufferpool_quota_t *quota
+///
+/// \return    uint8_t* buffer, NULL if the quota or the pool is exhausted
+uint8_t* bufferpool_alloc( uint32_t length, bufferpool_quota_t *quota )
+{
+   for( uint32_t c = 0; c < BUFFERPOOL_CLASSES; c++ )
+   {
+      if( length > classDesc[c].length )
+      {
+         continue;
+      }
+
+      // Account the buffer first, afterwards a free buffer is guaranteed to
+      // exist.
+      if( bufferpool_account( (bufferpool_class_t)c, quota ) )
+      {
+         return bufferpool_takeBuffer( (bufferpool_class_t)c );
+      }
+      atomicx_fetchAdd( &allocFail[c], 1 );
+   }
+
+   atomicx_fetchAdd( &quota->allocFail, 1 );
+   return NULL;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Moves the first length bytes of a buffer into a buffer of a
+///            smaller size class and frees the old one, so the unused rest
+///            goes back to the pool. If no smaller class fits or has a buffer
+///            left on the quota, the buffer is kept.
+///
+/// \param     [in]     uint8_t* buffer
+/// \param     [in]     uint32_t length in use
+/// \param     [in/out] bufferpool_quota_t *quota the buffer was allocated on
+///
+/// \return    uint8_t* buffer holding the data
+uint8_t* bufferpool_shrink( uint8_t* buffer, uint32_t length, bufferpool_quota_t *quota )
+{
+   bufferpool_class_t   sizeClass = bufferpool_getClass( buffer );
+   uint8_t*             smallBuffer;
+   
+   for( uint32_t c = 0; c < sizeClass; c++ )
+   {
+      if( length <= classDesc[c].length && bufferpool_account( (bufferpool_class_t)c, quota ) )
+      {
+         smallBuffer = bufferpool_takeBuffer( (bufferpool_class_t)c );
+         memcpy( smallBuffer, buffer, length );
+         bufferpool_free( buffer, quota );
+         return smallBuffer;
+      }
+   }
+   
+   return buffer;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns a buffer to the pool.
+///
+/// \param     [in]     uint8_t* buffer, NULL is ignored
+/// \param     [in/out] bufferpool_quota_t *quota the buffer was allocated on
+///
+/// \return    none
+void bufferpool_free( uint8_t* buffer, bufferpool_quota_t *quota )
+{
+   bufferpool_class_t   c;
+   uint32_t             index;
+   uint32_t             mapWord;
+   uint32_t             used;
+
+   if( buffer == NULL )
+   {
+      return;
+   }
+
+   // Mark the buffer as free before it is given back to the budget.
+   c = bufferpool_getClass( buffer );
+   index = (uint32_t)( (uint32_t*)buffer - classDesc[c].storage ) / classDesc[c].words;
+   do
+   {
+      mapWord = atomicx_load( &freeMap[c][index/32u] );
+   } while( !atomicx_compareExchange( &freeMap[c][index/32u], mapWord, mapWord | ( 1u << ( index%32u ) ) ) );
+   atomicx_fetchAdd( &freeBuffers[c], 1 );
+
+   // Above the minimum the buffer goes back to the shared budget, below it
+   // refills the guarantee of the quota.
+   used = atomicx_fetchAdd( &quota->usedBuffers[c], (uint32_t)-1 );
+   if( used > quota->minBuffers[c] )
+   {
+      atomicx_fetchAdd( &unreservedBuffers[c], 1 );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the length of a buffer, this is the length of its size
+///            class.
+///
+/// \param     [in] uint8_t* buffer
+///
+/// \return    uint32_t length in bytes
+uint32_t bufferpool_getLength( uint8_t* buffer )
+{
+   return classDesc[bufferpool_getClass( buffer )].length;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the occupancy counters of a size class.
+///
+/// \param     [in]  bufferpool_class_t sizeClass
+/// \param     [out] bufferpool_stat_t *stat
+///
+/// \return    none
+void bufferpool_getStat( bufferpool_class_t sizeClass, bufferpool_stat_t *stat )
+{
+   stat->length      = classDesc[sizeClass].length;
+   stat->buffers     = classDesc[sizeClass].buffers;
+   stat->used        = classDesc[sizeClass].buffers - atomicx_load( &freeBuffers[sizeClass] );
+   stat->usedPeak    = atomicx_load( &usedPeak[sizeClass] );
+   stat->allocFail   = atomicx_load( &allocFail[sizeClass] );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Accounts one buffer of a size class on the quota.
+///
+/// \param     [in]     bufferpool_class_t sizeClass
+/// \param     [in/out] bufferpool_quota_t *quota
+///
+/// \return    true = accounted, false = quota or pool exhausted
+static bool bufferpool_account( bufferpool_class_t sizeClass, bufferpool_quota_t *quota )
+{
+   uint32_t used;
+   bool     burst;
+
+   for(;;)
+   {
+      used = atomicx_load( &quota->usedBuffers[sizeClass] );
+      if( used >= quota->maxBuffers[sizeClass] )
+      {
+         return false;
+      }
+
+      burst = ( used >= quota->minBuffers[sizeClass] );
+      if( burst && !bufferpool_takeUnreserved( sizeClass ) )
+      {
+         return false;
+      }
+
+      if( atomicx_compareExchange( &quota->usedBuffers[sizeClass], used, used + 1u ) )
+      {
+         atomicx_max( &quota->usedBuffersPeak[sizeClass], used + 1u );
+         return true;
+      }
+
+      // Someone else changed the quota in between, give the budget back and
+      // try again.
+      if( burst )
+      {
+         atomicx_fetchAdd( &unreservedBuffers[sizeClass], 1 );
+      }
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Takes one buffer of a size class from the shared budget.
+///
+/// \param     [in] bufferpool_class_t sizeClass
+///
+/// \return    true = taken, false = no unreserved buffer left
+static bool bufferpool_takeUnreserved( bufferpool_class_t sizeClass )
+{
+   uint32_t unreserved;
+
+   do
+   {
+      unreserved = atomicx_load( &unreservedBuffers[sizeClass] );
+      if( unreserved == 0 )
+      {
+         return false;
+      }
+   } while( !atomicx_compareExchange( &unreservedBuffers[sizeClass], unreserved, unreserved - 1u ) );
+
+   return true;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Takes a free buffer out of the bitmap of a size class. The
+///            caller has accounted the buffer before, so there is always a
+///            free one.
+///
+/// \param     [in] bufferpool_class_t sizeClass
+///
+/// \return    uint8_t* buffer
+static uint8_t* bufferpool_takeBuffer( bufferpool_class_t sizeClass )
+{
+   for(;;)
+   {
+      for( uint32_t i = 0; i < BUFFERPOOL_MAPWORDS; i++ )
+      {
+         uint32_t mapWord = atomicx_loadAcquire( &freeMap[sizeClass][i] );
+         while( mapWord != 0 )
+         {
+            uint32_t bit = mapWord & ( 0u - mapWord );
+            if( atomicx_compareExchange( &freeMap[sizeClass][i], mapWord, mapWord & ~bit ) )
+            {
+               uint32_t free = atomicx_fetchAdd( &freeBuffers[sizeClass], (uint32_t)-1 ) - 1u;
+               atomicx_max( &usedPeak[sizeClass], classDesc[sizeClass].buffers - free );
+               return (uint8_t*)&classDesc[sizeClass].storage[( i*32u + bufferpool_bitIndex( bit ) ) * classDesc[sizeClass].words];
+            }
+            mapWord = atomicx_loadAcquire( &freeMap[sizeClass][i] );
+         }
+      }
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the size class a buffer belongs to.
+///
+/// \param     [in] uint8_t* buffer
+///
+/// \return    bufferpool_class_t size class
+static bufferpool_class_t bufferpool_getClass( uint8_t* buffer )
+{
+   uint32_t *word = (uint32_t*)buffer;
+
+   if( word >= poolSmall[0] && word < poolSmall[0] + sizeof(poolSmall)/4u )
+   {
+      return BUFFERPOOL_SMALL;
+   }
+   if( word >= poolMedium[0] && word < poolMedium[0] + sizeof(poolMedium)/4u )
+   {
+      return BUFFERPOOL_MEDIUM;
+   }
+   return BUFFERPOOL_LARGE;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the position of a single set bit.
+///
+/// \param     [in] uint32_t bit
+///
+/// \return    uint32_t bit position
+static uint32_t bufferpool_bitIndex( uint32_t bit )
+{
+#if defined(HOST_BUILD)
+   return (uint32_t)__builtin_ctz( bit );
+#else
+   return 31u - __CLZ( bit );
+#endif
+}
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
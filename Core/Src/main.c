@@ -30,11 +30,25 @@
 #include "usb_device.h"
 #include "usb_device.h"
 #include "queuex.h"
+#include "bufferpool.h"
 #include "rs485.h"
 
 // Private typedef *************************************************************
 
 // Private define *************************************************************
+// buffers per size class { small, medium, large }
+#define UARTQUEUE_MINBUFFERS     { 16u, 4u, 6u }   // guaranteed buffers of the uart to usb direction
+#define UARTQUEUE_MAXBUFFERS     { 96u, 12u, 16u } // burst ceiling of the uart to usb direction
+#define USBQUEUE_MINBUFFERS      { 16u, 4u, 6u }   // guaranteed buffers of the usb to uart direction
+#define USBQUEUE_MAXBUFFERS      { 96u, 12u, 16u } // burst ceiling of the usb to uart direction
+#define QUEUE_SERVICE            SERVICE_STRICT    // service of the priority classes of both queues
+#define QUEUE_LOWDEPTHLIMIT      ( 32u )           // background frames may not fill up a queue
+#define UARTQUEUE_DROPPOLICY     POLICY_TAILDROP   // overload policy of the uart to usb direction
+#define USBQUEUE_DROPPOLICY      POLICY_CODEL      // keeps the latency of the slow rs485 leg low
+#define UARTQUEUE_FLAG           ( 1u << 0 )       // thread flag of the rndis task, uart queue has work
+#define USBQUEUE_FLAG            ( 1u << 1 )       // thread flag of the rndis task, usb queue has work
+#define QUEUE_RETRYTICKS         ( 1u )            // a frame the output has not taken is tried again after
+#define WAKEUP_LATENCYBUDGET     ( 20u )           // us from the wake up of the sleeping rndis task to its queue managers, below a 64 byte full speed packet
 
 // Private variables **********************************************************
 /* Definitions for defaultTask */
@@ -54,11 +68,20 @@ const osEventFlagsAttr_t myEvent01_attributes = {
 // queue declerations
 queue_handle_t uartQueue;
 queue_handle_t usbQueue;
+
+// wake-up latency of the rndis task, cpu cycles from the first wake up of
+// the sleeping task to the queue managers
+static volatile bool     rndisTaskSleeping = false;
+static volatile uint32_t wakeupTimestamp = 0;
+uint32_t                 wakeupLatencyMax = 0;
+uint32_t                 wakeupLatencyOverBudget = 0;   // wake ups above WAKEUP_LATENCYBUDGET
    
 
 // Private function prototypes ************************************************
 void SystemClock_Config   ( void );
 void startRndisTask       ( void *argument );
+static void wakeupRndisTask      ( queue_handle_t *queueHandle );
+static bool isQueuePending       ( queue_handle_t *queueHandle );
 
 // Private functions **********************************************************
 
@@ -147,26 +170,136 @@ void SystemClock_Config( void )
 /// \return    none
 void startRndisTask( void *argument )
 {
-   // init peripherals
-   rs485_init();
-   usb_init();
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   // init the frame buffers shared by both queues
+   bufferpool_init();
+#endif
    
    // set the queue on the uart io
-   uartQueue.messageDirection  = UART_TO_USB;
-   uartQueue.output            = usb_output;
-   queue_init(&uartQueue);
+   uartQueue.messageDirection          = UART_TO_USB;
+   uartQueue.headroom                  = USB_TX_HEADROOM;
+   uartQueue.tailroom                  = USB_TX_TAILROOM;
+   uartQueue.output                    = usb_output;
+   uartQueue.outputBatch               = usb_outputBatch;
+   uartQueue.outputAbort               = usb_outputAbort;
+   uartQueue.outputProgress            = usb_outputProgress;
+   uartQueue.outputDrop                = usb_outputDrop;
+   uartQueue.inputResume               = rs485_rxResume;
+   uartQueue.inputDrop                 = rs485_rxDrop;
+   uartQueue.wakeup                    = wakeupRndisTask;
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   uartQueue.bufferQuota               = (bufferpool_quota_t){ .minBuffers = UARTQUEUE_MINBUFFERS, .maxBuffers = UARTQUEUE_MAXBUFFERS };
+   uartQueue.classify                  = queue_classify;
+   uartQueue.service                   = QUEUE_SERVICE;
+   uartQueue.priorityClass[PRIORITY_LOW].depthLimit = QUEUE_LOWDEPTHLIMIT;
+   uartQueue.dropPolicy                = UARTQUEUE_DROPPOLICY;
+#endif
+   if( queue_init(&uartQueue) != 1 )
+   {
+      Error_Handler();
+   }
    
    // set the queue on the usb io
-   usbQueue.messageDirection   = USB_TO_UART;
-   usbQueue.output             = rs485_output;  
-   queue_init(&usbQueue);
+   usbQueue.messageDirection           = USB_TO_UART;
+   usbQueue.headroom                   = RS485_TX_HEADROOM;
+   usbQueue.tailroom                   = RS485_TX_TAILROOM;
+   usbQueue.output                     = rs485_output;  
+   usbQueue.outputAbort                = rs485_outputAbort;
+   usbQueue.outputProgress             = rs485_outputProgress;
+   usbQueue.outputDrop                 = rs485_outputDrop;
+   usbQueue.inputResume                = usb_rxResume;
+   usbQueue.wakeup                     = wakeupRndisTask;
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   usbQueue.bufferQuota                = (bufferpool_quota_t){ .minBuffers = USBQUEUE_MINBUFFERS, .maxBuffers = USBQUEUE_MAXBUFFERS };
+   usbQueue.classify                   = queue_classify;
+   usbQueue.service                    = QUEUE_SERVICE;
+   usbQueue.priorityClass[PRIORITY_LOW].depthLimit = QUEUE_LOWDEPTHLIMIT;
+   usbQueue.dropPolicy                 = USBQUEUE_DROPPOLICY;
+#endif
+   if( queue_init(&usbQueue) != 1 )
+   {
+      Error_Handler();
+   }
    
-   // loop forever and check for messages to be ready to send from the queues
+   // init peripherals, they take their receive buffers from the queues
+   rs485_init();
+   usb_init();
+   
+   // the cycle counter measures the wake-up latency
+   CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+   
+   // loop forever and send the messages which are ready in the queues, in
+   // between sleep until an enqueue or a tx complete wakes up the task
    for(;;)
    {
+      // Only a wake up of the sleeping task is timed. Once the flag is
+      // cleared no irq writes the timestamp anymore, so it is read and
+      // cleared without losing a sample.
+      rndisTaskSleeping = false;
+      uint32_t timestamp = wakeupTimestamp;
+      if( timestamp != 0 )
+      {
+         uint32_t latency = DWT->CYCCNT - timestamp;
+         
+         wakeupTimestamp = 0;
+         if( latency > wakeupLatencyMax )
+         {
+            wakeupLatencyMax = latency;
+         }
+         if( latency > WAKEUP_LATENCYBUDGET * ( SystemCoreClock / 1000000u ) )
+         {
+            wakeupLatencyOverBudget++;
+         }
+      }
+      
       queue_manager( &uartQueue );
       queue_manager( &usbQueue );
+      usb_ctrlManager();
+      
+      // A frame the output has not taken (peripheral busy) gets no wake up,
+      // it is tried again after a tick.
+      rndisTaskSleeping = true;
+      if( isQueuePending( &uartQueue ) || isQueuePending( &usbQueue ) )
+      {
+         osThreadFlagsWait( UARTQUEUE_FLAG | USBQUEUE_FLAG, osFlagsWaitAny, QUEUE_RETRYTICKS );
+      }
+      else
+      {
+         osThreadFlagsWait( UARTQUEUE_FLAG | USBQUEUE_FLAG, osFlagsWaitAny, osWaitForever );
+      }
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Wakes up the rndis task, linked to the queues. Called from the
+///            peripheral irq's and the task. The thread flags are task
+///            notifications, they are set directly from an irq (event flags
+///            would be deferred to the timer task).
+///
+/// \param     [in] queue_handle_t *queueHandle
+///
+/// \return    none
+static void wakeupRndisTask( queue_handle_t *queueHandle )
+{
+   // a wake up while the task runs its queue managers is no latency
+   if( rndisTaskSleeping && wakeupTimestamp == 0 )
+   {
+      wakeupTimestamp = DWT->CYCCNT | 1u;
    }
+   osThreadFlagsSet( rndisTaskHandle, ( queueHandle == &uartQueue ) ? UARTQUEUE_FLAG : USBQUEUE_FLAG );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Checks if a queue holds frames without a transmission in
+///            progress, so no tx complete will wake up the task.
+///
+/// \param     [in] queue_handle_t *queueHandle
+///
+/// \return    true = frames pending
+static bool isQueuePending( queue_handle_t *queueHandle )
+{
+   return queue_getLength( queueHandle ) != 0 && queueHandle->queueStatus == TAIL_UNBLOCKED;
 }
 
 // ----------------------------------------------------------------------------
@@ -8,6 +8,30 @@
 ///            memory for the sake of performance. The parameters are in the 
 ///            header file. There the parameters for the ringbuffer length and
 ///            buffer length can be set.
+///            The queue is lock-free: head and tail index are single writer,
+///            the message objects are handed over with acquire/release
+///            ordering (see atomicx.h). queue_enqueue is the zero copy single
+///            producer path, queue_enqueueMulti the copying multi producer
+///            path for several irq's feeding the same queue.
+///            The frame buffers are not part of the queue, they are taken
+///            from the shared buffer pool (see bufferpool.h) through the quota
+///            of the queue and go back to the pool after the transmission.
+///            Short frames are moved into a small buffer at enqueue time, when
+///            their length is known (copy-break).
+///            Producers like a dma can also receive into a reservation and
+///            commit the frame with its real length (queue_reserve,
+///            queue_commit, queue_abort).
+///            Each queue has priority classes with an own ringbuffer, depth
+///            limit and counters. The class of a frame is chosen at enqueue
+///            time by the classifier of the queue (e.g. queue_classify on
+///            EtherType, VLAN PCP and IPv4 DSCP). The queue manager serves
+///            the classes with strict priority or weighted round robin.
+///            On overload a class drops the new frame (tail drop), its oldest
+///            frame (drop oldest) or the frames which wait too long at the
+///            output (codel). The drops are counted per reason.
+///            This is the slot backend, see queuex_bip.c for the contiguous
+///            byte ring backend. The backend is selected with QUEUE_BACKEND
+///            in queuex.h.
 ///
 /// \author    Nico Korn
 ///
@@ -55,215 +79,1384 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(HOST_BUILD)
+#include <time.h>
+#endif
+
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
 
 // Private define *************************************************************
+#define QUEUE_NOCLASS                     ( PRIORITY_CLASSES )
 
 // Private types     **********************************************************
 
 // Private variables **********************************************************
 
 // Private functions **********************************************************
+static inline uint32_t  queue_nextIndex      ( uint32_t index );
+static inline uint32_t  queue_usedSlots      ( uint32_t headIndex, uint32_t tailIndex );
+static queue_class_t*   queue_getClass       ( queue_handle_t *queueHandle, const uint8_t* dataStart, uint16_t dataLength );
+static bool             queue_claimSlot      ( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t *slotIndex );
+static bool             queue_claimOrDrop    ( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t *slotIndex );
+static bool             queue_dropOldest     ( queue_handle_t *queueHandle, queue_class_t *queueClass, queue_dropreason_t reason );
+static void             queue_countDrop      ( queue_handle_t *queueHandle, queue_class_t *queueClass, queue_dropreason_t reason );
+static void             queue_codel          ( queue_handle_t *queueHandle, queue_class_t *queueClass );
+static uint32_t         queue_codelNext      ( uint32_t time, uint32_t interval, uint32_t count );
+static inline uint32_t  queue_usToTicks      ( uint32_t us );
+static inline uint32_t  queue_bufferLength   ( queue_handle_t *queueHandle, uint32_t length );
+static uint8_t          queue_commitFrame    ( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle, bool shrink );
+static void             queue_publishSlot    ( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t slotIndex, uint8_t* data, uint8_t* dataStart, uint16_t dataLength );
+static bool             queue_isReady        ( queue_class_t *queueClass );
+static void             queue_notifyDrop     ( queue_handle_t *queueHandle, uint8_t* dataStart );
+static uint32_t         queue_selectClass    ( queue_handle_t *queueHandle );
 
 // ----------------------------------------------------------------------------
-/// \brief     Queue init.
+/// \brief     Queue init. Has to be called before the producers and the
+///            consumer of the queue are started, no irq is masked. The quota
+///            of the queue has to be set and the buffer pool initialised
+///            before. To drop the queued frames at runtime, e.g. on a usb
+///            reset, use queue_flush.
 ///
 /// \param     [in/out] queue_handle_t *queueHandle
 ///
-/// \return    none
-void queue_init( queue_handle_t *queueHandle )
+/// \return    1 = success, 0 = quota not available
+uint8_t queue_init( queue_handle_t *queueHandle )
 {   
-   // disable irq to avoid racing conditions
-   __disable_irq(); 
+   // block the tail, so the queue manager does not start a transmission
+   // while the queue is being reset
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_BLOCKED );
    
    // init statistics to 0
-   queueHandle->dataPacketsIN          = 0;
-   queueHandle->bytesIN                = 0;
+   atomicx_store( &queueHandle->dataPacketsIN, 0 );
+   atomicx_store( &queueHandle->bytesIN, 0 );
    queueHandle->dataPacketsOUT         = 0;
    queueHandle->bytesOUT               = 0;
-   queueHandle->queueFull              = 0;
-   queueHandle->queueLengthPeak        = 0;
-   queueHandle->queueLength            = 0;
-   queueHandle->headIndex              = QUEUELENGTH;
-   queueHandle->tailIndex              = QUEUELENGTH;
+   atomicx_store( &queueHandle->frameCounter, 0 );
+   atomicx_store( &queueHandle->queueFull, 0 );
+   for( uint32_t r = 0; r < DROP_REASONS; r++ )
+   {
+      atomicx_store( &queueHandle->dropCounter[r], 0 );
+   }
+   atomicx_store( &queueHandle->queueLength, 0 );
+   atomicx_store( &queueHandle->queueLengthPeak, 0 );
+   queueHandle->tailError              = 0;
+   queueHandle->spuriousError          = 0;
+   atomicx_store( &queueHandle->txFrames, 0 );
+   queueHandle->txTimestamp            = 0;
+   memset( &queueHandle->waitHistogram, 0, sizeof(queue_histogram_t) );
+   memset( &queueHandle->serviceHistogram, 0, sizeof(queue_histogram_t) );
    
-   // cleanup the queue
-   for( uint8_t i = 0; i < QUEUELENGTH; i++ )
+   // the guaranteed buffers of the queue are reserved once
+   if( bufferpool_register( &queueHandle->bufferQuota ) != 1 )
    {
-      memset( queueHandle->queue[i].data, 0x00, QUEUEBUFFERLENGTH );
-      queueHandle->queue[i].dataLength       = 0;
-      queueHandle->queue[i].messageStatus    = EMPTY_TX;
-      queueHandle->queue[i].dataStart        = NULL;
+      return 0;
+   }
+   
+   // cleanup the classes, buffers of queued frames go back to the pool
+   for( uint32_t c = 0; c < PRIORITY_CLASSES; c++ )
+   {
+      queue_class_t *queueClass = &queueHandle->priorityClass[c];
+      
+      for( uint8_t i = 0; i < QUEUELENGTH; i++ )
+      {
+         bufferpool_free( queueClass->queue[i].data, &queueHandle->bufferQuota );
+         queueClass->queue[i].data           = NULL;
+         queueClass->queue[i].dataOffset     = 0;
+         queueClass->queue[i].dataLength     = 0;
+         atomicx_store( &queueClass->queue[i].messageStatus, EMPTY_TX );
+      }
+      atomicx_store( &queueClass->headIndex, 0 );
+      atomicx_store( &queueClass->tailIndex, 0 );
+      atomicx_store( &queueClass->dataPacketsIN, 0 );
+      queueClass->dataPacketsOUT       = 0;
+      atomicx_store( &queueClass->queueFull, 0 );
+      atomicx_store( &queueClass->queueLengthPeak, 0 );
+      queueClass->waitMax              = 0;
+      queueClass->credit               = queueClass->weight;
+      queueClass->codelFirstAbove      = 0;
+      queueClass->codelDropNext        = 0;
+      queueClass->codelCount           = 0;
+      queueClass->codelDropping        = false;
    }
+   queueHandle->serviceClass           = 0;
+   queueHandle->txClass                = 0;
+   
+#if !defined(HOST_BUILD)
+   // the cycle counter timestamps the frames
+   CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
    
    // queue status - the tail is used to transmitt messages. As long as the
    // peripheral is sending the tail thus the queue status remains TAIL_BLOCKED 
    // because of doing zero opy. After a transmission has been completed the 
-   // queue status will be set back to TAIL_UNBLOCKED.
-   queueHandle->queueStatus            = TAIL_UNBLOCKED;
+   // queue status will be set back to TAIL_UNBLOCKED. The release publishes
+   // the reset queue to all contexts.
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
    
-   // disable irq
-   __enable_irq(); 
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Drops the queued frames at runtime, while the producers and the
+///            queue manager go on. Called from the context of the output
+///            completion, e.g. the usb irq when the host resets the
+///            configuration. The frames of a transmission the output has
+///            aborted are released first, as if they were sent. Then the
+///            waiting frames are dropped at the tails like with drop oldest,
+///            a frame which the queue manager is handing to the output at the
+///            same time stays and is released by the output.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint16_t aborted, frames handed to the output which
+///                      will not complete
+///
+/// \return    none
+void queue_flush( queue_handle_t *queueHandle, uint16_t aborted )
+{
+   queue_class_t  *queueClass = &queueHandle->priorityClass[queueHandle->txClass];
+   uint32_t       index = atomicx_load( &queueClass->tailIndex );
+   
+   // A frame of the aborted transmission may still be received by its
+   // producer, both sides let go of it before its buffer is freed.
+   for( uint16_t i = 0; i < aborted && index != atomicx_loadAcquire( &queueClass->headIndex ); i++ )
+   {
+      queue_notifyDrop( queueHandle, &queueClass->queue[index].data[queueClass->queue[index].dataOffset] );
+      index = queue_nextIndex( index );
+   }
+   if( aborted != 0 )
+   {
+      queue_dequeueBatch( queueHandle, aborted );
+   }
+   
+   for( uint32_t c = 0; c < PRIORITY_CLASSES; c++ )
+   {
+      while( queue_dropOldest( queueHandle, &queueHandle->priorityClass[c], DROP_FLUSH ) )
+      {
+      }
+   }
 }
 
 // ----------------------------------------------------------------------------
 /// \brief     The queue manager checks for available data to send, and calls
 ///            the linked peripheral output interface. NOTE! You have to provide
 ///            and link an output interface function before calling this
-///            function.
+///            function. The class to serve is chosen with the service
+///            discipline of the queue. If the peripheral links a batch
+///            output, the ready frames behind the tail of the class (up to
+///            QUEUEBATCHLENGTH) are handed over at once.
 ///
 /// \param     [in/out] queue_handle_t *queueHandle
 ///
 /// \return    none
 inline void queue_manager( queue_handle_t *queueHandle )
 {      
+   queue_class_t  *queueClass;
+   queue_obj_t    *queueObj;
+   uint32_t       classIndex;
+   uint32_t       first;
+   uint32_t       index;
+   uint32_t       maxCount;
+   uint32_t       timestamp;
+   uint16_t       count = 0;
+   uint16_t       taken;
+   
    // If the queue status is set to a blocked tail return.
-   if( queueHandle->queueStatus != TAIL_UNBLOCKED )
+   if( atomicx_loadAcquire( &queueHandle->queueStatus ) != TAIL_UNBLOCKED )
+   {
+      return;
+   }
+   
+   classIndex = queue_selectClass( queueHandle );
+   if( classIndex == QUEUE_NOCLASS )
    {
       return;
    }
+   queueClass = &queueHandle->priorityClass[classIndex];
+   
+   // Codel drops the frames at the tail of the class which waited too long,
+   // the class may be empty afterwards.
+   if( queueHandle->dropPolicy == POLICY_CODEL )
+   {
+      queue_codel( queueHandle, queueClass );
+      if( !queue_isReady( queueClass ) )
+      {
+         return;
+      }
+   }
    
-   // Check if tail and header index are ok and if the message object in the 
-   // queue is ready for transmission.
-   if( queueHandle->tailIndex < queueHandle->headIndex 
-      && queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].messageStatus == READY_FOR_TX )
+   // A batch takes the contiguous ready frames of the class, with weighted
+   // service not more than the class has left in this round.
+   maxCount = ( queueHandle->outputBatch != NULL ) ? QUEUEBATCHLENGTH : 1u;
+   if( queueHandle->service == SERVICE_WEIGHTED && queueClass->credit < maxCount )
    {
-      // To avoid racing conditions, immediately block the tail and set the
-      // message status to processing.
-      queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].messageStatus = PROCESSING_TX;
-      queueHandle->queueStatus = TAIL_BLOCKED;
+      maxCount = queueClass->credit;
+   }
+   
+   // Set the message status to processing before the peripheral is started,
+   // the tx complete irq may fire immediately. The acquire in queue_isReady
+   // pairs with the release of the producer, the slot is valid afterwards.
+   // The first slot is taken with a compare and exchange, a producer with
+   // drop oldest policy may drop it at the same time. The slots behind it can
+   // not be dropped as long as it is processed.
+   timestamp = queue_getTimestamp();
+   first = atomicx_load( &queueClass->tailIndex );
+   if( !atomicx_compareExchange( &queueClass->queue[first].messageStatus, READY_FOR_TX, PROCESSING_TX ) )
+   {
+      return;
+   }
+   index = first;
+   do
+   {
+      queueObj = &queueClass->queue[index];
+      atomicx_store( &queueObj->messageStatus, PROCESSING_TX );
+      queueHandle->txBatch[count].dataStart  = &queueObj->data[queueObj->dataOffset];
+      queueHandle->txBatch[count].dataLength = queueObj->dataLength;
+      if( timestamp - queueObj->timestamp > queueClass->waitMax )
+      {
+         queueClass->waitMax = timestamp - queueObj->timestamp;
+      }
+      index = queue_nextIndex( index );
+      count++;
+   } while( count < maxCount
+           && index != atomicx_loadAcquire( &queueClass->headIndex )
+           && atomicx_loadAcquire( &queueClass->queue[index].messageStatus ) == READY_FOR_TX );
+   
+   // Block the tail.
+   queueHandle->txClass = classIndex;
+   queueHandle->txTimestamp = timestamp;
+   atomicx_store( &queueHandle->txFrames, count );
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_BLOCKED );
+   
+   // Send the frames with the linked output function provided by the
+   // communication peripheral.
+   if( queueHandle->outputBatch != NULL )
+   {
+      taken = queueHandle->outputBatch( queueHandle->txBatch, count );
+   }
+   else
+   {
+      taken = queueHandle->output( queueHandle->txBatch[0].dataStart, queueHandle->txBatch[0].dataLength );
+   }
+   queueClass->credit -= ( queueClass->credit > taken ) ? taken : queueClass->credit;
+   
+   if( taken < count )
+   {
+      // Peripheral is busy, set back the frames it has not taken. They are
+      // behind the taken ones, the tx complete irq does not touch them. The
+      // tail is not read again, the irq may have released the taken frames
+      // and moved it on already.
+      index = first;
+      for( uint16_t i = 0; i < taken; i++ )
+      {
+         index = queue_nextIndex( index );
+      }
+      for( uint16_t i = taken; i < count; i++ )
+      {
+         atomicx_store( &queueClass->queue[index].messageStatus, READY_FOR_TX );
+         index = queue_nextIndex( index );
+      }
       
-      // Send the frame with the linked output function provided by the
-      // communication peripheral.
-      if( queueHandle->output( queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].dataStart, queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].dataLength ) != 1 )
+      // If the taken frames are already released (or none was taken), the
+      // tail is unblocked here.
+      if( atomicx_fetchAdd( &queueHandle->txFrames, (uint32_t)-( count - taken ) ) == (uint32_t)( count - taken ) )
       {
-         // Peripheral is busy, set back states.
-         queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].messageStatus = READY_FOR_TX;
-         queueHandle->queueStatus = TAIL_UNBLOCKED;
+         atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
       }
    }
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     The queue manager checks for available data to send, and calls
-///            the linled output interface.
+/// \brief     Releases the tail slot after the linked output interface has
+///            completed the transmission. Called from the tx complete
+///            callback of the peripheral.
 ///
 /// \param     [in/out] queue_handle_t *queueHandle
 ///
 /// \return    none
 inline void queue_dequeue( queue_handle_t *queueHandle )
 {   
-   // Transmission complete unblock the tail.
-   queueHandle->queueStatus = TAIL_UNBLOCKED;
-  
-   if( queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].messageStatus != PROCESSING_TX )
-   {
-      // Spurious error check for debugging
-      queueHandle->spuriousError++;
-      return;
-   }
+   queue_dequeueBatch( queueHandle, 1 );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Releases count slots at the tail after the linked output
+///            interface has completed their transmission. The tail is
+///            unblocked when all frames handed to the output are released,
+///            so a peripheral may release a batch at once or frame by frame.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint16_t count
+///
+/// \return    none
+void queue_dequeueBatch( queue_handle_t *queueHandle, uint16_t count )
+{
+   queue_class_t  *queueClass = &queueHandle->priorityClass[queueHandle->txClass];
+   uint32_t       tailIndex = atomicx_load( &queueClass->tailIndex );
+   uint32_t       now = queue_getTimestamp();
+   uint16_t       released = 0;
    
-   // Check if tail and head index are ok.
-   if( queueHandle->tailIndex < queueHandle->headIndex )
+   while( released < count )
    {
+      queue_obj_t *queueObj = &queueClass->queue[tailIndex];
+      
+      if( atomicx_load( &queueObj->messageStatus ) != PROCESSING_TX )
+      {
+         // Spurious error check for debugging
+         queueHandle->spuriousError++;
+         break;
+      }
+      
+      // Check if tail and head index are ok.
+      if( tailIndex == atomicx_loadAcquire( &queueClass->headIndex ) )
+      {
+         queueHandle->tailError++;
+         break;
+      }
+      
       // Update queue statistics.
       queueHandle->dataPacketsOUT++;
-      queueHandle->bytesOUT += queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].dataLength; // note: this are the frame bytes without preamble and crc value
+      queueHandle->bytesOUT += queueObj->dataLength; // note: this are the frame bytes without preamble and crc value
+      queueClass->dataPacketsOUT++;
+      queue_histogramAdd( &queueHandle->waitHistogram, queueHandle->txTimestamp - queueObj->timestamp );
+      queue_histogramAdd( &queueHandle->serviceHistogram, now - queueHandle->txTimestamp );
       
-      // Set message status.
-      queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].data[0] = 0x00;
-      queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].messageStatus = EMPTY_TX;
+      // Give the buffer back to the pool and set message status.
+      bufferpool_free( queueObj->data, &queueHandle->bufferQuota );
+      queueObj->data = NULL;
+      atomicx_store( &queueObj->messageStatus, EMPTY_TX );
       
-      // Set tail number.
-      queueHandle->tailIndex++;
-      
-      // set queue length
-      queueHandle->queueLength = queueHandle->headIndex - queueHandle->tailIndex;
+      tailIndex = queue_nextIndex( tailIndex );
+      released++;
    }
-   else
+   
+   // Hand the slots back to the producers, the release makes sure the slots
+   // are cleaned up before a producer can claim them again.
+   atomicx_storeRelease( &queueClass->tailIndex, tailIndex );
+   atomicx_fetchAdd( &queueHandle->queueLength, (uint32_t)-released );
+   
+   // Transmission complete unblock the tail.
+   if( released == 0 || atomicx_fetchAdd( &queueHandle->txFrames, (uint32_t)-released ) == released )
    {
-      queueHandle->tailError++;
+      atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
+      if( queueHandle->wakeup != NULL )
+      {
+         queueHandle->wakeup( queueHandle );
+      }
+   }
+   
+   // A producer waiting for room can go on.
+   if( released != 0 && queueHandle->inputResume != NULL )
+   {
+      queueHandle->inputResume();
    }
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     Enqueue a new message into the ringbuffer. If the ringbuffer is
-///            full, the slot will be used again until the head can move
-///            forward.
+/// \brief     Enqueue a new message into the ringbuffer of its class. If the
+///            class is full or the quota of the queue is exhausted, the
+///            receive buffer will be used again until the head can move
+///            forward. This is the zero copy single producer path: the
+///            producer receives directly into the head buffer, so only one
+///            context may enqueue into the queue with this function.
+///            Short frames are copied into a buffer of a smaller size class
+///            (copy-break) and the head buffer is kept for the next
+///            reception, so a short frame does not hold a full ethernet frame
+///            buffer while it waits in the queue.
 ///
+/// \param     [in]     uint8_t* dataStart
+/// \param     [in]     uint16_t dataLength
 /// \param     [in/out] queue_handle_t *queueHandle
 ///
 /// \return    uint8_t* data pointer
 inline uint8_t* queue_enqueue( uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
 {
-   // Integer type wrap arround check and set for head and tail index.
-   if( queueHandle->headIndex < QUEUELENGTH )
+   queue_class_t  *queueClass;
+   uint32_t       slotIndex;
+   uint32_t       frameOffset;
+   uint8_t*       buffer;
+   
+   // The frame keeps its offset in the buffer, so the room in front of it
+   // (e.g. for the header of the output interface) is kept too.
+   frameOffset = (uint32_t)( dataStart - queueHandle->headBuffer );
+   queueClass = queue_getClass( queueHandle, dataStart, dataLength );
+   if( frameOffset < queueHandle->headroom )
+   {
+      queue_countDrop( queueHandle, queueClass, DROP_FULL );
+      return queueHandle->headBuffer;
+   }
+   
+   // A short frame gets a buffer of its size, a long frame needs a new
+   // receive buffer before it can be handed over.
+   buffer = bufferpool_alloc( queue_bufferLength( queueHandle, frameOffset + dataLength ), &queueHandle->bufferQuota );
+   if( buffer == NULL )
    {
-      queueHandle->headIndex += QUEUELENGTH;
-      queueHandle->tailIndex += QUEUELENGTH;
+      // No buffer, return old pointer.
+      queue_countDrop( queueHandle, queueClass, DROP_NOBUFFER );
+      return queueHandle->headBuffer;
    }
    
    // Ringbuffer not full?
-   if( (queueHandle->headIndex - queueHandle->tailIndex) < QUEUELENGTH-1 )
+   if( !queue_claimOrDrop( queueHandle, queueClass, &slotIndex ) )
    {
-      // Get actual index in the ringbuffer.
-      uint8_t arrayIndex = queueHandle->headIndex%QUEUELENGTH;
-      
-      // Set data length in the message object.
-      queueHandle->queue[arrayIndex].dataLength = dataLength;
-      
-      // Set data start pointer in the databuffer of the message object.
-      queueHandle->queue[arrayIndex].dataStart = dataStart;
-      
-      // Set message status in the message object.
-      queueHandle->queue[arrayIndex].messageStatus = READY_FOR_TX;
-      
-      // Update queue statistics.
-      queueHandle->frameCounter++;
-      queueHandle->dataPacketsIN++;
-      queueHandle->bytesIN += dataLength;
-      if( queueHandle->queueLength > queueHandle->queueLengthPeak )
+      // Queue is full, return old pointer.
+      bufferpool_free( buffer, &queueHandle->bufferQuota );
+      return queueHandle->headBuffer;
+   }
+   
+   if( bufferpool_getLength( buffer ) < QUEUEBUFFERLENGTH )
+   {
+      // Copy the short frame, the head buffer stays the receive buffer.
+      memcpy( &buffer[frameOffset], dataStart, dataLength );
+      queue_publishSlot( queueHandle, queueClass, slotIndex, buffer, &buffer[frameOffset], dataLength );
+   }
+   else
+   {
+      // Hand the received buffer over to the message object.
+      queue_publishSlot( queueHandle, queueClass, slotIndex, queueHandle->headBuffer, dataStart, dataLength );
+      queueHandle->headBuffer = buffer;
+   }
+
+   // Return new pointer.
+   return queueHandle->headBuffer;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Enqueue a copy of a message into the ringbuffer of its class.
+///            This is the multi producer path: several irq's may enqueue into
+///            the same queue concurrently, each producer takes its own buffer
+///            from the pool and claims its own slot. The copy is placed
+///            behind the headroom of the output, QUEUEFRAMEALIGN past a word.
+///
+/// \param     [in]     const uint8_t* data
+/// \param     [in]     uint16_t dataLength
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = enqueued, 0 = queue full or frame too long
+uint8_t queue_enqueueMulti( const uint8_t* data, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   queue_class_t  *queueClass;
+   uint32_t       slotIndex;
+   uint32_t       offset;
+   uint8_t*       buffer;
+   
+   queueClass = queue_getClass( queueHandle, data, dataLength );
+   offset = QUEUE_FRAMEOFFSET( (uint32_t)queueHandle->headroom );
+   if( offset + dataLength + queueHandle->tailroom > QUEUEBUFFERLENGTH )
+   {
+      queue_countDrop( queueHandle, queueClass, DROP_FULL );
+      return 0;
+   }
+   
+   buffer = bufferpool_alloc( queue_bufferLength( queueHandle, offset + dataLength ), &queueHandle->bufferQuota );
+   if( buffer == NULL )
+   {
+      queue_countDrop( queueHandle, queueClass, DROP_NOBUFFER );
+      return 0;
+   }
+   
+   if( !queue_claimOrDrop( queueHandle, queueClass, &slotIndex ) )
+   {
+      bufferpool_free( buffer, &queueHandle->bufferQuota );
+      return 0;
+   }
+   
+   // The slot is owned by this producer until it is published.
+   memcpy( &buffer[offset], data, dataLength );
+   queue_publishSlot( queueHandle, queueClass, slotIndex, buffer, &buffer[offset], dataLength );
+   
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Reserves a buffer of at least maxLength bytes for a producer,
+///            e.g. as target of a dma. The frame is received directly into
+///            the buffer and handed over with queue_commit, no head buffer is
+///            involved. A reservation which is still held is returned again.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint16_t maxLength
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* reserved buffer, NULL = quota of the queue exhausted
+uint8_t* queue_reserve( queue_reservation_t *reservation, uint16_t maxLength, queue_handle_t *queueHandle )
+{
+   if( reservation->buffer != NULL )
+   {
+      if( reservation->length >= maxLength )
       {
-         queueHandle->queueLengthPeak = queueHandle->queueLength;
+         return reservation->buffer;
       }
-      
-      // Increment absolute head index
-      queueHandle->headIndex++;
-      
-      // set queue length
-      queueHandle->queueLength = queueHandle->headIndex - queueHandle->tailIndex;
-      
-      // Set receiving state on the queue object.
-      queueHandle->queue[queueHandle->headIndex%QUEUELENGTH].messageStatus = RECEIVING_RX;
+      queue_abort( reservation, queueHandle );
+   }
+   
+   reservation->buffer = bufferpool_alloc( maxLength, &queueHandle->bufferQuota );
+   reservation->length = ( reservation->buffer != NULL ) ? maxLength : 0;
+   
+   return reservation->buffer;
+}
 
-      // Return new pointer.
-      return queueHandle->queue[queueHandle->headIndex%QUEUELENGTH].data;
+// ----------------------------------------------------------------------------
+/// \brief     Commits a frame which has been received into a reservation. The
+///            frame may be shorter than reserved, the unused rest of the
+///            buffer goes back to the pool. Several producers may commit
+///            into the same queue concurrently, each with its own
+///            reservation. If the class of the frame is full, the frame is
+///            dropped and the reservation is kept for the next frame.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint8_t* dataStart, inside the reserved buffer
+/// \param     [in]     uint16_t dataLength
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = enqueued, 0 = dropped
+uint8_t queue_commit( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   return queue_commitFrame( reservation, dataStart, dataLength, queueHandle, true );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Commits a frame which is still being received into the
+///            reservation, for cut-through forwarding. The buffer keeps its
+///            size and is not exchanged for a smaller one, so the producer
+///            goes on writing the rest of the frame while the output may
+///            already send it. A frame which turns out bad is ended with
+///            queue_abortStream.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint8_t* dataStart, inside the reserved buffer
+/// \param     [in]     uint16_t dataLength, the full length of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = enqueued, 0 = dropped
+uint8_t queue_commitStream( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   return queue_commitFrame( reservation, dataStart, dataLength, queueHandle, false );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Tells the output that a frame of queue_commitStream has turned
+///            out bad, e.g. it ended short. The output ends the frame with a
+///            framing error, the frame is released as usual on its tx
+///            complete.
+///
+/// \param     [in]     uint8_t* dataStart of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_abortStream( uint8_t* dataStart, queue_handle_t *queueHandle )
+{
+   if( queueHandle->outputAbort != NULL )
+   {
+      queueHandle->outputAbort( dataStart );
    }
+}
 
-   // Queue is full, return old pointer.
-   queueHandle->queueFull++;
-   return queueHandle->queue[queueHandle->headIndex%QUEUELENGTH].data;
+// ----------------------------------------------------------------------------
+/// \brief     Tells the output how many bytes of a frame of
+///            queue_commitStream have been received so far, the output does
+///            not send beyond them. The frame is complete with received
+///            equal to its length.
+///
+/// \param     [in]     uint8_t* dataStart of the frame
+/// \param     [in]     uint16_t received bytes of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_progressStream( uint8_t* dataStart, uint16_t received, queue_handle_t *queueHandle )
+{
+   if( queueHandle->outputProgress != NULL )
+   {
+      queueHandle->outputProgress( dataStart, received );
+   }
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     Returns pointer to the head buffer of the queue.
+/// \brief     Commits a frame of a reservation, with or without giving the
+///            unused rest of the buffer back.
 ///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint8_t* dataStart, inside the reserved buffer
+/// \param     [in]     uint16_t dataLength
 /// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     bool shrink
 ///
-/// \return    uint8_t* data pointer
+/// \return    1 = enqueued, 0 = dropped
+static uint8_t queue_commitFrame( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle, bool shrink )
+{
+   queue_class_t  *queueClass;
+   uint32_t       slotIndex;
+   uint32_t       frameOffset;
+   uint8_t*       buffer;
+   
+   if( reservation->buffer == NULL )
+   {
+      return 0;
+   }
+   frameOffset = (uint32_t)( dataStart - reservation->buffer );
+   queueClass = queue_getClass( queueHandle, dataStart, dataLength );
+   if( frameOffset < queueHandle->headroom || frameOffset + dataLength > reservation->length )
+   {
+      queue_countDrop( queueHandle, queueClass, DROP_FULL );
+      return 0;
+   }
+   
+   // Ringbuffer not full?
+   if( !queue_claimOrDrop( queueHandle, queueClass, &slotIndex ) )
+   {
+      return 0;
+   }
+   
+   // Give the unused rest of the buffer back, the frame keeps its offset.
+   buffer = reservation->buffer;
+   if( shrink )
+   {
+      buffer = bufferpool_shrink( buffer, queue_bufferLength( queueHandle, frameOffset + dataLength ), &queueHandle->bufferQuota );
+   }
+   reservation->buffer = NULL;
+   reservation->length = 0;
+   
+   // The slot is owned by this producer until it is published.
+   queue_publishSlot( queueHandle, queueClass, slotIndex, buffer, &buffer[frameOffset], dataLength );
+   
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns where a producer places a frame in a reservation,
+///            behind the headroom of the output and QUEUEFRAMEALIGN past a
+///            word, and the longest frame which leaves the tailroom of the
+///            output free.
+///
+/// \param     [in]     queue_reservation_t *reservation
+/// \param     [out]    uint16_t *maxLength of the frame
+/// \param     [in]     queue_handle_t *queueHandle
+///
+/// \return    uint8_t* frame start, NULL = no reservation
+uint8_t* queue_getFrameStart( queue_reservation_t *reservation, uint16_t *maxLength, queue_handle_t *queueHandle )
+{
+   uint32_t offset = QUEUE_FRAMEOFFSET( (uint32_t)queueHandle->headroom );
+   
+   if( reservation->buffer == NULL || offset + queueHandle->tailroom >= reservation->length )
+   {
+      *maxLength = 0;
+      return NULL;
+   }
+   *maxLength = (uint16_t)( reservation->length - offset - queueHandle->tailroom );
+   
+   return &reservation->buffer[offset];
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Gives a reservation back without enqueuing a frame, e.g. after
+///            a receive error.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_abort( queue_reservation_t *reservation, queue_handle_t *queueHandle )
+{
+   bufferpool_free( reservation->buffer, &queueHandle->bufferQuota );
+   reservation->buffer = NULL;
+   reservation->length = 0;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Classifies an ethernet frame by its EtherType, the VLAN PCP and
+///            the IPv4 DSCP. Network control (ARP, PCP 6-7, DSCP CS6/CS7/EF)
+///            goes into the high class, background (PCP 1-2, DSCP CS1) into
+///            the low class, all other frames into the normal class. Can be
+///            linked as classifier of a queue.
+///
+/// \param     [in] const uint8_t* frame, starting with the destination mac
+/// \param     [in] uint16_t length
+///
+/// \return    queue_priority_t class of the frame
+queue_priority_t queue_classify( const uint8_t* frame, uint16_t length )
+{
+   uint32_t ipOffset = 14u;
+   uint16_t etherType;
+   uint8_t  dscp;
+   uint8_t  pcp;
+   
+   if( length < 14u )
+   {
+      return PRIORITY_NORMAL;
+   }
+   etherType = (uint16_t)( ( frame[12] << 8 ) | frame[13] );
+   
+   // A tagged frame with a priority set is classified by its PCP, priority
+   // 0 (best effort) falls through to the inner EtherType and DSCP.
+   if( etherType == 0x8100u && length >= 18u )
+   {
+      pcp = frame[14] >> 5;
+      if( pcp >= 6u )
+      {
+         return PRIORITY_HIGH;
+      }
+      if( pcp == 1u || pcp == 2u )
+      {
+         return PRIORITY_LOW;
+      }
+      if( pcp != 0u )
+      {
+         return PRIORITY_NORMAL;
+      }
+      etherType = (uint16_t)( ( frame[16] << 8 ) | frame[17] );
+      ipOffset = 18u;
+   }
+   
+   if( etherType == 0x0806u )
+   {
+      // arp
+      return PRIORITY_HIGH;
+   }
+   if( etherType == 0x0800u && length >= ipOffset + 2u )
+   {
+      dscp = frame[ipOffset + 1u] >> 2;
+      if( dscp >= 48u || dscp == 46u )
+      {
+         // cs6, cs7 and expedited forwarding
+         return PRIORITY_HIGH;
+      }
+      if( dscp == 8u )
+      {
+         // cs1, scavenger
+         return PRIORITY_LOW;
+      }
+   }
+   
+   return PRIORITY_NORMAL;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the number of messages in the queue.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint32_t queue length
+uint32_t queue_getLength( queue_handle_t *queueHandle )
+{
+   return atomicx_load( &queueHandle->queueLength );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns pointer to the head buffer of the queue. The receive
+///            buffer of the zero copy producer is taken from the pool on the
+///            first call, producers which work with reservations do not hold
+///            one.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* data pointer, NULL = quota of the queue exhausted
 uint8_t* queue_getHeadBuffer( queue_handle_t *queueHandle )
 {
-   return queueHandle->queue[queueHandle->headIndex%QUEUELENGTH].data;
+   if( queueHandle->headBuffer == NULL )
+   {
+      queueHandle->headBuffer = bufferpool_alloc( QUEUEBUFFERLENGTH, &queueHandle->bufferQuota );
+   }
+   return queueHandle->headBuffer;
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     Returns pointer to the tail buffer of the queue.
+/// \brief     Returns pointer to the tail buffer of the class which has been
+///            served last.
 ///
 /// \param     [in/out] queue_handle_t *queueHandle
 ///
 /// \return    uint8_t* data pointer
 uint8_t* queue_getTailBuffer( queue_handle_t *queueHandle )
 {
-   return queueHandle->queue[queueHandle->tailIndex%QUEUELENGTH].data;
+   queue_class_t *queueClass = &queueHandle->priorityClass[queueHandle->txClass];
+   
+   return queueClass->queue[atomicx_load( &queueClass->tailIndex )].data;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the ringbuffer index following index.
+///
+/// \param     [in] uint32_t index
+///
+/// \return    uint32_t next index
+static inline uint32_t queue_nextIndex( uint32_t index )
+{
+   return ( index + 1u < QUEUELENGTH ) ? index + 1u : 0u;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the number of used slots between tail and head.
+///
+/// \param     [in] uint32_t headIndex
+/// \param     [in] uint32_t tailIndex
+///
+/// \return    uint32_t used slots
+static inline uint32_t queue_usedSlots( uint32_t headIndex, uint32_t tailIndex )
+{
+   return ( headIndex >= tailIndex ) ? headIndex - tailIndex : headIndex + QUEUELENGTH - tailIndex;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the class of a frame given by the classifier of the
+///            queue. Without classifier all frames go into the normal class.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     const uint8_t* dataStart
+/// \param     [in]     uint16_t dataLength
+///
+/// \return    queue_class_t* class of the frame
+static queue_class_t* queue_getClass( queue_handle_t *queueHandle, const uint8_t* dataStart, uint16_t dataLength )
+{
+   queue_priority_t priority = PRIORITY_NORMAL;
+   
+   if( queueHandle->classify != NULL )
+   {
+      priority = queueHandle->classify( dataStart, dataLength );
+      if( priority >= PRIORITY_CLASSES )
+      {
+         priority = PRIORITY_NORMAL;
+      }
+   }
+   
+   return &queueHandle->priorityClass[priority];
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Claims the head slot of a class for a producer. If another
+///            producer was faster, the compare and exchange fails and the
+///            next slot is tried. The slot is owned by the producer until its
+///            message status is set to READY_FOR_TX. A class holds not more
+///            frames than its depth limit. Drops are counted by the caller.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+/// \param     [out]    uint32_t *slotIndex
+///
+/// \return    true = claimed, false = class full
+static bool queue_claimSlot( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t *slotIndex )
+{
+   uint32_t headIndex;
+   uint32_t tailIndex;
+   uint32_t depthLimit;
+   
+   depthLimit = ( queueClass->depthLimit != 0 && queueClass->depthLimit < QUEUELENGTH-1 ) ? queueClass->depthLimit : QUEUELENGTH-1;
+   
+   // The tail is acquired to see the slots which have been released by the 
+   // consumer.
+   do
+   {
+      headIndex = atomicx_load( &queueClass->headIndex );
+      tailIndex = atomicx_loadAcquire( &queueClass->tailIndex );
+      if( queue_usedSlots( headIndex, tailIndex ) >= depthLimit )
+      {
+         return false;
+      }
+   } while( !atomicx_compareExchange( &queueClass->headIndex, headIndex, queue_nextIndex( headIndex ) ) );
+   
+   atomicx_max( &queueClass->queueLengthPeak, queue_usedSlots( queue_nextIndex( headIndex ), tailIndex ) );
+   atomicx_max( &queueHandle->queueLengthPeak, atomicx_fetchAdd( &queueHandle->queueLength, 1 ) + 1u );
+   *slotIndex = headIndex;
+   
+   return true;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Claims a slot like queue_claimSlot. If the class is full, the
+///            drop policy of the queue decides which frame is dropped: with
+///            drop oldest the frame at the tail makes room for the new one,
+///            otherwise the new frame is dropped.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+/// \param     [out]    uint32_t *slotIndex
+///
+/// \return    true = claimed, false = new frame dropped
+static bool queue_claimOrDrop( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t *slotIndex )
+{
+   if( queue_claimSlot( queueHandle, queueClass, slotIndex ) )
+   {
+      return true;
+   }
+   
+   if( queueHandle->dropPolicy == POLICY_DROPOLDEST
+      && queue_dropOldest( queueHandle, queueClass, DROP_OLDEST )
+      && queue_claimSlot( queueHandle, queueClass, slotIndex ) )
+   {
+      return true;
+   }
+   
+   queue_countDrop( queueHandle, queueClass, DROP_FULL );
+   return false;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Drops the frame at the tail of a class. Called by the producers
+///            (drop oldest) and by the queue manager (codel). The frame is
+///            taken with a compare and exchange on its message status, so it
+///            is either dropped or handed to the output, never both. A frame
+///            in transmission is not dropped.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+/// \param     [in]     queue_dropreason_t reason
+///
+/// \return    true = dropped, false = class empty or tail in transmission
+static bool queue_dropOldest( queue_handle_t *queueHandle, queue_class_t *queueClass, queue_dropreason_t reason )
+{
+   queue_obj_t    *queueObj;
+   uint32_t       tailIndex;
+   uint8_t*       data;
+   uint8_t*       dataStart;
+   
+   tailIndex = atomicx_loadAcquire( &queueClass->tailIndex );
+   if( tailIndex == atomicx_loadAcquire( &queueClass->headIndex ) )
+   {
+      return false;
+   }
+   
+   queueObj = &queueClass->queue[tailIndex];
+   if( !atomicx_compareExchange( &queueObj->messageStatus, READY_FOR_TX, EMPTY_TX ) )
+   {
+      return false;
+   }
+   data = queueObj->data;
+   dataStart = &data[queueObj->dataOffset];
+   queueObj->data = NULL;
+   
+   // The tail may have moved on meanwhile (the slot has been reused), then
+   // the frame is not the oldest one anymore and is given back.
+   if( !atomicx_compareExchange( &queueClass->tailIndex, tailIndex, queue_nextIndex( tailIndex ) ) )
+   {
+      queueObj->data = data;
+      atomicx_storeRelease( &queueObj->messageStatus, READY_FOR_TX );
+      return false;
+   }
+   
+   queue_notifyDrop( queueHandle, dataStart );
+   bufferpool_free( data, &queueHandle->bufferQuota );
+   atomicx_fetchAdd( &queueHandle->queueLength, (uint32_t)-1 );
+   queue_countDrop( queueHandle, queueClass, reason );
+   
+   return true;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Tells the producer and the output that a frame is dropped
+///            before it has been sent. A frame of queue_commitStream may
+///            still be received, neither side may touch its buffer
+///            afterwards.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint8_t* dataStart of the frame
+///
+/// \return    none
+static void queue_notifyDrop( queue_handle_t *queueHandle, uint8_t* dataStart )
+{
+   if( queueHandle->inputDrop != NULL )
+   {
+      queueHandle->inputDrop( dataStart );
+   }
+   if( queueHandle->outputDrop != NULL )
+   {
+      queueHandle->outputDrop( dataStart );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Counts a dropped frame. A dropped new frame counts as queue
+///            full too.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+/// \param     [in]     queue_dropreason_t reason
+///
+/// \return    none
+static void queue_countDrop( queue_handle_t *queueHandle, queue_class_t *queueClass, queue_dropreason_t reason )
+{
+   atomicx_fetchAdd( &queueHandle->dropCounter[reason], 1 );
+   if( reason == DROP_FULL || reason == DROP_NOBUFFER )
+   {
+      atomicx_fetchAdd( &queueHandle->queueFull, 1 );
+      atomicx_fetchAdd( &queueClass->queueFull, 1 );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Codel active queue management of a class, called by the queue
+///            manager before the tail of the class is sent. If the sojourn
+///            time of the frames stays above the target for an interval, the
+///            class enters the dropping state and drops frames at the tail,
+///            the next drop follows after interval/sqrt(drops). The dropping
+///            state is left as soon as the sojourn time is below target.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+///
+/// \return    none
+static void queue_codel( queue_handle_t *queueHandle, queue_class_t *queueClass )
+{
+   uint32_t now = queue_getTimestamp();
+   uint32_t target = queue_usToTicks( ( queueHandle->codelTarget != 0 ) ? queueHandle->codelTarget : QUEUECODELTARGET );
+   uint32_t interval = queue_usToTicks( ( queueHandle->codelInterval != 0 ) ? queueHandle->codelInterval : QUEUECODELINTERVAL );
+   uint32_t headIndex;
+   uint32_t tailIndex;
+   bool     okToDrop;
+   
+   // Every pass drops a frame or returns.
+   for( ;; )
+   {
+      tailIndex = atomicx_load( &queueClass->tailIndex );
+      headIndex = atomicx_loadAcquire( &queueClass->headIndex );
+      if( tailIndex == headIndex || atomicx_loadAcquire( &queueClass->queue[tailIndex].messageStatus ) != READY_FOR_TX )
+      {
+         return;
+      }
+      
+      // A single frame is never dropped, it can not build up a queue.
+      okToDrop = false;
+      if( now - queueClass->queue[tailIndex].timestamp < target || queue_usedSlots( headIndex, tailIndex ) <= 1u )
+      {
+         queueClass->codelFirstAbove = 0;
+      }
+      else if( queueClass->codelFirstAbove == 0 )
+      {
+         queueClass->codelFirstAbove = ( now + interval ) | 1u;
+      }
+      else if( (int32_t)( now - queueClass->codelFirstAbove ) >= 0 )
+      {
+         okToDrop = true;
+      }
+      
+      if( queueClass->codelDropping )
+      {
+         if( !okToDrop )
+         {
+            queueClass->codelDropping = false;
+            return;
+         }
+         if( (int32_t)( now - queueClass->codelDropNext ) < 0 )
+         {
+            return;
+         }
+         queueClass->codelCount++;
+         queueClass->codelDropNext = queue_codelNext( queueClass->codelDropNext, interval, queueClass->codelCount );
+      }
+      else
+      {
+         if( !okToDrop )
+         {
+            return;
+         }
+         
+         // Start with the drop rate of the last dropping state if it has
+         // been left a short time ago.
+         queueClass->codelDropping = true;
+         if( queueClass->codelCount > 2u && now - queueClass->codelDropNext < 16u * interval )
+         {
+            queueClass->codelCount -= 2u;
+         }
+         else
+         {
+            queueClass->codelCount = 1u;
+         }
+         queueClass->codelDropNext = queue_codelNext( now, interval, queueClass->codelCount );
+      }
+      
+      if( !queue_dropOldest( queueHandle, queueClass, DROP_SOJOURN ) )
+      {
+         return;
+      }
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Codel control law, returns the time of the next drop.
+///
+/// \param     [in] uint32_t time
+/// \param     [in] uint32_t interval
+/// \param     [in] uint32_t count, drops in the dropping state
+///
+/// \return    uint32_t time + interval/sqrt(count)
+static uint32_t queue_codelNext( uint32_t time, uint32_t interval, uint32_t count )
+{
+   uint32_t root = 1u;
+   
+   while( ( root + 1u ) * ( root + 1u ) <= count )
+   {
+      root++;
+   }
+   
+   return time + interval / root;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Converts microseconds into timestamp ticks.
+///
+/// \param     [in] uint32_t us
+///
+/// \return    uint32_t ticks
+static inline uint32_t queue_usToTicks( uint32_t us )
+{
+#if defined(HOST_BUILD)
+   return us * 1000u;
+#else
+   return us * ( SystemCoreClock / 1000000u );
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the buffer length for a frame, with the tailroom of
+///            the output behind it as long as the biggest buffer has room for
+///            it.
+///
+/// \param     [in] queue_handle_t *queueHandle
+/// \param     [in] uint32_t length up to the end of the frame
+///
+/// \return    uint32_t buffer length
+static inline uint32_t queue_bufferLength( queue_handle_t *queueHandle, uint32_t length )
+{
+   length += queueHandle->tailroom;
+   return ( length < QUEUEBUFFERLENGTH ) ? length : QUEUEBUFFERLENGTH;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Fills a claimed slot and publishes it to the consumer.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] queue_class_t *queueClass
+/// \param     [in]     uint32_t slotIndex
+/// \param     [in]     uint8_t* data, buffer from the pool
+/// \param     [in]     uint8_t* dataStart, inside data
+/// \param     [in]     uint16_t dataLength
+///
+/// \return    none
+static void queue_publishSlot( queue_handle_t *queueHandle, queue_class_t *queueClass, uint32_t slotIndex, uint8_t* data, uint8_t* dataStart, uint16_t dataLength )
+{
+   queue_obj_t *queueObj = &queueClass->queue[slotIndex];
+   
+   queueObj->data       = data;
+   queueObj->dataOffset = (uint16_t)( dataStart - data );
+   queueObj->dataLength = dataLength;
+   queueObj->timestamp  = queue_getTimestamp();
+   
+   // Publish the message object to the consumer.
+   atomicx_storeRelease( &queueObj->messageStatus, READY_FOR_TX );
+   
+   // Update queue statistics.
+   atomicx_fetchAdd( &queueHandle->frameCounter, 1 );
+   atomicx_fetchAdd( &queueHandle->dataPacketsIN, 1 );
+   atomicx_fetchAdd( &queueHandle->bytesIN, dataLength );
+   atomicx_fetchAdd( &queueClass->dataPacketsIN, 1 );   
+   // Wake up the queue manager.
+   if( queueHandle->wakeup != NULL )
+   {
+      queueHandle->wakeup( queueHandle );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Checks if the tail slot of a class is ready for transmission.
+///            The acquire pairs with the release of the producer.
+///
+/// \param     [in] queue_class_t *queueClass
+///
+/// \return    true = ready
+static bool queue_isReady( queue_class_t *queueClass )
+{
+   uint32_t tailIndex = atomicx_load( &queueClass->tailIndex );
+   
+   return tailIndex != atomicx_loadAcquire( &queueClass->headIndex )
+      && atomicx_loadAcquire( &queueClass->queue[tailIndex].messageStatus ) == READY_FOR_TX;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Selects the class to serve next. With strict priority the
+///            highest class with a ready frame is served. With weighted
+///            service the classes take turns, each class sends up to its
+///            weight in frames per round, an empty class passes its turn.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint32_t class index, QUEUE_NOCLASS = no frame ready
+static uint32_t queue_selectClass( queue_handle_t *queueHandle )
+{
+   queue_class_t *queueClass;
+   
+   if( queueHandle->service == SERVICE_STRICT )
+   {
+      for( uint32_t c = 0; c < PRIORITY_CLASSES; c++ )
+      {
+         if( queue_isReady( &queueHandle->priorityClass[c] ) )
+         {
+            return c;
+         }
+      }
+      return QUEUE_NOCLASS;
+   }
+   
+   for( uint32_t i = 0; i <= PRIORITY_CLASSES; i++ )
+   {
+      queueClass = &queueHandle->priorityClass[queueHandle->serviceClass];
+      if( queueClass->credit != 0 && queue_isReady( queueClass ) )
+      {
+         return queueHandle->serviceClass;
+      }
+      
+      // The class has used its share or is empty, next class.
+      queueClass->credit = ( queueClass->weight != 0 ) ? queueClass->weight : 1u;
+      queueHandle->serviceClass = ( queueHandle->serviceClass + 1u ) % PRIORITY_CLASSES;
+   }
+   
+   return QUEUE_NOCLASS;
+}
+
+#endif // QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+
+// Functions of both backends *************************************************
+static uint32_t         queue_bucketIndex    ( uint32_t value );
+static uint32_t         queue_bucketLimit    ( uint32_t index );
+static void             queue_getPercentiles ( queue_histogram_t *histogram, queue_sojourn_t *sojourn );
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the timestamp for the sojourn time measurement, the cpu
+///            cycle counter on the target.
+///
+/// \param     none
+///
+/// \return    uint32_t timestamp
+uint32_t queue_getTimestamp( void )
+{
+#if defined(HOST_BUILD)
+   struct timespec now;
+   timespec_get( &now, TIME_UTC );
+   return (uint32_t)( now.tv_sec * 1000000000u + now.tv_nsec );
+#else
+   return DWT->CYCCNT;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Adds a sample to a histogram. Each power of two is split into
+///            four buckets, so a percentile is off by 25% at most. Only one
+///            context may add samples to a histogram.
+///
+/// \param     [in/out] queue_histogram_t *histogram
+/// \param     [in]     uint32_t value, cpu cycles
+///
+/// \return    none
+void queue_histogramAdd( queue_histogram_t *histogram, uint32_t value )
+{
+   histogram->bucket[queue_bucketIndex( value )]++;
+   histogram->count++;
+   if( value > histogram->max )
+   {
+      histogram->max = value;
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the sojourn times of the frames sent by the queue: the
+///            wait from the enqueue to the output start and the service time
+///            from the output start to the tx complete.
+///
+/// \param     [in]  queue_handle_t *queueHandle
+/// \param     [out] queue_sojourn_t *wait
+/// \param     [out] queue_sojourn_t *service
+///
+/// \return    none
+void queue_getSojourn( queue_handle_t *queueHandle, queue_sojourn_t *wait, queue_sojourn_t *service )
+{
+   queue_getPercentiles( &queueHandle->waitHistogram, wait );
+   queue_getPercentiles( &queueHandle->serviceHistogram, service );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the histogram bucket of a value. The values 0 to 3 have
+///            their own bucket, above there are four buckets per power of
+///            two.
+///
+/// \param     [in] uint32_t value
+///
+/// \return    uint32_t bucket index
+static uint32_t queue_bucketIndex( uint32_t value )
+{
+   uint32_t msb;
+   
+   if( value < 4u )
+   {
+      return value;
+   }
+#if defined(HOST_BUILD)
+   msb = 31u - (uint32_t)__builtin_clz( value );
+#else
+   msb = 31u - __CLZ( value );
+#endif
+   
+   return ( msb - 1u ) * 4u + ( ( value >> ( msb - 2u ) ) & 3u );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the biggest value of a histogram bucket.
+///
+/// \param     [in] uint32_t index
+///
+/// \return    uint32_t upper limit
+static uint32_t queue_bucketLimit( uint32_t index )
+{
+   uint32_t shift;
+   
+   if( index < 4u )
+   {
+      return index;
+   }
+   shift = index / 4u - 1u;
+   
+   return ( ( 4u + index % 4u ) << shift ) + ( ( 1u << shift ) - 1u );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Evaluates p50, p99 and max of a histogram. The percentiles are
+///            the upper limits of their buckets, not more than the max.
+///
+/// \param     [in]  queue_histogram_t *histogram
+/// \param     [out] queue_sojourn_t *sojourn
+///
+/// \return    none
+static void queue_getPercentiles( queue_histogram_t *histogram, queue_sojourn_t *sojourn )
+{
+   uint32_t count = histogram->count;
+   uint32_t p50Rank = count - count / 2u;             // rank of the median, rounded up
+   uint32_t p99Rank = count - count / 100u;           // rank of the 99th percentile, rounded up
+   uint32_t sum = 0;
+   bool     p50Found = false;                         // the median may be in bucket 0, its limit is 0
+   
+   sojourn->count = count;
+   sojourn->p50   = 0;
+   sojourn->p99   = 0;
+   sojourn->max   = histogram->max;
+   
+   for( uint32_t i = 0; i < QUEUEHISTOGRAMBUCKETS && sum < p99Rank; i++ )
+   {
+      sum += histogram->bucket[i];
+      if( !p50Found && sum >= p50Rank )
+      {
+         sojourn->p50 = queue_bucketLimit( i );
+         p50Found = true;
+      }
+      if( sum >= p99Rank )
+      {
+         sojourn->p99 = queue_bucketLimit( i );
+      }
+   }
+   
+   if( sojourn->p50 > sojourn->max )
+   {
+      sojourn->p50 = sojourn->max;
+   }
+   if( sojourn->p99 > sojourn->max )
+   {
+      sojourn->p99 = sojourn->max;
+   }
 }
 
-/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
\ No newline at end of file
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,740 @@
+// ****************************************************************************
+/// \file      queuex_bip.c
+///
+/// \brief     queue Module
+///
+/// \details   This is the bip-buffer backend of the queue. Instead of slots
+///            with references to buffer pool buffers, each queue owns one
+///            contiguous byte ring. The frames are stored back to back, each
+///            behind a record header with its length, so the memory in use is
+///            proportional to the bytes in flight and not to the number of
+///            frames.
+///            The producer always holds a reservation of QUEUEBUFFERLENGTH
+///            contiguous bytes (the head buffer), so the dma/usb of the
+///            receiving peripheral can write a whole frame in one piece. When
+///            the end of the ring has not enough room for a reservation, a
+///            wrap record is written and the reservation starts at the begin
+///            of the ring again (bip-buffer). On queue_enqueue only the used
+///            part of the reservation is committed, the next reservation
+///            starts right behind the frame. queue_reserve/queue_commit
+///            work the same way with a reservation of the producers choice.
+///            The backend is selected with QUEUE_BACKEND in queuex.h. The API
+///            is the one of the slot backend, except queue_enqueueMulti: the
+///            ring has a single producer, several irq's can not feed the same
+///            queue. The frames of the ring are sent in order, so there are
+///            no priority classes, and a full ring always drops the new frame
+///            (the drop policy of the queue is not used).
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      29102021
+/// 
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///            
+///            Permission is hereby granted, free of charge, to any person 
+///            obtaining a copy of this software and associated documentation 
+///            files (the "Software"), to deal in the Software without 
+///            restriction, including without limitation the rights to use, 
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the 
+///            Software is furnished to do so, subject to the following 
+///            conditions:
+///            
+///            The above copyright notice and this permission notice shall be 
+///            included in all copies or substantial portions of the Software.
+///            
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR 
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre       
+///
+/// \bug       
+///
+/// \warning   
+///
+/// \todo      
+///
+// ****************************************************************************
+
+
+// Include ********************************************************************
+#include "queuex.h"
+#include <string.h>
+
+#if QUEUE_BACKEND == QUEUE_BACKEND_BIP
+
+// Private define *************************************************************
+#define QUEUE_RECORDALIGN( length )       ( ( (length) + 7u ) & ~7u )  // keeps record header and frame 8 byte aligned
+#define QUEUE_RECORDLENGTH                QUEUE_RECORDALIGN( sizeof(queue_record_t) + QUEUEBUFFERLENGTH )
+#define QUEUE_WRAPRECORD                  ( 0u )                       // record length of the wrap record
+
+// Private types     **********************************************************
+typedef struct queue_record
+{
+   uint16_t             recordLength;       // bytes up to the next record, QUEUE_WRAPRECORD = continue at the ring start
+   uint16_t             dataOffset;         // frame start behind the record header
+   uint16_t             dataLength;
+   uint16_t             reserved;
+   uint32_t             timestamp;          // enqueue time, cpu cycles
+   uint32_t             reserved2;          // keeps the frame 8 byte aligned
+} queue_record_t;
+
+// Private variables **********************************************************
+
+// Private functions **********************************************************
+static bool             queue_findRoom     ( queue_handle_t *queueHandle, uint32_t headIndex, uint32_t length, uint32_t *reserveIndex );
+static void             queue_writeRecord  ( queue_handle_t *queueHandle, uint32_t dataOffset, uint16_t dataLength, uint32_t headIndex );
+static queue_record_t*  queue_recordAt     ( queue_handle_t *queueHandle, uint32_t *index );
+static inline uint32_t  queue_usedBytes    ( uint32_t headIndex, uint32_t tailIndex );
+
+// ----------------------------------------------------------------------------
+/// \brief     Queue init. Has to be called before the producers and the
+///            consumer of the queue are started, no irq is masked. To drop
+///            the frames of an aborted transmission at runtime, e.g. on a usb
+///            reset, use queue_flush.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = success
+uint8_t queue_init( queue_handle_t *queueHandle )
+{   
+   // block the tail, so the queue manager does not start a transmission
+   // while the queue is being reset
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_BLOCKED );
+   
+   // init statistics to 0
+   atomicx_store( &queueHandle->dataPacketsIN, 0 );
+   atomicx_store( &queueHandle->bytesIN, 0 );
+   queueHandle->dataPacketsOUT         = 0;
+   queueHandle->bytesOUT               = 0;
+   atomicx_store( &queueHandle->frameCounter, 0 );
+   atomicx_store( &queueHandle->queueFull, 0 );
+   for( uint32_t r = 0; r < DROP_REASONS; r++ )
+   {
+      atomicx_store( &queueHandle->dropCounter[r], 0 );
+   }
+   atomicx_store( &queueHandle->queueLengthPeak, 0 );
+   queueHandle->tailError              = 0;
+   queueHandle->spuriousError          = 0;
+   atomicx_store( &queueHandle->txFrames, 0 );
+   queueHandle->txTimestamp            = 0;
+   memset( &queueHandle->waitHistogram, 0, sizeof(queue_histogram_t) );
+   memset( &queueHandle->serviceHistogram, 0, sizeof(queue_histogram_t) );
+   
+#if !defined(HOST_BUILD)
+   // the cycle counter timestamps the frames
+   CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+   
+   // Empty the ring. A peripheral may already receive into the head buffer,
+   // so the ring restarts at the current reservation.
+   if( queueHandle->headBuffer == NULL )
+   {
+      queueHandle->reserveIndex = 0;
+      queueHandle->headBuffer   = (uint8_t*)queueHandle->ring + sizeof(queue_record_t);
+   }
+   atomicx_store( &queueHandle->headIndex, queueHandle->reserveIndex );
+   atomicx_store( &queueHandle->tailIndex, queueHandle->reserveIndex );
+   
+   // queue status - the tail is used to transmitt messages. As long as the
+   // peripheral is sending the tail thus the queue status remains TAIL_BLOCKED 
+   // because of doing zero opy. After a transmission has been completed the 
+   // queue status will be set back to TAIL_UNBLOCKED. The release publishes
+   // the reset queue to all contexts.
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
+   
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Releases the frames of a transmission the output has aborted at
+///            runtime, as if they were sent. Called from the context of the
+///            output completion, e.g. the usb irq when the host resets the
+///            configuration. The waiting records stay in the ring, the tail
+///            can not be moved past records the queue manager may be handing
+///            to the output at the same time.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint16_t aborted, frames handed to the output which
+///                      will not complete
+///
+/// \return    none
+void queue_flush( queue_handle_t *queueHandle, uint16_t aborted )
+{
+   queue_record_t *record;
+   uint32_t       index = atomicx_load( &queueHandle->tailIndex );
+   
+   // A frame of the aborted transmission may still be received by its
+   // producer, both sides let go of it before its bytes are handed back.
+   for( uint16_t i = 0; i < aborted && index != atomicx_loadAcquire( &queueHandle->headIndex ); i++ )
+   {
+      record = queue_recordAt( queueHandle, &index );
+      if( queueHandle->inputDrop != NULL )
+      {
+         queueHandle->inputDrop( (uint8_t*)record + sizeof(queue_record_t) + record->dataOffset );
+      }
+      if( queueHandle->outputDrop != NULL )
+      {
+         queueHandle->outputDrop( (uint8_t*)record + sizeof(queue_record_t) + record->dataOffset );
+      }
+      index += record->recordLength;
+   }
+   if( aborted != 0 )
+   {
+      queue_dequeueBatch( queueHandle, aborted );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     The queue manager checks for available data to send, and calls
+///            the linked peripheral output interface. NOTE! You have to provide
+///            and link an output interface function before calling this
+///            function. If the peripheral links a batch output, the records
+///            behind the tail (up to QUEUEBATCHLENGTH) are handed over at
+///            once.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+inline void queue_manager( queue_handle_t *queueHandle )
+{      
+   queue_record_t *record;
+   uint32_t       headIndex;
+   uint32_t       index;
+   uint16_t       count = 0;
+   uint16_t       taken;
+   
+   // If the queue status is set to a blocked tail return.
+   if( atomicx_loadAcquire( &queueHandle->queueStatus ) != TAIL_UNBLOCKED )
+   {
+      return;
+   }
+   
+   // Collect the records up to the head. The acquire pairs with the release
+   // of the producer, the records up to the head index are valid afterwards.
+   headIndex = atomicx_loadAcquire( &queueHandle->headIndex );
+   index     = atomicx_load( &queueHandle->tailIndex );
+   while( index != headIndex && count < ( ( queueHandle->outputBatch != NULL ) ? QUEUEBATCHLENGTH : 1u ) )
+   {
+      record = queue_recordAt( queueHandle, &index );
+      queueHandle->txBatch[count].dataStart  = (uint8_t*)record + sizeof(queue_record_t) + record->dataOffset;
+      queueHandle->txBatch[count].dataLength = record->dataLength;
+      index += record->recordLength;
+      count++;
+   }
+   if( count == 0 )
+   {
+      return;
+   }
+   
+   // Block the tail before the peripheral is started, the tx complete irq
+   // may fire immediately.
+   queueHandle->txTimestamp = queue_getTimestamp();
+   atomicx_store( &queueHandle->txFrames, count );
+   atomicx_storeRelease( &queueHandle->queueStatus, TAIL_BLOCKED );
+   
+   // Send the frames with the linked output function provided by the
+   // communication peripheral.
+   if( queueHandle->outputBatch != NULL )
+   {
+      taken = queueHandle->outputBatch( queueHandle->txBatch, count );
+   }
+   else
+   {
+      taken = queueHandle->output( queueHandle->txBatch[0].dataStart, queueHandle->txBatch[0].dataLength );
+   }
+   
+   // The records which have not been taken simply stay in the ring. If the
+   // taken ones are already released (or none was taken), the tail is
+   // unblocked here.
+   if( taken < count
+      && atomicx_fetchAdd( &queueHandle->txFrames, (uint32_t)-( count - taken ) ) == (uint32_t)( count - taken ) )
+   {
+      atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Releases the tail record after the linked output interface has
+///            completed the transmission. Called from the tx complete
+///            callback of the peripheral.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+inline void queue_dequeue( queue_handle_t *queueHandle )
+{   
+   queue_dequeueBatch( queueHandle, 1 );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Releases count records at the tail after the linked output
+///            interface has completed their transmission. The tail is
+///            unblocked when all frames handed to the output are released.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint16_t count
+///
+/// \return    none
+void queue_dequeueBatch( queue_handle_t *queueHandle, uint16_t count )
+{
+   queue_record_t *record;
+   uint32_t       tailIndex;
+   uint32_t       now = queue_getTimestamp();
+   uint16_t       released = 0;
+   
+   if( atomicx_load( &queueHandle->queueStatus ) != TAIL_BLOCKED )
+   {
+      // Spurious error check for debugging
+      queueHandle->spuriousError++;
+      atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
+      return;
+   }
+   
+   tailIndex = atomicx_load( &queueHandle->tailIndex );
+   while( released < count )
+   {
+      // Check if tail and head index are ok.
+      if( tailIndex == atomicx_loadAcquire( &queueHandle->headIndex ) )
+      {
+         queueHandle->tailError++;
+         break;
+      }
+      record = queue_recordAt( queueHandle, &tailIndex );
+      
+      // Update queue statistics.
+      queueHandle->dataPacketsOUT++;
+      queueHandle->bytesOUT += record->dataLength; // note: this are the frame bytes without preamble and crc value
+      queue_histogramAdd( &queueHandle->waitHistogram, queueHandle->txTimestamp - record->timestamp );
+      queue_histogramAdd( &queueHandle->serviceHistogram, now - queueHandle->txTimestamp );
+      
+      tailIndex += record->recordLength;
+      released++;
+   }
+   
+   // Hand the bytes back to the producer, the release makes sure the
+   // records have been read before the producer can overwrite them.
+   atomicx_storeRelease( &queueHandle->tailIndex, tailIndex );
+   
+   // Transmission complete unblock the tail.
+   if( released == 0 || atomicx_fetchAdd( &queueHandle->txFrames, (uint32_t)-released ) == released )
+   {
+      atomicx_storeRelease( &queueHandle->queueStatus, TAIL_UNBLOCKED );
+      if( queueHandle->wakeup != NULL )
+      {
+         queueHandle->wakeup( queueHandle );
+      }
+   }
+   
+   // A producer waiting for room can go on.
+   if( released != 0 && queueHandle->inputResume != NULL )
+   {
+      queueHandle->inputResume();
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Enqueue a new message into the ring. The used part of the head
+///            buffer is committed as record and a new head buffer is reserved
+///            behind it. If the ring has no room for a new reservation, the
+///            frame is dropped and the head buffer will be used again until
+///            the consumer has freed enough bytes. Only one context may
+///            enqueue into the queue.
+///
+/// \param     [in]     uint8_t* dataStart, inside the head buffer
+/// \param     [in]     uint16_t dataLength
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* data pointer
+inline uint8_t* queue_enqueue( uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   uint32_t       dataOffset;
+   uint32_t       dataEnd;
+   uint32_t       headIndex;
+   uint32_t       reserveIndex;
+   
+   // The frame keeps its offset in the head buffer, so the room in front of
+   // it (e.g. for the header of the output interface) is kept too.
+   dataOffset = (uint32_t)( dataStart - queueHandle->headBuffer );
+   if( dataOffset < queueHandle->headroom || dataOffset + dataLength > QUEUEBUFFERLENGTH )
+   {
+      atomicx_fetchAdd( &queueHandle->queueFull, 1 );
+      atomicx_fetchAdd( &queueHandle->dropCounter[DROP_FULL], 1 );
+      return queueHandle->headBuffer;
+   }
+   dataEnd = dataOffset + dataLength + queueHandle->tailroom;
+   if( dataEnd > QUEUEBUFFERLENGTH )
+   {
+      dataEnd = QUEUEBUFFERLENGTH;
+   }
+   
+   // The record ends behind the frame and the tailroom of the output, the
+   // next reservation starts there if the ring has room for it.
+   headIndex = queueHandle->reserveIndex + QUEUE_RECORDALIGN( sizeof(queue_record_t) + dataEnd );
+   if( !queue_findRoom( queueHandle, headIndex, QUEUE_RECORDLENGTH, &reserveIndex ) )
+   {
+      // Ring is full, return old pointer.
+      atomicx_fetchAdd( &queueHandle->queueFull, 1 );
+      atomicx_fetchAdd( &queueHandle->dropCounter[DROP_FULL], 1 );
+      return queueHandle->headBuffer;
+   }
+   
+   // The next reservation starts at the ring begin, tell the consumer to
+   // continue there after this record.
+   if( reserveIndex != headIndex && headIndex < QUEUERINGLENGTH )
+   {
+      ( (queue_record_t*)( (uint8_t*)queueHandle->ring + headIndex ) )->recordLength = QUEUE_WRAPRECORD;
+   }
+   
+   // Publish the record to the consumer.
+   queue_writeRecord( queueHandle, dataOffset, dataLength, headIndex );
+
+   // Return new pointer.
+   queueHandle->reserveIndex = reserveIndex;
+   queueHandle->headBuffer   = (uint8_t*)queueHandle->ring + reserveIndex + sizeof(queue_record_t);
+   return queueHandle->headBuffer;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Reserves maxLength contiguous bytes behind the last committed
+///            record for the producer, e.g. as target of a dma. The frame is
+///            received directly into the ring and handed over with
+///            queue_commit. The ring has a single producer: the reservation
+///            replaces the head buffer, a queue is fed either with
+///            queue_enqueue or with queue_reserve/queue_commit.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint16_t maxLength, up to QUEUEBUFFERLENGTH
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* reserved buffer, NULL = ring full
+uint8_t* queue_reserve( queue_reservation_t *reservation, uint16_t maxLength, queue_handle_t *queueHandle )
+{
+   uint32_t headIndex;
+   uint32_t reserveIndex;
+   
+   if( reservation->buffer != NULL && reservation->length >= maxLength )
+   {
+      return reservation->buffer;
+   }
+   reservation->buffer = NULL;
+   reservation->length = 0;
+   
+   // The head index is only written by the producer itself.
+   headIndex = atomicx_load( &queueHandle->headIndex );
+   if( maxLength > QUEUEBUFFERLENGTH
+      || !queue_findRoom( queueHandle, headIndex, QUEUE_RECORDALIGN( sizeof(queue_record_t) + maxLength ), &reserveIndex ) )
+   {
+      return NULL;
+   }
+   
+   // The reservation starts at the ring begin, tell the consumer to continue
+   // there after the last record.
+   if( reserveIndex != headIndex && headIndex < QUEUERINGLENGTH )
+   {
+      ( (queue_record_t*)( (uint8_t*)queueHandle->ring + headIndex ) )->recordLength = QUEUE_WRAPRECORD;
+   }
+   
+   queueHandle->reserveIndex  = reserveIndex;
+   queueHandle->headBuffer    = (uint8_t*)queueHandle->ring + reserveIndex + sizeof(queue_record_t);
+   reservation->buffer        = queueHandle->headBuffer;
+   reservation->length        = maxLength;
+   
+   return reservation->buffer;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Commits a frame which has been received into the reservation.
+///            Only the used part of the reservation and the tailroom of the
+///            output behind it become a record, the rest stays free for the
+///            next reservation.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint8_t* dataStart, inside the reserved buffer
+/// \param     [in]     uint16_t dataLength
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = enqueued, 0 = dropped
+uint8_t queue_commit( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   uint32_t dataOffset;
+   uint32_t dataEnd;
+   
+   if( reservation->buffer == NULL || reservation->buffer != queueHandle->headBuffer )
+   {
+      return 0;
+   }
+   dataOffset = (uint32_t)( dataStart - reservation->buffer );
+   if( dataOffset < queueHandle->headroom || dataOffset + dataLength > reservation->length )
+   {
+      atomicx_fetchAdd( &queueHandle->queueFull, 1 );
+      atomicx_fetchAdd( &queueHandle->dropCounter[DROP_FULL], 1 );
+      return 0;
+   }
+   dataEnd = dataOffset + dataLength + queueHandle->tailroom;
+   if( dataEnd > reservation->length )
+   {
+      dataEnd = reservation->length;
+   }
+   
+   queue_writeRecord( queueHandle, dataOffset, dataLength, queueHandle->reserveIndex + QUEUE_RECORDALIGN( sizeof(queue_record_t) + dataEnd ) );
+   reservation->buffer = NULL;
+   reservation->length = 0;
+   
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Commits a frame which is still being received into the
+///            reservation, for cut-through forwarding. The ring never moves
+///            a frame, so this is a plain commit with the full length of the
+///            frame. A frame which turns out bad is ended with
+///            queue_abortStream.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     uint8_t* dataStart, inside the reserved buffer
+/// \param     [in]     uint16_t dataLength, the full length of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    1 = enqueued, 0 = dropped
+uint8_t queue_commitStream( queue_reservation_t *reservation, uint8_t* dataStart, uint16_t dataLength, queue_handle_t *queueHandle )
+{
+   return queue_commit( reservation, dataStart, dataLength, queueHandle );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Tells the output that a frame of queue_commitStream has turned
+///            out bad, e.g. it ended short. The output ends the frame with a
+///            framing error, the frame is released as usual on its tx
+///            complete.
+///
+/// \param     [in]     uint8_t* dataStart of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_abortStream( uint8_t* dataStart, queue_handle_t *queueHandle )
+{
+   if( queueHandle->outputAbort != NULL )
+   {
+      queueHandle->outputAbort( dataStart );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Tells the output how many bytes of a frame of
+///            queue_commitStream have been received so far, the output does
+///            not send beyond them. The frame is complete with received
+///            equal to its length.
+///
+/// \param     [in]     uint8_t* dataStart of the frame
+/// \param     [in]     uint16_t received bytes of the frame
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_progressStream( uint8_t* dataStart, uint16_t received, queue_handle_t *queueHandle )
+{
+   if( queueHandle->outputProgress != NULL )
+   {
+      queueHandle->outputProgress( dataStart, received );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns where a producer places a frame in a reservation,
+///            behind the headroom of the output and QUEUEFRAMEALIGN past a
+///            word, and the longest frame which leaves the tailroom of the
+///            output free.
+///
+/// \param     [in]     queue_reservation_t *reservation
+/// \param     [out]    uint16_t *maxLength of the frame
+/// \param     [in]     queue_handle_t *queueHandle
+///
+/// \return    uint8_t* frame start, NULL = no reservation
+uint8_t* queue_getFrameStart( queue_reservation_t *reservation, uint16_t *maxLength, queue_handle_t *queueHandle )
+{
+   uint32_t offset = QUEUE_FRAMEOFFSET( (uint32_t)queueHandle->headroom );
+   
+   if( reservation->buffer == NULL || offset + queueHandle->tailroom >= reservation->length )
+   {
+      *maxLength = 0;
+      return NULL;
+   }
+   *maxLength = (uint16_t)( reservation->length - offset - queueHandle->tailroom );
+   
+   return &reservation->buffer[offset];
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Gives a reservation back without enqueuing a frame. The
+///            reserved bytes have never left the free part of the ring.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    none
+void queue_abort( queue_reservation_t *reservation, queue_handle_t *queueHandle )
+{
+   (void)queueHandle;
+   reservation->buffer = NULL;
+   reservation->length = 0;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the number of messages in the queue.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint32_t queue length
+uint32_t queue_getLength( queue_handle_t *queueHandle )
+{
+   return atomicx_load( &queueHandle->dataPacketsIN ) - queueHandle->dataPacketsOUT;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns pointer to the head buffer of the queue.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* data pointer
+uint8_t* queue_getHeadBuffer( queue_handle_t *queueHandle )
+{
+   return queueHandle->headBuffer;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns pointer to the tail buffer of the queue.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+///
+/// \return    uint8_t* data pointer, NULL if the queue is empty
+uint8_t* queue_getTailBuffer( queue_handle_t *queueHandle )
+{
+   uint32_t tailIndex = atomicx_load( &queueHandle->tailIndex );
+   
+   if( tailIndex == atomicx_loadAcquire( &queueHandle->headIndex ) )
+   {
+      return NULL;
+   }
+   return (uint8_t*)queue_recordAt( queueHandle, &tailIndex ) + sizeof(queue_record_t);
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Looks for a reservation of length contiguous bytes behind the
+///            head index. If the ring end has not enough room,
+///            the reservation wraps to the ring begin. The reservation must
+///            not reach the tail, so head and tail are only equal on an empty
+///            ring.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint32_t headIndex
+/// \param     [in]     uint32_t length, record header included
+/// \param     [out]    uint32_t *reserveIndex
+///
+/// \return    true = reserved, false = ring full
+static bool queue_findRoom( queue_handle_t *queueHandle, uint32_t headIndex, uint32_t length, uint32_t *reserveIndex )
+{
+   // The tail is acquired to see the records which have been released by
+   // the consumer.
+   uint32_t tailIndex = atomicx_loadAcquire( &queueHandle->tailIndex );
+   
+   if( headIndex >= tailIndex )
+   {
+      if( QUEUERINGLENGTH - headIndex >= length )
+      {
+         *reserveIndex = headIndex;
+         return true;
+      }
+      if( tailIndex > length )
+      {
+         *reserveIndex = 0;
+         return true;
+      }
+   }
+   else if( tailIndex - headIndex > length )
+   {
+      *reserveIndex = headIndex;
+      return true;
+   }
+   
+   return false;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Writes the record header of the frame in the reservation and
+///            publishes the record to the consumer.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in]     uint32_t dataOffset in the reservation
+/// \param     [in]     uint16_t dataLength
+/// \param     [in]     uint32_t headIndex, end of the record
+///
+/// \return    none
+static void queue_writeRecord( queue_handle_t *queueHandle, uint32_t dataOffset, uint16_t dataLength, uint32_t headIndex )
+{
+   queue_record_t *record = (queue_record_t*)( (uint8_t*)queueHandle->ring + queueHandle->reserveIndex );
+   
+   record->recordLength = (uint16_t)( headIndex - queueHandle->reserveIndex );
+   record->dataOffset   = (uint16_t)dataOffset;
+   record->dataLength   = dataLength;
+   record->timestamp    = queue_getTimestamp();
+   
+   // Publish the record to the consumer.
+   atomicx_storeRelease( &queueHandle->headIndex, headIndex );
+   atomicx_max( &queueHandle->queueLengthPeak, queue_usedBytes( headIndex, atomicx_load( &queueHandle->tailIndex ) ) );
+   
+   // Update queue statistics.
+   atomicx_fetchAdd( &queueHandle->frameCounter, 1 );
+   atomicx_fetchAdd( &queueHandle->dataPacketsIN, 1 );
+   atomicx_fetchAdd( &queueHandle->bytesIN, dataLength );   
+   // Wake up the queue manager.
+   if( queueHandle->wakeup != NULL )
+   {
+      queueHandle->wakeup( queueHandle );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the record at index. A wrap record or the ring end move
+///            the index to the ring begin. Only called by the consumer for an
+///            index in front of the head.
+///
+/// \param     [in/out] queue_handle_t *queueHandle
+/// \param     [in/out] uint32_t *index
+///
+/// \return    queue_record_t* record
+static queue_record_t* queue_recordAt( queue_handle_t *queueHandle, uint32_t *index )
+{
+   if( *index == QUEUERINGLENGTH
+      || ( (queue_record_t*)( (uint8_t*)queueHandle->ring + *index ) )->recordLength == QUEUE_WRAPRECORD )
+   {
+      *index = 0;
+   }
+   
+   return (queue_record_t*)( (uint8_t*)queueHandle->ring + *index );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the bytes in use between tail and head, the unused end
+///            of a wrapped ring is counted as used.
+///
+/// \param     [in] uint32_t headIndex
+/// \param     [in] uint32_t tailIndex
+///
+/// \return    uint32_t used bytes
+static inline uint32_t queue_usedBytes( uint32_t headIndex, uint32_t tailIndex )
+{
+   return ( headIndex >= tailIndex ) ? headIndex - tailIndex : headIndex + QUEUERINGLENGTH - tailIndex;
+}
+
+#endif // QUEUE_BACKEND == QUEUE_BACKEND_BIP
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
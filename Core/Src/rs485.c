@@ -30,19 +30,37 @@
 // Include ********************************************************************
 #include "rs485.h"
 #include "queuex.h"
+#include "usb_device.h"
 
 // Private defines ************************************************************
 
 // Private types     **********************************************************
 
 // Private variables **********************************************************
-static uint8_t* rxBufferPointerExample;
+static queue_reservation_t rxReservation;
+static volatile bool       rxPaused = false;    // no reservation, reception stopped
+static uint8_t* volatile   txAbort = NULL;      // frame to end with a framing error
+static uint8_t*            txFrame = NULL;      // frame in transmission, NULL = none
+static uint16_t            txLength = 0;        // length of the frame in transmission
+static uint16_t            txSent = 0;          // bytes handed to the transmitter
+static bool                txBusy = false;      // a part is in transmission
+static struct
+{
+   uint8_t*                frame;               // frame of the usb queue still being received, NULL = none
+   uint16_t                received;            // bytes of the frame received so far
+} txStream;
+static uint8_t*            rxStream = NULL;     // frame forwarded while it is received, NULL = none
+static uint16_t            rxStreamLength = 0;  // length from the length prefix
 
 // Global variables ***********************************************************
 extern queue_handle_t uartQueue;
 extern queue_handle_t usbQueue;
 
 // Private function prototypes ************************************************
+static void rs485_rxArm( void );
+static void rs485_transmit( uint8_t* buffer, uint16_t length );
+static void rs485_txStop( void );
+static void rs485_txNext( void );
 
 // Functions ******************************************************************
 
@@ -54,7 +72,10 @@ extern queue_handle_t usbQueue;
 /// \return    none
 void rs485_init( void )
 {
-   rxBufferPointerExample = queue_getHeadBuffer( &uartQueue );
+   // The dma receives directly into a reservation of the uart queue.
+   __disable_irq();
+   rs485_rxArm();
+   __enable_irq();
 }
 
 //------------------------------------------------------------------------------
@@ -76,9 +97,163 @@ void rs485_deinit( void )
 /// \return    0 = not send, 1 = send
 uint8_t rs485_output( uint8_t* buffer, uint16_t length )
 {
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( txFrame != NULL )
+   {
+      __set_PRIMASK( primask );
+      return 0;
+   }
+   txFrame = buffer;
+   txLength = length;
+   txSent = 0;
+   if( buffer == txAbort )
+   {
+      // The frame is bad already, only a break goes out and ends with
+      // rs485_txCplt.
+      txAbort = NULL;
+      txSent = length;
+      txBusy = true;
+      rs485_txStop();
+   }
+   else
+   {
+      rs485_txNext();
+   }
+   __set_PRIMASK( primask );
    return 1;
 }
 
+//------------------------------------------------------------------------------
+/// \brief     Takes the receive progress of a frame of the usb queue which
+///            is forwarded while it is received. Linked as output progress
+///            of the usb queue, called from the usb irq. A transmission
+///            waiting for the bytes goes on.
+///
+/// \param     [in] uint8_t* buffer, the frame start
+/// \param     [in] uint16_t received bytes of the frame
+///
+/// \return    none
+void rs485_outputProgress( uint8_t* buffer, uint16_t received )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   txStream.frame = buffer;
+   txStream.received = received;
+   if( buffer == txFrame && !txBusy )
+   {
+      rs485_txNext();
+   }
+   __set_PRIMASK( primask );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Forgets a frame of the usb queue which is dropped before it
+///            has been sent. Linked as output drop of the usb queue, its
+///            buffer may be handed out again for a frame which is not
+///            forwarded while it is received.
+///
+/// \param     [in] uint8_t* buffer, the frame start
+///
+/// \return    none
+void rs485_outputDrop( uint8_t* buffer )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( buffer == txStream.frame )
+   {
+      txStream.frame = NULL;
+   }
+   if( buffer == txAbort )
+   {
+      txAbort = NULL;
+   }
+   __set_PRIMASK( primask );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ends a frame with a framing error, e.g. a break. Linked as
+///            output abort of the usb queue, called when a frame forwarded
+///            cut-through ends short. A frame in transmission is stopped, a
+///            frame which is still queued is ended as soon as it is handed
+///            to rs485_output.
+///
+/// \param     [in] uint8_t* buffer, the frame start
+///
+/// \return    none
+void rs485_outputAbort( uint8_t* buffer )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( buffer == txFrame )
+   {
+      txSent = txLength;
+      txBusy = true;
+      rs485_txStop();
+   }
+   else
+   {
+      txAbort = buffer;
+   }
+   __set_PRIMASK( primask );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Uart start transmit function, e.g. the tx dma. Ends with
+///            rs485_txCplt, a frame may be sent in several parts. Has to be
+///            called with disabled irq's.
+///
+/// \param     [in] uint8_t* buffer
+/// \param     [in] uint16_t length
+///
+/// \return    none
+static void rs485_transmit( uint8_t* buffer, uint16_t length )
+{
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Uart stop transmit function. Stops a running transmission,
+///            e.g. the tx dma, and sends a break, so the receiver sees a
+///            framing error. Ends with rs485_txCplt. Has to be called with
+///            disabled irq's.
+///
+/// \param     none
+///
+/// \return    none
+static void rs485_txStop( void )
+{
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Hands the next part of the frame in transmission to the
+///            transmitter. Of a frame still being received only the received
+///            bytes are sent, so the transmitter never runs ahead of the usb
+///            out endpoint, and the transmission waits for
+///            rs485_outputProgress. Has to be called with disabled irq's.
+///
+/// \param     none
+///
+/// \return    none
+static void rs485_txNext( void )
+{
+   uint16_t available = txLength;
+   
+   if( txFrame == txStream.frame && txStream.received < txLength )
+   {
+      available = txStream.received;
+   }
+   if( available > txSent )
+   {
+      txBusy = true;
+      rs485_transmit( &txFrame[txSent], available - txSent );
+      txSent = available;
+   }
+}
+
 //------------------------------------------------------------------------------
 /// \brief     Uart start receive function.          
 ///
@@ -95,13 +270,163 @@ uint8_t rs485_receive( uint8_t* buffer, uint16_t length )
 /// \brief     Uart rx complete callback function. Called from peripheral irq
 ///            handler.
 ///
+/// \param     [in] uint16_t length of the received frame, e.g. from the dma
+///                 counter, 0 on a framing or crc error
+///
+/// \return    none
+void rs485_rxCplt( uint16_t length )
+{
+   uint8_t*    frame;
+   uint16_t    maxLength;
+   
+   if( rxStream != NULL )
+   {
+      // The frame is forwarded already, a frame which does not match its
+      // length prefix is aborted.
+      if( length == rxStreamLength )
+      {
+         queue_progressStream( rxStream, length, &uartQueue );
+      }
+      else
+      {
+         queue_abortStream( rxStream, &uartQueue );
+      }
+      rxStream = NULL;
+   }
+   else if( length != 0 )
+   {
+      // Commit the frame with its real length, the unused rest of the
+      // reservation goes back to the queue. On a full queue the frame is
+      // dropped and the reservation is used again.
+      frame = queue_getFrameStart( &rxReservation, &maxLength, &uartQueue );
+      if( frame != NULL )
+      {
+         queue_commit( &rxReservation, frame, length, &uartQueue );
+      }
+   }
+   
+   __disable_irq();
+   rs485_rxArm();
+   __enable_irq();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Length prefix callback function. Called from peripheral irq
+///            handler as soon as the length of the frame in reception is
+///            known, e.g. from a length prefix of the serial framing. The
+///            frame is committed to the uart queue with this length and the
+///            usb output may start before the rest has arrived.
+///
+/// \param     [in] uint16_t length of the frame
+///
+/// \return    none
+void rs485_rxLength( uint16_t length )
+{
+   uint8_t*    frame;
+   uint16_t    maxLength;
+   
+   frame = queue_getFrameStart( &rxReservation, &maxLength, &uartQueue );
+   if( frame == NULL || rxStream != NULL || length == 0 || length > maxLength )
+   {
+      // left to rs485_rxCplt
+      return;
+   }
+   
+   // The output is told about the stream before the queue manager can see
+   // the frame.
+   __disable_irq();
+   if( queue_commitStream( &rxReservation, frame, length, &uartQueue ) == 1 )
+   {
+      rxStream = frame;
+      rxStreamLength = length;
+      queue_progressStream( frame, 0, &uartQueue );
+   }
+   __enable_irq();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Receive progress callback function. Called from peripheral irq
+///            handler while a frame is received, e.g. on the dma half
+///            transfer or the idle line. The usb output sends up to the
+///            received bytes.
+///
+/// \param     [in] uint16_t received bytes of the frame
+///
+/// \return    none
+void rs485_rxProgress( uint16_t received )
+{
+   if( rxStream != NULL && received < rxStreamLength )
+   {
+      queue_progressStream( rxStream, received, &uartQueue );
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Lets go of a frame which is dropped from the uart queue before
+///            it has been sent. Linked as input drop of the uart queue. If
+///            the frame is still being received, rs485_receive restarts the
+///            reception into a new reservation and the rest of the frame is
+///            lost.
+///
+/// \param     [in] uint8_t* buffer, the frame start
+///
+/// \return    none
+void rs485_rxDrop( uint8_t* buffer )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( buffer == rxStream )
+   {
+      rxStream = NULL;
+      rs485_rxArm();
+   }
+   __set_PRIMASK( primask );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Restarts the reception, which is stopped while the uart queue
+///            has no buffer for it. Linked as input resume of the uart queue.
+///
+/// \param     none
+///
+/// \return    none
+void rs485_rxResume( void )
+{
+   if( !rxPaused )
+   {
+      return;
+   }
+   
+   __disable_irq();
+   if( rxPaused )
+   {
+      rs485_rxArm();
+   }
+   __enable_irq();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Reserves the buffer for the next frame and starts the
+///            reception, without buffer the reception stays stopped until
+///            rs485_rxResume. Has to be called with disabled irq's.
+///
 /// \param     none
 ///
 /// \return    none
-void rs485_rxCplt( void )
+static void rs485_rxArm( void )
 {
-   uint16_t rxLengthExample = 500;
-   queue_enqueue( rxBufferPointerExample, rxLengthExample, &uartQueue );
+   uint8_t*    frame;
+   uint16_t    maxLength;
+   
+   // The frame is received behind the headroom of the usb output, which
+   // writes its header in front of it without copy.
+   rxPaused = ( queue_reserve( &rxReservation, QUEUEBUFFERLENGTH, &uartQueue ) == NULL );
+   frame = queue_getFrameStart( &rxReservation, &maxLength, &uartQueue );
+   if( frame != NULL )
+   {
+      rs485_receive( frame, maxLength );
+   }
 }
 
 //------------------------------------------------------------------------------
@@ -113,7 +438,32 @@ void rs485_rxCplt( void )
 /// \return    none
 void rs485_txCplt( void )
 {
+   txBusy = false;
+   if( txSent < txLength )
+   {
+      rs485_txNext();
+      return;
+   }
+   if( txFrame == txStream.frame )
+   {
+      txStream.frame = NULL;
+   }
+   txFrame = NULL;
    queue_dequeue( &usbQueue );
 }
 
+//------------------------------------------------------------------------------
+/// \brief     Link state callback function. To be called by the driver when
+///            the bus goes up or down, e.g. on a transceiver fault or when no
+///            node answers anymore. The usb side reports the media state to
+///            the host.
+///
+/// \param     [in] bool up
+///
+/// \return    none
+void rs485_linkChanged( bool up )
+{
+   usb_setLinkState( up );
+}
+
 /********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
\ No newline at end of file
@@ -0,0 +1,147 @@
+// ****************************************************************************
+/// \file      stats.c
+///
+/// \brief     statistics module
+///
+/// \details   This is the statistics c source file. The 64 bit counters
+///            can not be written with one store on the cortex-m4, each access
+///            masks the interrupts for the few cycles of the update, so a
+///            counter may be written from any context and is never read torn.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Include ********************************************************************
+#include "stats.h"
+#include <string.h>
+
+// Private define *************************************************************
+
+// Private types     **********************************************************
+
+// Private variables **********************************************************
+static uint64_t   counters[STATS_COUNTERS];
+
+// Global variables ***********************************************************
+extern queue_handle_t uartQueue;
+extern queue_handle_t usbQueue;
+
+// Private functions **********************************************************
+static void       stats_getQueue             ( queue_handle_t *queueHandle, stats_queue_t *stat );
+
+// ----------------------------------------------------------------------------
+/// \brief     Adds a value to a counter. Can be called from any context.
+///
+/// \param     [in] stats_counter_t counter
+/// \param     [in] uint32_t value
+///
+/// \return    none
+void stats_add( stats_counter_t counter, uint32_t value )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   counters[counter] += value;
+   __set_PRIMASK( primask );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns a counter.
+///
+/// \param     [in] stats_counter_t counter
+///
+/// \return    uint64_t value
+uint64_t stats_get( stats_counter_t counter )
+{
+   uint32_t primask = __get_PRIMASK();
+   uint64_t value;
+   
+   __disable_irq();
+   value = counters[counter];
+   __set_PRIMASK( primask );
+   return value;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Takes a snapshot of the counters and of the queue statistics.
+///            The counters are copied at once, the queues are read one after
+///            the other.
+///
+/// \param     [out] stats_snapshot_t *snapshot
+///
+/// \return    none
+void stats_getSnapshot( stats_snapshot_t *snapshot )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   snapshot->version = STATS_VERSION;
+   snapshot->length = sizeof(stats_snapshot_t);
+   
+   __disable_irq();
+   memcpy( snapshot->counter, counters, sizeof(counters) );
+   __set_PRIMASK( primask );
+   
+   stats_getQueue( &uartQueue, &snapshot->queue[STATS_UARTQUEUE] );
+   stats_getQueue( &usbQueue, &snapshot->queue[STATS_USBQUEUE] );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Copies the statistics of a queue.
+///
+/// \param     [in]  queue_handle_t *queueHandle
+/// \param     [out] stats_queue_t *stat
+///
+/// \return    none
+static void stats_getQueue( queue_handle_t *queueHandle, stats_queue_t *stat )
+{
+   stat->length = queue_getLength( queueHandle );
+   stat->lengthPeak = atomicx_load( &queueHandle->queueLengthPeak );
+   stat->packetsIn = atomicx_load( &queueHandle->dataPacketsIN );
+   stat->packetsOut = queueHandle->dataPacketsOUT;
+   stat->full = atomicx_load( &queueHandle->queueFull );
+   for( uint32_t i = 0; i < DROP_REASONS; i++ )
+   {
+      stat->drop[i] = atomicx_load( &queueHandle->dropCounter[i] );
+   }
+   stat->tailError = queueHandle->tailError;
+   stat->spuriousError = queueHandle->spuriousError;
+   queue_getSojourn( queueHandle, &stat->wait, &stat->service );
+}
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,1359 @@
+// ****************************************************************************
+/// \file      usbd_ncm.c
+///
+/// \brief     CDC-NCM device C source file
+///
+/// \details   Usb network control model class with NTB16 framing. It uses the
+///            same queues and hooks of usb_device as the rndis class:
+///            received datagrams go to the usb queue with on_usbOutRxPacket
+///            and on_usbOutRxCopy, the frames of the uart queue are packed
+///            into one in transfer block by USBD_NCM_sendBatch.
+///
+///            Out: a transfer block is received into a reservation of the
+///            usb queue. The NDP16 chain is walked, the last datagram is
+///            committed from the reservation, the datagrams in front of it
+///            are copied.
+///
+///            In: a single frame is sent without copy, the NTH16 and NDP16
+///            are written into the headroom in front of the frame. Several
+///            frames are copied into the transfer block buffer.
+///
+///            The cdc ethernet control model class (ECM) shares the control
+///            and endpoint handling, it carries one frame per transfer
+///            without any header.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+#include "usbd_ncm.h"
+#include "main.h"
+#include "usbd_ctlreq.h"
+#include "queuex.h"
+#include "rndis_protocol.h"
+#include "usb_device.h"
+#include "stats.h"
+
+// Private defines ************************************************************
+#define ETH_HEADER_SIZE                   14
+#define ETH_MAX_PACKET_SIZE               ( ETH_HEADER_SIZE + 1500 )
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+#define NCM_RX_DATAGRAMS                  16u  /* datagrams per out transfer block, all but the last one are copied into the usb queue */
+#else
+#define NCM_RX_DATAGRAMS                  1u   /* the bip queue holds a single reservation, no copies */
+#endif
+
+#define NCM_NTH16_SIGNATURE               0x484D434Eu /* "NCMH" */
+#define NCM_NDP16_SIGNATURE               0x304D434Eu /* "NCM0", without crc */
+
+#define NCM_SET_ETHERNET_PACKET_FILTER    0x43
+#define NCM_GET_NTB_PARAMETERS            0x80
+#define NCM_GET_NTB_INPUT_SIZE            0x85
+#define NCM_SET_NTB_INPUT_SIZE            0x86
+
+#define NCM_NOTIFY_NETWORK_CONNECTION     0x00
+#define NCM_NOTIFY_SPEED_CHANGE           0x2A
+
+#define NCM_NOTIFY_STATE_SPEED            0 /* connection speed change is next */
+#define NCM_NOTIFY_STATE_CONNECTION       1 /* network connection is next */
+#define NCM_NOTIFY_STATE_DONE             2 /* host is informed */
+
+#define TX_STATE_READY                    0 /* initial transmitter state */
+#define TX_STATE_SENDING_DATA             1 /* sending the transfer block */
+#define TX_STATE_SENDING_ZLP              2 /* sending zero length packet */
+#define TX_STATE_RESET                    3 /* reset state, data interface not active */
+
+#define USB_CONFIGURATION_DESCRIPTOR_TYPE 0x02
+#define USB_INTERFACE_DESCRIPTOR_TYPE     0x04
+#define USB_ENDPOINT_DESCRIPTOR_TYPE      0x05
+#define USB_NOTIFICATION_INTERVAL_FS      0x01 /* 1 ms */
+#define USB_NOTIFICATION_INTERVAL_HS      0x04 /* 2^(4-1) microframes = 1 ms */
+
+// Private types     **********************************************************
+
+typedef struct
+{
+   uint16_t wLength;
+   uint16_t bmNtbFormatsSupported;
+   uint32_t dwNtbInMaxSize;
+   uint16_t wNdpInDivisor;
+   uint16_t wNdpInPayloadRemainder;
+   uint16_t wNdpInAlignment;
+   uint16_t wReserved;
+   uint32_t dwNtbOutMaxSize;
+   uint16_t wNdpOutDivisor;
+   uint16_t wNdpOutPayloadRemainder;
+   uint16_t wNdpOutAlignment;
+   uint16_t wNtbOutMaxDatagrams;
+} ncm_ntb_parameters_t;
+
+typedef struct
+{
+   uint8_t  bmRequestType;
+   uint8_t  bNotification;
+   uint16_t wValue;
+   uint16_t wIndex;
+   uint16_t wLength;
+   uint32_t data[2];
+} ncm_notification_t;
+
+// Private variables **********************************************************
+static uint8_t*               ncm_rx_buffer;
+static queue_reservation_t    ncm_rx_reservation;
+static volatile bool          ncm_rx_paused = false;                  // out endpoint not armed, the host is NAKed
+static uint32_t               ncm_tx_ntb[NCM_TX_NTBSIZE/4u];          // several frames packed into one transfer block
+static uint32_t               ncm_tx_maxNtbSize = NCM_TX_NTBSIZE;     // biggest in transfer block the host accepts
+static uint16_t               ncm_tx_sequence = 0;
+static uint8_t                ncm_altSetting = 0;                     // alternate setting of the data interface
+static bool                   ncm_ecm = false;                        // ecm framing, one frame per transfer
+static uint16_t               ncm_dataInSize = NCM_DATA_IN_SZ;        // bulk endpoint size of the negotiated speed
+static uint8_t                ncm_ctrlRequest = 0;                    // class request waiting for its data stage
+static uint32_t               ncm_ctrlBuffer[8];                      // data stage of the class requests
+static ncm_notification_t     ncm_notification;
+static uint8_t                ncm_notifyState = NCM_NOTIFY_STATE_DONE;
+static bool                   ncm_notifyBusy = false;                 // notification endpoint in use
+static volatile bool          ncm_mediaConnected = true;              // link state of the backend
+static uint8_t                ncm_macString[2u + 12u * 2u];
+static const uint8_t          station_hwaddr[6] = { NCM_HWADDR };
+
+// struct for the ncm transmission information and status
+static struct
+{
+   uint8_t  *ptr;
+   uint16_t size;
+   uint16_t state;
+   bool need_zlp;
+   uint16_t frames;        // frames in the transfer
+} tx =
+{
+   NULL,
+   0,
+   TX_STATE_RESET,
+   false,
+   0
+};
+
+// USB standard device descriptor
+__ALIGN_BEGIN static uint8_t USBD_NCM_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __ALIGN_END =
+{
+  USB_LEN_DEV_QUALIFIER_DESC,
+  USB_DESC_TYPE_DEVICE_QUALIFIER,
+  0x00,
+  0x02,
+  0x00,
+  0x00,
+  0x00,
+  0x40,
+  USBD_MAX_NUM_CONFIGURATION,
+  0x00,
+};
+
+// USB device configuration descriptor
+__ALIGN_BEGIN static uint8_t USBD_NCM_CfgDesc[] __ALIGN_END =
+{
+    /* Configuration descriptor */
+
+    9,                                 /* bLength         = 9 bytes. */
+    USB_CONFIGURATION_DESCRIPTOR_TYPE, /* bDescriptorType = CONFIGURATION */
+    0xDE, 0xAD,                        /* wTotalLength    = sizeof(USBD_NCM_CfgDesc) */
+    0x02,                              /* bNumInterfaces  = 2 */
+    0x01,                              /* bConfValue      = 1 */
+    0x00,                              /* iConfiguration  = unused. */
+    0x40,                              /* bmAttributes    = Self-Powered. */
+    0x01,                              /* MaxPower        = x2mA */
+
+    /* IAD descriptor */
+
+    0x08, /* bLength */
+    0x0B, /* bDescriptorType */
+    0x00, /* bFirstInterface */
+    0x02, /* bInterfaceCount */
+    0x02, /* bFunctionClass (Communications) */
+    0x0D, /* bFunctionSubClass (NCM) */
+    0x00, /* bFunctionProtocol */
+    0x00, /* iFunction */
+
+    /* Interface 0 descriptor */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType = INTERFACE */
+    0x00,                          /* bInterfaceNumber */
+    0x00,                          /* bAlternateSetting */
+    1,                             /* bNumEndpoints */
+    0x02,                          /* bInterfaceClass: Communications */
+    0x0D,                          /* bInterfaceSubClass: NCM */
+    0x00,                          /* bInterfaceProtocol */
+    0,                             /* iInterface */
+
+    /* Header Functional Descriptor */
+    0x05, /* bFunctionLength */
+    0x24, /* bDescriptorType = CS Interface */
+    0x00, /* bDescriptorSubtype */
+    0x10, /* bcdCDC = 1.10 */
+    0x01, /* bcdCDC = 1.10 */
+
+    /* Union Functional Descriptor */
+    0x05, /* bFunctionLength */
+    0x24, /* bDescriptorType = CS Interface */
+    0x06, /* bDescriptorSubtype = Union */
+    0x00, /* bControlInterface */
+    0x01, /* bSubordinateInterface0 */
+
+    /* Ethernet Networking Functional Descriptor */
+    0x0D,                 /* bFunctionLength */
+    0x24,                 /* bDescriptorType = CS Interface */
+    0x0F,                 /* bDescriptorSubtype = Ethernet Networking */
+    NCM_MAC_STRING_INDEX, /* iMACAddress */
+    0x00, 0x00, 0x00, 0x00, /* bmEthernetStatistics */
+    LOBYTE(ETH_MAX_PACKET_SIZE), HIBYTE(ETH_MAX_PACKET_SIZE), /* wMaxSegmentSize */
+    0x00, 0x00,           /* wNumberMCFilters */
+    0x00,                 /* bNumberPowerFilters */
+
+    /* NCM Functional Descriptor */
+    0x06, /* bFunctionLength */
+    0x24, /* bDescriptorType = CS Interface */
+    0x1A, /* bDescriptorSubtype = NCM */
+    0x00, /* bcdNcmVersion = 1.00 */
+    0x01, /* bcdNcmVersion = 1.00 */
+    0x00, /* bmNetworkCapabilities */
+
+    /* Endpoint descriptor for Communication Class Interface */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT */
+    NCM_NOTIFICATION_IN_EP,       /* bEndpointAddr   = IN - EP1 */
+    0x03,                         /* bmAttributes    = Interrupt endpoint */
+    NCM_NOTIFICATION_IN_SZ, 0,    /* wMaxPacketSize */
+    0x01,                         /* bInterval       = 1 ms polling from host */
+
+    /* Interface 1 descriptor, alternate setting 0 without endpoints */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType */
+    0x01,                          /* bInterfaceNumber */
+    0x00,                          /* bAlternateSetting */
+    0,                             /* bNumEndpoints */
+    0x0A,                          /* bInterfaceClass: CDC data */
+    0x00,                          /* bInterfaceSubClass */
+    0x01,                          /* bInterfaceProtocol: NTB */
+    0x00,                          /* iInterface */
+
+    /* Interface 1 descriptor, alternate setting 1 for the data transfer */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType */
+    0x01,                          /* bInterfaceNumber */
+    0x01,                          /* bAlternateSetting */
+    2,                             /* bNumEndpoints */
+    0x0A,                          /* bInterfaceClass: CDC data */
+    0x00,                          /* bInterfaceSubClass */
+    0x01,                          /* bInterfaceProtocol: NTB */
+    0x00,                          /* iInterface */
+
+    /* Endpoint descriptors for Data Class Interface */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT [IN] */
+    NCM_DATA_IN_EP,               /* bEndpointAddr   = IN EP */
+    0x02,                         /* bmAttributes    = BULK */
+    NCM_DATA_IN_SZ, 0,            /* wMaxPacketSize */
+    0,                            /* bInterval       = ignored for BULK */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT [OUT] */
+    NCM_DATA_OUT_EP,              /* bEndpointAddr   = OUT EP */
+    0x02,                         /* bmAttributes    = BULK */
+    NCM_DATA_OUT_SZ, 0,           /* wMaxPacketSize */
+    0                             /* bInterval       = ignored for BULK */
+};
+
+// USB device configuration descriptor of the ecm class
+__ALIGN_BEGIN static uint8_t USBD_ECM_CfgDesc[] __ALIGN_END =
+{
+    /* Configuration descriptor */
+
+    9,                                 /* bLength         = 9 bytes. */
+    USB_CONFIGURATION_DESCRIPTOR_TYPE, /* bDescriptorType = CONFIGURATION */
+    0xDE, 0xAD,                        /* wTotalLength    = sizeof(USBD_ECM_CfgDesc) */
+    0x02,                              /* bNumInterfaces  = 2 */
+    USBD_MAX_NUM_CONFIGURATION,        /* bConfValue      = last configuration */
+    0x00,                              /* iConfiguration  = unused. */
+    0x40,                              /* bmAttributes    = Self-Powered. */
+    0x01,                              /* MaxPower        = x2mA */
+
+    /* IAD descriptor */
+
+    0x08, /* bLength */
+    0x0B, /* bDescriptorType */
+    0x00, /* bFirstInterface */
+    0x02, /* bInterfaceCount */
+    0x02, /* bFunctionClass (Communications) */
+    0x06, /* bFunctionSubClass (ECM) */
+    0x00, /* bFunctionProtocol */
+    0x00, /* iFunction */
+
+    /* Interface 0 descriptor */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType = INTERFACE */
+    0x00,                          /* bInterfaceNumber */
+    0x00,                          /* bAlternateSetting */
+    1,                             /* bNumEndpoints */
+    0x02,                          /* bInterfaceClass: Communications */
+    0x06,                          /* bInterfaceSubClass: ECM */
+    0x00,                          /* bInterfaceProtocol */
+    0,                             /* iInterface */
+
+    /* Header Functional Descriptor */
+    0x05, /* bFunctionLength */
+    0x24, /* bDescriptorType = CS Interface */
+    0x00, /* bDescriptorSubtype */
+    0x10, /* bcdCDC = 1.10 */
+    0x01, /* bcdCDC = 1.10 */
+
+    /* Union Functional Descriptor */
+    0x05, /* bFunctionLength */
+    0x24, /* bDescriptorType = CS Interface */
+    0x06, /* bDescriptorSubtype = Union */
+    0x00, /* bControlInterface */
+    0x01, /* bSubordinateInterface0 */
+
+    /* Ethernet Networking Functional Descriptor */
+    0x0D,                 /* bFunctionLength */
+    0x24,                 /* bDescriptorType = CS Interface */
+    0x0F,                 /* bDescriptorSubtype = Ethernet Networking */
+    NCM_MAC_STRING_INDEX, /* iMACAddress */
+    0x00, 0x00, 0x00, 0x00, /* bmEthernetStatistics */
+    LOBYTE(ETH_MAX_PACKET_SIZE), HIBYTE(ETH_MAX_PACKET_SIZE), /* wMaxSegmentSize */
+    0x00, 0x00,           /* wNumberMCFilters */
+    0x00,                 /* bNumberPowerFilters */
+
+    /* Endpoint descriptor for Communication Class Interface */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT */
+    NCM_NOTIFICATION_IN_EP,       /* bEndpointAddr   = IN - EP1 */
+    0x03,                         /* bmAttributes    = Interrupt endpoint */
+    NCM_NOTIFICATION_IN_SZ, 0,    /* wMaxPacketSize */
+    0x01,                         /* bInterval       = 1 ms polling from host */
+
+    /* Interface 1 descriptor, alternate setting 0 without endpoints */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType */
+    0x01,                          /* bInterfaceNumber */
+    0x00,                          /* bAlternateSetting */
+    0,                             /* bNumEndpoints */
+    0x0A,                          /* bInterfaceClass: CDC data */
+    0x00,                          /* bInterfaceSubClass */
+    0x00,                          /* bInterfaceProtocol */
+    0x00,                          /* iInterface */
+
+    /* Interface 1 descriptor, alternate setting 1 for the data transfer */
+
+    9,                             /* bLength */
+    USB_INTERFACE_DESCRIPTOR_TYPE, /* bDescriptorType */
+    0x01,                          /* bInterfaceNumber */
+    0x01,                          /* bAlternateSetting */
+    2,                             /* bNumEndpoints */
+    0x0A,                          /* bInterfaceClass: CDC data */
+    0x00,                          /* bInterfaceSubClass */
+    0x00,                          /* bInterfaceProtocol */
+    0x00,                          /* iInterface */
+
+    /* Endpoint descriptors for Data Class Interface */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT [IN] */
+    NCM_DATA_IN_EP,               /* bEndpointAddr   = IN EP */
+    0x02,                         /* bmAttributes    = BULK */
+    NCM_DATA_IN_SZ, 0,            /* wMaxPacketSize */
+    0,                            /* bInterval       = ignored for BULK */
+
+    7,                            /* bLength         = 7 bytes */
+    USB_ENDPOINT_DESCRIPTOR_TYPE, /* bDescriptorType = ENDPOINT [OUT] */
+    NCM_DATA_OUT_EP,              /* bEndpointAddr   = OUT EP */
+    0x02,                         /* bmAttributes    = BULK */
+    NCM_DATA_OUT_SZ, 0,           /* wMaxPacketSize */
+    0                             /* bInterval       = ignored for BULK */
+};
+
+// high speed or other speed copy of a configuration descriptor
+__ALIGN_BEGIN static uint8_t USBD_NCM_SpeedCfgDesc[MAX(sizeof(USBD_NCM_CfgDesc), sizeof(USBD_ECM_CfgDesc))] __ALIGN_END;
+
+// Global variables ***********************************************************
+extern USBD_HandleTypeDef  hUsbDeviceFS;
+extern queue_handle_t      usbQueue;
+extern queue_handle_t      uartQueue;
+
+// Private function prototypes ************************************************
+static uint8_t    USBD_NCM_Init                             ( USBD_HandleTypeDef *pdev, uint8_t cfgidx );
+static uint8_t    USBD_ECM_Init                             ( USBD_HandleTypeDef *pdev, uint8_t cfgidx );
+static uint8_t    USBD_NCM_open                             ( USBD_HandleTypeDef *pdev );
+static uint8_t    USBD_NCM_DeInit                           ( USBD_HandleTypeDef *pdev, uint8_t cfgidx );
+static uint8_t    USBD_NCM_Setup                            ( USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req );
+static uint8_t    USBD_NCM_EP0_RxReady                      ( USBD_HandleTypeDef *pdev );
+static uint8_t    USBD_NCM_DataIn                           ( USBD_HandleTypeDef *pdev, uint8_t epnum );
+static uint8_t    USBD_NCM_DataOut                          ( USBD_HandleTypeDef *pdev, uint8_t epnum );
+static uint8_t    *USBD_NCM_GetFSCfgDesc                    ( uint16_t *length );
+static uint8_t    *USBD_ECM_GetFSCfgDesc                    ( uint16_t *length );
+static uint8_t    *USBD_NCM_GetHSCfgDesc                    ( uint16_t *length );
+static uint8_t    *USBD_NCM_GetOtherSpeedCfgDesc            ( uint16_t *length );
+static uint8_t    *USBD_ECM_GetHSCfgDesc                    ( uint16_t *length );
+static uint8_t    *USBD_ECM_GetOtherSpeedCfgDesc            ( uint16_t *length );
+static uint8_t    *USBD_NCM_speedCfgDesc                    ( const uint8_t *fsDesc, uint16_t fsLength, bool highSpeed, uint16_t *length );
+static uint8_t    *USBD_NCM_GetDeviceQualifierDescriptor    ( uint16_t *length );
+static uint8_t    *USBD_NCM_GetUsrStrDescriptor             ( USBD_HandleTypeDef *pdev, uint8_t index, uint16_t *length );
+static void       USBD_NCM_setAltSetting                    ( USBD_HandleTypeDef *pdev, uint8_t altSetting );
+static void       USBD_NCM_notify                           ( USBD_HandleTypeDef *pdev );
+static void       USBD_NCM_handleNtb                        ( const uint8_t *data, uint32_t size );
+static void       USBD_ECM_handleFrame                      ( const uint8_t *data, uint32_t size );
+static void       USBD_NCM_rxArm                            ( USBD_HandleTypeDef *pdev );
+
+// NCM interface class callbacks structure
+static USBD_ClassTypeDef USBD_NCM =
+{
+  USBD_NCM_Init,
+  USBD_NCM_DeInit,
+  USBD_NCM_Setup,
+  NULL,                 // EP0_TxSent
+  USBD_NCM_EP0_RxReady,
+  USBD_NCM_DataIn,
+  USBD_NCM_DataOut,
+  NULL,
+  NULL,
+  NULL,
+  USBD_NCM_GetHSCfgDesc,
+  USBD_NCM_GetFSCfgDesc,
+  USBD_NCM_GetOtherSpeedCfgDesc,
+  USBD_NCM_GetDeviceQualifierDescriptor,
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+  USBD_NCM_GetUsrStrDescriptor,
+#endif
+};
+
+// ECM interface class callbacks structure
+static USBD_ClassTypeDef USBD_ECM =
+{
+  USBD_ECM_Init,
+  USBD_NCM_DeInit,
+  USBD_NCM_Setup,
+  NULL,                 // EP0_TxSent
+  USBD_NCM_EP0_RxReady,
+  USBD_NCM_DataIn,
+  USBD_NCM_DataOut,
+  NULL,
+  NULL,
+  NULL,
+  USBD_ECM_GetHSCfgDesc,
+  USBD_ECM_GetFSCfgDesc,
+  USBD_ECM_GetOtherSpeedCfgDesc,
+  USBD_NCM_GetDeviceQualifierDescriptor,
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+  USBD_NCM_GetUsrStrDescriptor,
+#endif
+};
+
+//------------------------------------------------------------------------------
+/// \brief     Returns ncm class struct.
+///
+/// \param     none
+///
+/// \return    USBD_ClassTypeDef*
+USBD_ClassTypeDef* USBD_NCM_getClass( void )
+{
+   return &USBD_NCM;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns ecm class struct.
+///
+/// \param     none
+///
+/// \return    USBD_ClassTypeDef*
+USBD_ClassTypeDef* USBD_ECM_getClass( void )
+{
+   return &USBD_ECM;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ncm init function. Called by the usb stack.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t cfgidx (unused)
+///
+/// \return    init status
+static uint8_t USBD_NCM_Init( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
+{
+   UNUSED(cfgidx);
+
+   ncm_ecm = false;
+   return USBD_NCM_open( pdev );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ecm init function. Called by the usb stack.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t cfgidx (unused)
+///
+/// \return    init status
+static uint8_t USBD_ECM_Init( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
+{
+   UNUSED(cfgidx);
+
+   ncm_ecm = true;
+   return USBD_NCM_open( pdev );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Opens the notification endpoint for both classes. The data
+///            endpoints are opened with the alternate setting 1 of the data
+///            interface.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+///
+/// \return    init status
+static uint8_t USBD_NCM_open( USBD_HandleTypeDef *pdev )
+{
+   // Open the notification endpoint
+   USBD_LL_OpenEP( pdev, NCM_NOTIFICATION_IN_EP, USBD_EP_TYPE_INTR, NCM_NOTIFICATION_IN_SZ );
+
+   ncm_altSetting = 0;
+   ncm_notifyState = NCM_NOTIFY_STATE_DONE;
+   ncm_notifyBusy = false;
+   tx.state = TX_STATE_RESET;
+
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ncm deinit function. Called by the usb stack.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t cfgidx (unused)
+///
+/// \return    status
+static uint8_t USBD_NCM_DeInit( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
+{
+   UNUSED(cfgidx);
+
+   // Close notification endpoint
+   USBD_LL_CloseEP( pdev, NCM_NOTIFICATION_IN_EP );
+
+   // Close the data endpoints
+   USBD_NCM_setAltSetting( pdev, 0 );
+
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ncm setup function. Called by the usb stack. Handles the ntb
+///            class requests and the alternate setting of the data interface.
+///            Ecm knows only the packet filter request.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     USBD_SetupReqTypedef *req
+///
+/// \return    status
+static uint8_t USBD_NCM_Setup( USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req )
+{
+   static uint8_t altSetting;
+
+   switch ( req->bmRequest & USB_REQ_TYPE_MASK )
+   {
+      case USB_REQ_TYPE_CLASS :
+         if( ncm_ecm && req->bRequest != NCM_SET_ETHERNET_PACKET_FILTER )
+         {
+            USBD_CtlError( pdev, req );
+            return USBD_FAIL;
+         }
+         switch( req->bRequest )
+         {
+            case NCM_GET_NTB_PARAMETERS:
+               {
+                  ncm_ntb_parameters_t *p = (ncm_ntb_parameters_t *)ncm_ctrlBuffer;
+                  memset(p, 0, sizeof(ncm_ntb_parameters_t));
+                  p->wLength                 = sizeof(ncm_ntb_parameters_t);
+                  p->bmNtbFormatsSupported   = 0x0001; // NTB16
+                  p->dwNtbInMaxSize          = NCM_TX_NTBSIZE;
+                  p->wNdpInDivisor           = NCM_ALIGNMENT;
+                  p->wNdpInPayloadRemainder  = NCM_PAYLOAD_REMAINDER;
+                  p->wNdpInAlignment         = NCM_ALIGNMENT;
+                  p->dwNtbOutMaxSize         = QUEUEBUFFERLENGTH;
+                  p->wNdpOutDivisor          = NCM_ALIGNMENT;
+                  p->wNdpOutPayloadRemainder = NCM_PAYLOAD_REMAINDER;
+                  p->wNdpOutAlignment        = NCM_ALIGNMENT;
+                  p->wNtbOutMaxDatagrams     = NCM_RX_DATAGRAMS;
+                  USBD_CtlSendData( pdev, (uint8_t *)p, MIN(req->wLength, sizeof(ncm_ntb_parameters_t)) );
+               }
+               return USBD_OK;
+
+            case NCM_GET_NTB_INPUT_SIZE:
+               ncm_ctrlBuffer[0] = ncm_tx_maxNtbSize;
+               USBD_CtlSendData( pdev, (uint8_t *)ncm_ctrlBuffer, MIN(req->wLength, 4u) );
+               return USBD_OK;
+
+            case NCM_SET_NTB_INPUT_SIZE:
+               ncm_ctrlRequest = req->bRequest;
+               USBD_CtlPrepareRx( pdev, (uint8_t *)ncm_ctrlBuffer, MIN(req->wLength, sizeof(ncm_ctrlBuffer)) );
+               return USBD_OK;
+
+            case NCM_SET_ETHERNET_PACKET_FILTER:
+               // all frames are forwarded, the filter is accepted as is
+               return USBD_OK;
+
+            default:
+               USBD_CtlError( pdev, req );
+               return USBD_FAIL;
+         }
+
+      case USB_REQ_TYPE_STANDARD:
+         switch( req->bRequest )
+         {
+            case USB_REQ_GET_INTERFACE:
+               altSetting = ( LOBYTE(req->wIndex) == 1u ) ? ncm_altSetting : 0u;
+               USBD_CtlSendData( pdev, &altSetting, 1u );
+               return USBD_OK;
+
+            case USB_REQ_SET_INTERFACE:
+               if( pdev->dev_state != USBD_STATE_CONFIGURED || req->wValue > ( LOBYTE(req->wIndex) == 1u ? 1u : 0u ) )
+               {
+                  USBD_CtlError( pdev, req );
+                  return USBD_FAIL;
+               }
+               if( LOBYTE(req->wIndex) == 1u )
+               {
+                  USBD_NCM_setAltSetting( pdev, (uint8_t)req->wValue );
+               }
+               return USBD_OK;
+
+            default:
+               return USBD_OK;
+         }
+
+      default:
+         return USBD_OK;
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Endpoint 0 (ctrl endpoint) ready function called by the usb
+///            stack with the data stage of a class request.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+///
+/// \return    status
+static uint8_t USBD_NCM_EP0_RxReady( USBD_HandleTypeDef *pdev )
+{
+   UNUSED(pdev);
+
+   if( ncm_ctrlRequest == NCM_SET_NTB_INPUT_SIZE )
+   {
+      // the host may only lower the in transfer block size
+      ncm_tx_maxNtbSize = MIN(ncm_ctrlBuffer[0], NCM_TX_NTBSIZE);
+   }
+   ncm_ctrlRequest = 0;
+
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Opens or closes the data endpoints with the alternate setting
+///            of the data interface. Alternate setting 1 starts the data
+///            transfer and informs the host about speed and connection.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t altSetting
+///
+/// \return    none
+static void USBD_NCM_setAltSetting( USBD_HandleTypeDef *pdev, uint8_t altSetting )
+{
+   if( altSetting == ncm_altSetting )
+   {
+      return;
+   }
+   ncm_altSetting = altSetting;
+
+   if( altSetting == 1u )
+   {
+      ncm_dataInSize = ( pdev->dev_speed == USBD_SPEED_HIGH ) ? NCM_DATA_HS_SZ : NCM_DATA_IN_SZ;
+      USBD_LL_OpenEP( pdev, NCM_DATA_IN_EP, USBD_EP_TYPE_BULK, ncm_dataInSize );
+      USBD_LL_OpenEP( pdev, NCM_DATA_OUT_EP, USBD_EP_TYPE_BULK, ( pdev->dev_speed == USBD_SPEED_HIGH ) ? NCM_DATA_HS_SZ : NCM_DATA_OUT_SZ );
+      ncm_tx_maxNtbSize = NCM_TX_NTBSIZE;
+      ncm_tx_sequence = 0;
+      tx.state = TX_STATE_READY;
+
+      // Prepare Out endpoint to receive next transfer block
+      __disable_irq();
+      USBD_NCM_rxArm( pdev );
+      __enable_irq();
+
+      ncm_notifyState = NCM_NOTIFY_STATE_SPEED;
+      USBD_NCM_notify( pdev );
+      return;
+   }
+
+   USBD_LL_CloseEP( pdev, NCM_DATA_IN_EP );
+   USBD_LL_CloseEP( pdev, NCM_DATA_OUT_EP );
+   ncm_rx_paused = false;
+
+   // frames in an aborted transfer are released, they would block the
+   // queue, the waiting frames are dropped
+   queue_flush( &uartQueue, ( tx.state == TX_STATE_SENDING_DATA || tx.state == TX_STATE_SENDING_ZLP ) ? tx.frames : 0u );
+   tx.state = TX_STATE_RESET;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Sends the next notification on the interrupt endpoint, first
+///            the connection speed, then the network connection. Called again
+///            from the in complete of the notification endpoint. Has to be
+///            called from the usb irq or with disabled irq's.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+///
+/// \return    none
+static void USBD_NCM_notify( USBD_HandleTypeDef *pdev )
+{
+   if( ncm_notifyBusy )
+   {
+      return;
+   }
+   ncm_notification.bmRequestType = 0xA1;
+   ncm_notification.wIndex = 0;
+
+   switch( ncm_notifyState )
+   {
+      case NCM_NOTIFY_STATE_SPEED:
+         ncm_notification.bNotification = NCM_NOTIFY_SPEED_CHANGE;
+         ncm_notification.wValue = 0;
+         ncm_notification.wLength = 8;
+         ncm_notification.data[0] = ( pdev->dev_speed == USBD_SPEED_HIGH ) ? NCM_LINK_SPEED_HS : NCM_LINK_SPEED_FS;   // downlink
+         ncm_notification.data[1] = ncm_notification.data[0];                                                        // uplink
+         ncm_notifyState = NCM_NOTIFY_STATE_CONNECTION;
+         ncm_notifyBusy = true;
+         USBD_LL_Transmit( pdev, NCM_NOTIFICATION_IN_EP, (uint8_t *)&ncm_notification, sizeof(ncm_notification_t) );
+         break;
+
+      case NCM_NOTIFY_STATE_CONNECTION:
+         ncm_notification.bNotification = NCM_NOTIFY_NETWORK_CONNECTION;
+         ncm_notification.wValue = ncm_mediaConnected ? 1u : 0u;
+         ncm_notification.wLength = 0;
+         ncm_notifyState = NCM_NOTIFY_STATE_DONE;
+         ncm_notifyBusy = true;
+         USBD_LL_Transmit( pdev, NCM_NOTIFICATION_IN_EP, (uint8_t *)&ncm_notification, 8u );
+         break;
+
+      default:
+         break;
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Sets the link state of the backend. A change is reported with
+///            a network connection notification while the data interface is
+///            active, otherwise with the next activation.
+///
+/// \param     [in]  bool connected
+///
+/// \return    none
+void USBD_NCM_setMediaState( bool connected )
+{
+   __disable_irq();
+   if( connected != ncm_mediaConnected )
+   {
+      ncm_mediaConnected = connected;
+      if( ncm_altSetting == 1u )
+      {
+         if( ncm_notifyState == NCM_NOTIFY_STATE_DONE )
+         {
+            ncm_notifyState = NCM_NOTIFY_STATE_CONNECTION;
+         }
+         USBD_NCM_notify( &hUsbDeviceFS );
+      }
+   }
+   __enable_irq();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Data input function called by the usb stack.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t epnum
+///
+/// \return    status
+static uint8_t USBD_NCM_DataIn( USBD_HandleTypeDef *pdev, uint8_t epnum )
+{
+   epnum &= 0x0F;
+   if( epnum == (NCM_NOTIFICATION_IN_EP & 0x0F) )
+   {
+      ncm_notifyBusy = false;
+      USBD_NCM_notify( pdev );
+      return USBD_OK;
+   }
+
+   if( epnum == (NCM_DATA_IN_EP & 0x0F) )
+   {
+      if( tx.state == TX_STATE_SENDING_DATA )
+      {
+         if( tx.need_zlp )
+         {
+            stats_add( STATS_USB_TX_ZLP, 1 );
+            USBD_LL_Transmit( pdev, NCM_DATA_IN_EP, NULL, 0 );
+            tx.state = TX_STATE_SENDING_ZLP;
+            return USBD_OK;
+         }
+         tx.state = TX_STATE_READY;
+         on_usbInTxCplt( tx.frames );
+         return USBD_OK;
+      }
+
+      if( tx.state == TX_STATE_SENDING_ZLP )
+      {
+         tx.state = TX_STATE_READY;
+         on_usbInTxCplt( tx.frames );
+         return USBD_OK;
+      }
+   }
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Handles an out transfer block. The NDP16 chain is walked and the
+///            datagrams are checked against the block length, up to
+///            NCM_RX_DATAGRAMS are accepted. The last datagram is committed
+///            from the reservation the block was received into, the
+///            datagrams in front of it are copied into the usb queue.
+///
+/// \param     [in]  const uint8_t *data
+/// \param     [in]  uint32_t size
+///
+/// \return    none
+static void USBD_NCM_handleNtb( const uint8_t *data, uint32_t size )
+{
+   const ncm_nth16_t *nth = (const ncm_nth16_t *)data;
+   const ncm_ndp16_t *ndp;
+   ncm_datagram_t datagram[NCM_RX_DATAGRAMS];
+   uint32_t datagrams = 0;
+   uint32_t blockLength;
+   uint32_t ndpIndex;
+   uint32_t ndps = 0;
+
+   if( size < sizeof(ncm_nth16_t)
+      || nth->dwSignature != NCM_NTH16_SIGNATURE
+      || nth->wHeaderLength != sizeof(ncm_nth16_t)
+      || nth->wBlockLength > size )
+   {
+      stats_add( STATS_USB_RX_ERRORS, 1 );
+      return;
+   }
+   blockLength = nth->wBlockLength;
+   ndpIndex = nth->wNdpIndex;
+
+   while( ndpIndex != 0 )
+   {
+      ndp = (const ncm_ndp16_t *)&data[ndpIndex];
+      if( ( ndpIndex & ( NCM_ALIGNMENT - 1u ) ) != 0
+         || ndpIndex < sizeof(ncm_nth16_t)
+         || ndpIndex + sizeof(ncm_ndp16_t) > blockLength
+         || ndp->dwSignature != NCM_NDP16_SIGNATURE
+         || ndp->wLength < NCM_NDP_LENGTH(1u)
+         || ndpIndex + ndp->wLength > blockLength
+         || ++ndps > NCM_RX_DATAGRAMS )
+      {
+         stats_add( STATS_USB_RX_ERRORS, 1 );
+         return;
+      }
+
+      for( uint32_t i = 0; sizeof(ncm_ndp16_t) + ( i + 1u ) * sizeof(ncm_datagram_t) <= ndp->wLength; i++ )
+      {
+         if( ndp->datagram[i].wDatagramIndex == 0 || ndp->datagram[i].wDatagramLength == 0 )
+         {
+            break;
+         }
+         if( ndp->datagram[i].wDatagramIndex < sizeof(ncm_nth16_t)
+            || ndp->datagram[i].wDatagramIndex + ndp->datagram[i].wDatagramLength > blockLength
+            || ndp->datagram[i].wDatagramLength > ETH_MAX_PACKET_SIZE
+            || datagrams == NCM_RX_DATAGRAMS )
+         {
+            stats_add( STATS_USB_RX_ERRORS, 1 );
+            return;
+         }
+         datagram[datagrams++] = ndp->datagram[i];
+      }
+      ndpIndex = ndp->wNextNdpIndex;
+   }
+
+   if( datagrams == 0 )
+   {
+      stats_add( STATS_USB_RX_ERRORS, 1 );
+      return;
+   }
+
+#if NCM_RX_DATAGRAMS > 1u
+   for( uint32_t i = 0; i < datagrams - 1u; i++ )
+   {
+      on_usbOutRxCopy( (const char *)&data[datagram[i].wDatagramIndex], datagram[i].wDatagramLength );
+   }
+#endif
+
+   // last datagram, the frame stays in the reservation
+   on_usbOutRxPacket( &ncm_rx_reservation, (const char *)&data[datagram[datagrams - 1u].wDatagramIndex], datagram[datagrams - 1u].wDatagramLength );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Handles an ecm out transfer, which carries exactly one frame.
+///            The frame is committed from the reservation.
+///
+/// \param     [in]  const uint8_t *data
+/// \param     [in]  uint32_t size
+///
+/// \return    none
+static void USBD_ECM_handleFrame( const uint8_t *data, uint32_t size )
+{
+   if( size < ETH_HEADER_SIZE || size > ETH_MAX_PACKET_SIZE )
+   {
+      stats_add( STATS_USB_RX_ERRORS, 1 );
+      return;
+   }
+
+   on_usbOutRxPacket( &ncm_rx_reservation, (const char *)data, (int)size );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Data received on non-control Out endpoint called by the usb
+///            stack.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t epnum
+///
+/// \return    status
+static uint8_t USBD_NCM_DataOut( USBD_HandleTypeDef *pdev, uint8_t epnum )
+{
+   if( epnum == NCM_DATA_OUT_EP && ncm_altSetting == 1u )
+   {
+      if( ncm_ecm )
+      {
+         USBD_ECM_handleFrame( ncm_rx_buffer, USBD_LL_GetRxDataSize( pdev, epnum ) );
+      }
+      else
+      {
+         USBD_NCM_handleNtb( ncm_rx_buffer, USBD_LL_GetRxDataSize( pdev, epnum ) );
+      }
+      __disable_irq();
+      USBD_NCM_rxArm( pdev );
+      __enable_irq();
+   }
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns if ncm usb is ready to send next transfer block.
+///
+/// \param     none
+///
+/// \return    bool
+bool USBD_NCM_canSend( void )
+{
+   return tx.state == TX_STATE_READY;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Sends a single frame without copy. The NTH16 and the NDP16 with
+///            one datagram entry are written into the headroom in front of
+///            the frame, ecm sends the frame as it is.
+///
+/// \param     [in]  const void *data
+/// \param     [in]  uint16_t size
+///
+/// \return    bool
+bool USBD_NCM_send( const void *data, uint16_t size )
+{
+   ncm_nth16_t *nth;
+   ncm_ndp16_t *ndp;
+
+   if( tx.state != TX_STATE_READY )
+   {
+      return false;
+   }
+   if( size > ETH_MAX_PACKET_SIZE )
+   {
+      stats_add( STATS_USB_TX_ERRORS, 1 );
+      return false;
+   }
+
+   __disable_irq();
+
+   if( ncm_ecm )
+   {
+      tx.ptr = (uint8_t *)data;
+      tx.size = size;
+      tx.frames = 1;
+      tx.need_zlp = ( tx.size & (ncm_dataInSize - 1) ) == 0;
+      USBD_LL_Transmit(&hUsbDeviceFS, NCM_DATA_IN_EP, tx.ptr, (uint32_t)tx.size);
+      tx.state = TX_STATE_SENDING_DATA;
+      __enable_irq();
+      return true;
+   }
+
+   tx.ptr = (uint8_t *)data - NCM_TX_HEADROOM;   // there is allocated memory in front of data for the usb header
+   tx.size = size + NCM_TX_HEADROOM;
+   tx.frames = 1;
+
+   nth = (ncm_nth16_t *)tx.ptr;
+   nth->dwSignature     = NCM_NTH16_SIGNATURE;
+   nth->wHeaderLength   = sizeof(ncm_nth16_t);
+   nth->wSequence       = ncm_tx_sequence++;
+   nth->wBlockLength    = tx.size;
+   nth->wNdpIndex       = sizeof(ncm_nth16_t);
+
+   ndp = (ncm_ndp16_t *)&tx.ptr[sizeof(ncm_nth16_t)];
+   ndp->dwSignature     = NCM_NDP16_SIGNATURE;
+   ndp->wLength         = NCM_NDP_LENGTH(1u);
+   ndp->wNextNdpIndex   = 0;
+   ndp->datagram[0].wDatagramIndex  = NCM_TX_HEADROOM;
+   ndp->datagram[0].wDatagramLength = size;
+   ndp->datagram[1].wDatagramIndex  = 0;
+   ndp->datagram[1].wDatagramLength = 0;
+
+   // the block is padded with the byte behind the frame (tailroom of the
+   // queue) instead of a zero length packet
+   if( ( tx.size & (ncm_dataInSize - 1) ) == 0 )
+   {
+      tx.size++;
+      nth->wBlockLength = tx.size;
+      stats_add( STATS_USB_TX_PADDED, 1 );
+   }
+   tx.need_zlp = false;
+
+   USBD_LL_Transmit(&hUsbDeviceFS, NCM_DATA_IN_EP, tx.ptr, (uint32_t)tx.size);
+   tx.state = TX_STATE_SENDING_DATA;
+
+   __enable_irq();
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Requests to send several frames in one transfer block. The
+///            frames are copied 4 byte aligned behind the NTH16 and the NDP16
+///            as long as the block stays within the block buffer and the in
+///            size set by the host. A single frame is sent without copy. A
+///            block of a multiple of the endpoint size gets a padding byte
+///            instead of a zero length packet.
+///
+/// \param     [in]  const queue_frame_t *frames
+/// \param     [in]  uint16_t count
+///
+/// \return    uint16_t frames taken, 0 = busy
+uint16_t USBD_NCM_sendBatch( const queue_frame_t *frames, uint16_t count )
+{
+   uint8_t  *ntb = (uint8_t *)ncm_tx_ntb;
+   ncm_nth16_t *nth = (ncm_nth16_t *)ntb;
+   ncm_ndp16_t *ndp = (ncm_ndp16_t *)&ntb[sizeof(ncm_nth16_t)];
+   uint32_t limit = MIN(ncm_tx_maxNtbSize, NCM_TX_NTBSIZE);
+   uint32_t payload = 0;
+   uint32_t length;
+   uint16_t taken = 0;
+
+   if( tx.state != TX_STATE_READY )
+   {
+      return 0;
+   }
+
+   // Count the frames which fit, one byte is kept free for the padding.
+   while( taken < count
+      && sizeof(ncm_nth16_t) + NCM_NDP_LENGTH(taken + 1u) + NCM_ALIGN(payload) + NCM_PAYLOAD_REMAINDER + frames[taken].dataLength + 1u <= limit )
+   {
+      payload = NCM_ALIGN(payload) + NCM_PAYLOAD_REMAINDER + frames[taken].dataLength;
+      taken++;
+   }
+
+   // A single frame is sent without copy, ecm has no aggregation.
+   if( taken < 2u || ncm_ecm )
+   {
+      return USBD_NCM_send( frames[0].dataStart, frames[0].dataLength ) ? 1u : 0u;
+   }
+
+   ndp->dwSignature     = NCM_NDP16_SIGNATURE;
+   ndp->wLength         = NCM_NDP_LENGTH(taken);
+   ndp->wNextNdpIndex   = 0;
+   length = sizeof(ncm_nth16_t) + NCM_NDP_LENGTH(taken);
+   for( uint16_t i = 0; i < taken; i++ )
+   {
+      length = NCM_ALIGN(length) + NCM_PAYLOAD_REMAINDER;
+      ndp->datagram[i].wDatagramIndex  = (uint16_t)length;
+      ndp->datagram[i].wDatagramLength = frames[i].dataLength;
+      memcpy( &ntb[length], frames[i].dataStart, frames[i].dataLength );
+      length += frames[i].dataLength;
+   }
+   ndp->datagram[taken].wDatagramIndex  = 0;
+   ndp->datagram[taken].wDatagramLength = 0;
+
+   // A block of a multiple of the endpoint size would need a zero length
+   // packet, the block gets a padding byte instead.
+   if( ( length & (ncm_dataInSize - 1) ) == 0 )
+   {
+      ntb[length++] = 0;
+      stats_add( STATS_USB_TX_PADDED, 1 );
+   }
+
+   nth->dwSignature     = NCM_NTH16_SIGNATURE;
+   nth->wHeaderLength   = sizeof(ncm_nth16_t);
+   nth->wSequence       = ncm_tx_sequence++;
+   nth->wBlockLength    = (uint16_t)length;
+   nth->wNdpIndex       = sizeof(ncm_nth16_t);
+
+   __disable_irq();
+   tx.ptr = ntb;
+   tx.size = (uint16_t)length;
+   tx.need_zlp = false;
+   tx.frames = taken;
+   USBD_LL_Transmit(&hUsbDeviceFS, NCM_DATA_IN_EP, tx.ptr, (uint32_t)tx.size);
+   tx.state = TX_STATE_SENDING_DATA;
+   __enable_irq();
+
+   return taken;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Arms the out endpoint for the next transfer block, received
+///            directly into a reservation of the usb queue. If the usb queue
+///            has no room, the endpoint is left unarmed and the host gets a
+///            NAK until USBD_NCM_rxResume is called. Has to be called with
+///            disabled irq's.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+///
+/// \return    none
+static void USBD_NCM_rxArm( USBD_HandleTypeDef *pdev )
+{
+   uint32_t offset = ncm_ecm ? QUEUEFRAMEALIGN : 0u;   // an ecm frame is placed like an ncm datagram
+   
+   ncm_rx_buffer = queue_reserve( &ncm_rx_reservation, QUEUEBUFFERLENGTH, &usbQueue );
+   ncm_rx_paused = ( ncm_rx_buffer == NULL );
+   if( !ncm_rx_paused )
+   {
+      ncm_rx_buffer += offset;
+      USBD_LL_PrepareReceive( pdev, NCM_DATA_OUT_EP, ncm_rx_buffer, QUEUEBUFFERLENGTH - offset );
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Arms the out endpoint again after it has been left unarmed
+///            because of a full usb queue. Linked as input resume of the usb
+///            queue, it is called after the queue has released slots.
+///
+/// \param     none
+///
+/// \return    none
+void USBD_NCM_rxResume( void )
+{
+   if( !ncm_rx_paused )
+   {
+      return;
+   }
+
+   __disable_irq();
+   if( ncm_rx_paused && ncm_altSetting == 1u )
+   {
+      USBD_NCM_rxArm( &hUsbDeviceFS );
+   }
+   __enable_irq();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return configuration descriptor.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_NCM_GetFSCfgDesc( uint16_t *length )
+{
+   *length = (uint16_t)sizeof(USBD_NCM_CfgDesc);
+   USBD_NCM_CfgDesc[2] = sizeof(USBD_NCM_CfgDesc) & 0xFF;
+   USBD_NCM_CfgDesc[3] = (sizeof(USBD_NCM_CfgDesc) >> 8) & 0xFF;
+   return USBD_NCM_CfgDesc;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return configuration descriptor of the ecm class.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_ECM_GetFSCfgDesc( uint16_t *length )
+{
+   *length = (uint16_t)sizeof(USBD_ECM_CfgDesc);
+   USBD_ECM_CfgDesc[2] = sizeof(USBD_ECM_CfgDesc) & 0xFF;
+   USBD_ECM_CfgDesc[3] = (sizeof(USBD_ECM_CfgDesc) >> 8) & 0xFF;
+   return USBD_ECM_CfgDesc;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return high speed configuration descriptor.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_NCM_GetHSCfgDesc( uint16_t *length )
+{
+   return USBD_NCM_speedCfgDesc( USBD_NCM_GetFSCfgDesc( length ), sizeof(USBD_NCM_CfgDesc), true, length );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return other speed configuration descriptor. Only requested by
+///            a high speed host, so the other speed is full speed.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_NCM_GetOtherSpeedCfgDesc( uint16_t *length )
+{
+   return USBD_NCM_speedCfgDesc( USBD_NCM_GetFSCfgDesc( length ), sizeof(USBD_NCM_CfgDesc), false, length );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return high speed configuration descriptor of the ecm class.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_ECM_GetHSCfgDesc( uint16_t *length )
+{
+   return USBD_NCM_speedCfgDesc( USBD_ECM_GetFSCfgDesc( length ), sizeof(USBD_ECM_CfgDesc), true, length );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return other speed configuration descriptor of the ecm class.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_ECM_GetOtherSpeedCfgDesc( uint16_t *length )
+{
+   return USBD_NCM_speedCfgDesc( USBD_ECM_GetFSCfgDesc( length ), sizeof(USBD_ECM_CfgDesc), false, length );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Builds a copy of a configuration descriptor for the speed, the
+///            core overwrites the descriptor type of the other speed. The
+///            bulk endpoints get 512 bytes on high speed, the interrupt
+///            endpoint keeps its 1 ms interval.
+///
+/// \param     [in]  const uint8_t *fsDesc
+/// \param     [in]  uint16_t fsLength
+/// \param     [in]  bool highSpeed
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_NCM_speedCfgDesc( const uint8_t *fsDesc, uint16_t fsLength, bool highSpeed, uint16_t *length )
+{
+   uint8_t *desc = USBD_NCM_SpeedCfgDesc;
+
+   memcpy( desc, fsDesc, fsLength );
+   for( uint32_t i = 0; i + 7u <= fsLength && desc[i] != 0; i += desc[i] )
+   {
+      if( desc[i + 1u] != USB_ENDPOINT_DESCRIPTOR_TYPE )
+      {
+         continue;
+      }
+      if( ( desc[i + 3u] & 0x03 ) == 0x02 )
+      {
+         desc[i + 4u] = LOBYTE( highSpeed ? NCM_DATA_HS_SZ : NCM_DATA_IN_SZ );
+         desc[i + 5u] = HIBYTE( highSpeed ? NCM_DATA_HS_SZ : NCM_DATA_IN_SZ );
+      }
+      else
+      {
+         desc[i + 6u] = highSpeed ? USB_NOTIFICATION_INTERVAL_HS : USB_NOTIFICATION_INTERVAL_FS;
+      }
+   }
+   *length = fsLength;
+   return desc;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Return device qualifier descriptor.
+///
+/// \param     [in]  uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_NCM_GetDeviceQualifierDescriptor( uint16_t *length )
+{
+  *length = (uint16_t)sizeof(USBD_NCM_DeviceQualifierDesc);
+
+  return USBD_NCM_DeviceQualifierDesc;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns the class specific string descriptors, the MAC-address
+///            of the host interface referenced by the ethernet networking
+///            functional descriptor.
+///
+/// \param     [in]  USBD_HandleTypeDef *pdev
+/// \param     [in]  uint8_t index
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer, NULL = unknown index
+static uint8_t *USBD_NCM_GetUsrStrDescriptor( USBD_HandleTypeDef *pdev, uint8_t index, uint16_t *length )
+{
+   static const char hex[] = "0123456789ABCDEF";
+
+   UNUSED(pdev);
+
+   if( index != NCM_MAC_STRING_INDEX )
+   {
+      *length = 0;
+      return NULL;
+   }
+
+   ncm_macString[0] = sizeof(ncm_macString);
+   ncm_macString[1] = USB_DESC_TYPE_STRING;
+   for( uint32_t i = 0; i < sizeof(station_hwaddr); i++ )
+   {
+      ncm_macString[2u + i * 4u]      = hex[station_hwaddr[i] >> 4];
+      ncm_macString[2u + i * 4u + 1u] = 0;
+      ncm_macString[2u + i * 4u + 2u] = hex[station_hwaddr[i] & 0x0F];
+      ncm_macString[2u + i * 4u + 3u] = 0;
+   }
+   *length = sizeof(ncm_macString);
+
+   return ncm_macString;
+}
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,114 @@
+// ****************************************************************************
+/// \file      usbd_ncm.h
+///
+/// \brief     CDC-NCM device C header file
+///
+/// \details   Usb network control model class, built alongside the rndis
+///            class and selected with USBD_CLASS. The frames are carried in
+///            NTB16 transfer blocks, several frames per transfer in both
+///            directions. The cdc-ecm class for the composite configuration
+///            is built from the same code, the send and resume functions
+///            serve the class which is active.
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre
+///
+/// \bug
+///
+/// \warning   The out endpoint is NAKed while the usb queue is full, there is
+///            no discard mode like RNDIS_RX_FLOWCONTROL 0.
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __USBD_NCM_H_
+#define __USBD_NCM_H_
+
+// Include ********************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include "stm32f4xx.h"
+#include "stm32f4xx_hal.h"
+#include "usbd_ioreq.h"
+#include "queuex.h"
+
+// Exported defines ***********************************************************
+#define NCM_LINK_SPEED_FS     12000000                       /* Link baudrate (12Mbit/s for USB-FS) */
+#define NCM_LINK_SPEED_HS     480000000                      /* Link baudrate (480Mbit/s for USB-HS) */
+#define NCM_DATA_HS_SZ        512u                           /* bulk endpoint size on high speed */
+#define NCM_HWADDR            0x20,0x89,0x84,0x6A,0x96,0xAB  /* MAC-address to set to host interface */
+#define NCM_MAC_STRING_INDEX  6u                             /* string descriptor index of the MAC-address */
+#define NCM_TX_NTBSIZE        2048u                          /* buffer for several frames in one in transfer block, bytes */
+#define NCM_ALIGNMENT         4u                             /* ndp and datagram alignment in both directions */
+#define NCM_ALIGN(x)          ( ( (x) + NCM_ALIGNMENT - 1u ) & ~( NCM_ALIGNMENT - 1u ) )
+#define NCM_NDP_LENGTH(datagrams) ( sizeof(ncm_ndp16_t) + ( (datagrams) + 1u ) * sizeof(ncm_datagram_t) )
+#define NCM_PAYLOAD_REMAINDER QUEUEFRAMEALIGN                /* datagrams start 2 bytes past the alignment in both directions */
+#define NCM_TX_HEADROOM       ( NCM_ALIGN( sizeof(ncm_nth16_t) + NCM_NDP_LENGTH(1u) ) + NCM_PAYLOAD_REMAINDER ) /* nth16, ndp16 and padding in front of a frame of USBD_NCM_send, 30 bytes */
+
+// Exported types *************************************************************
+typedef struct
+{
+   uint32_t dwSignature;
+   uint16_t wHeaderLength;
+   uint16_t wSequence;
+   uint16_t wBlockLength;
+   uint16_t wNdpIndex;
+} ncm_nth16_t;
+
+typedef struct
+{
+   uint16_t wDatagramIndex;
+   uint16_t wDatagramLength;
+} ncm_datagram_t;
+
+typedef struct
+{
+   uint32_t dwSignature;
+   uint16_t wLength;
+   uint16_t wNextNdpIndex;
+   ncm_datagram_t datagram[];    // terminated by a zero entry
+} ncm_ndp16_t;
+
+// Exported functions *********************************************************
+bool                 USBD_NCM_canSend              ( void );
+bool                 USBD_NCM_send                 ( const void *data, uint16_t size );
+uint16_t             USBD_NCM_sendBatch            ( const queue_frame_t *frames, uint16_t count );
+USBD_ClassTypeDef*   USBD_NCM_getClass             ( void );
+USBD_ClassTypeDef*   USBD_ECM_getClass             ( void );
+void                 USBD_NCM_rxResume             ( void );
+void                 USBD_NCM_setMediaState        ( bool connected );
+#endif
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
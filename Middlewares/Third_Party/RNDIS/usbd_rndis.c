@@ -58,22 +58,34 @@
 #include "ndis.h"
 #include "rndis_protocol.h"
 #include "usb_device.h"
+#include "stats.h"
 
 // Private defines ************************************************************
 #define ETH_HEADER_SIZE                   14
 #define ETH_MAX_PACKET_SIZE               ETH_HEADER_SIZE + RNDIS_MTU
 #define RNDIS_RX_BUFFER_SIZE              (ETH_MAX_PACKET_SIZE + sizeof(rndis_data_packet_t))
+#define RNDIS_RX_OFFSET                   ( ( QUEUEFRAMEALIGN - sizeof(rndis_data_packet_t) ) & 3u ) /* transfer offset in the reservation, the frames behind the headers start QUEUEFRAMEALIGN past a word */
+#define RNDIS_TX_ALIGN(x)                 ( ( (x) + 3u ) & ~3u ) /* packet messages of an in transfer start on a word */
+#if RNDIS_RX_CUTTHROUGH > 0u
+#define RNDIS_RX_PACKETS                  1u   /* a frame is forwarded before its transfer has ended, one per transfer */
+#elif QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+#define RNDIS_RX_PACKETS                  16u  /* packets per out transfer, all but the last one are copied into the usb queue */
+#else
+#define RNDIS_RX_PACKETS                  1u   /* the bip queue holds a single reservation, no copies */
+#endif
 
 #define TX_STATE_READY                    0 /* initial transmitter state */
 #define TX_STATE_NEED_SENDING             1 /* has user data to send */
 #define TX_STATE_SENDING_HDR              2 /* sending first packet with header */
 #define TX_STATE_SENDING_DATA             3 /* sending message data */
-#define TX_STATE_SENDING_PADDING          4 /* sending one byte padding */
+#define TX_STATE_WAITING_DATA             4 /* waiting for the rest of a frame which is still being received */
 #define TX_STATE_RESET                    5 /* reset state */
 
 #define USB_CONFIGURATION_DESCRIPTOR_TYPE 0x02
 #define USB_INTERFACE_DESCRIPTOR_TYPE     0x04
 #define USB_ENDPOINT_DESCRIPTOR_TYPE      0x05
+#define USB_NOTIFICATION_INTERVAL_FS      0x01 /* 1 ms */
+#define USB_NOTIFICATION_INTERVAL_HS      0x04 /* 2^(4-1) microframes = 1 ms */
 
 #define INFBUF ((uint32_t *)((uint8_t *)&(m->RequestId) + m->InformationBufferOffset))
 
@@ -85,26 +97,53 @@
 // Private types     **********************************************************
 
 // Private variables **********************************************************
-static usb_eth_stat_t         usb_eth_stat = {0};
 static uint32_t               oid_packet_filter = 0x0000000;
+static uint8_t                rndis_multicastList[RNDIS_MULTICAST_LIST_SIZE][6];
+static uint32_t               rndis_multicastCount = 0;
+static uint32_t               rndis_multicastHash[2];                        // 64 bit table, indexed by the upper 6 bits of the address crc
 static __ALIGN_BEGIN char*    rndis_rx_buffer __ALIGN_END;
+static queue_reservation_t    rndis_rx_reservation;
+#if RNDIS_RX_FLOWCONTROL == 0
+static uint32_t               rndis_rx_discard[(QUEUEBUFFERLENGTH+3u)/4u];   // receives the frames which find no room in the usb queue
+#endif
+static volatile bool          rndis_rx_paused = false;                       // out endpoint not armed, the host is NAKed
+static uint32_t               rndis_tx_aggregate[RNDIS_TX_AGGREGATESIZE/4u]; // several frames packed into one in transfer
+static uint32_t               rndis_tx_maxTransferSize = 0;                  // biggest in transfer the host accepts
+static uint16_t               rndis_dataInSize = RNDIS_DATA_IN_SZ;           // bulk endpoint size of the negotiated speed
+static uint16_t               rndis_dataOutSize = RNDIS_DATA_OUT_SZ;
+#if RNDIS_RX_CUTTHROUGH > 0u
+static uint32_t               rndis_rx_received = 0;                         // bytes of the transfer in front of the armed part
+static const char*            rndis_rx_stream = NULL;                        // frame forwarded while it is received
+static uint32_t               rndis_rx_streamEnd = 0;                        // transfer length the frame needs
+static uint16_t               rndis_rx_streamLength = 0;                     // length of the forwarded frame
+#endif
 static rndis_state_t          rndis_state;
+static volatile bool          rndis_mediaConnected = true;                   // link state of the backend
 static const uint8_t          station_hwaddr[6] = { RNDIS_HWADDR };
 static const uint8_t          permanent_hwaddr[6] = { RNDIS_HWADDR };
+static const rndis_data_packet_t rndis_packetTemplate =                      // header of each frame, copied whole and then the lengths set
+{
+   .MessageType   = REMOTE_NDIS_PACKET_MSG,
+   .DataOffset    = RNDIS_TX_HEADROOM - offsetof(rndis_data_packet_t, DataOffset),
+};
 
 // struct for the rndis transmission information and status
 static struct
 {
 	uint8_t  *ptr;
 	uint16_t size;
+	uint16_t sent;          // bytes of the transfer handed to the endpoint
 	uint16_t state;
-	bool need_padding;
+	uint16_t frames;        // frames in the transfer
+	uint32_t holdStart;     // timestamp of the first hold-off, 0 = none
 } tx =
 {
 	NULL,
 	0,
+	0,
 	TX_STATE_RESET,
-	false
+	0,
+	0
 };
 
 // USB standard device descriptor
@@ -118,11 +157,11 @@ __ALIGN_BEGIN static uint8_t USBD_RNDIS_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIE
   0x00,
   0x00,
   0x40,
-  0x01,
+  USBD_MAX_NUM_CONFIGURATION,
   0x00,
 };
 
-// USB device configuration descriptor
+// USB device configuration descriptor, full speed
 __ALIGN_BEGIN static uint8_t USBD_RNDIS_CfgDesc[] __ALIGN_END =
 {
     /* Configuration descriptor */
@@ -250,11 +289,38 @@ const uint32_t OIDSupportedList[] =
     OID_802_3_CURRENT_ADDRESS,
     OID_802_3_MULTICAST_LIST,
     OID_802_3_MAXIMUM_LIST_SIZE,
-    OID_802_3_MAC_OPTIONS
+    OID_802_3_MAC_OPTIONS,
+    OID_GEN_XMIT_OK,
+    OID_GEN_RCV_OK,
+    OID_GEN_XMIT_ERROR,
+    OID_GEN_RCV_ERROR,
+    OID_GEN_RCV_NO_BUFFER,
+    RNDIS_OID_STATISTICS
 };
 #define OID_LIST_LENGTH (sizeof(OIDSupportedList) / sizeof(*OIDSupportedList))
-#define ENC_BUF_SIZE    (OID_LIST_LENGTH * 4 + 32)
-static uint8_t encapsulated_buffer[ENC_BUF_SIZE];
+
+// high speed or other speed copy of the configuration descriptor
+__ALIGN_BEGIN static uint8_t USBD_RNDIS_SpeedCfgDesc[sizeof(USBD_RNDIS_CfgDesc)] __ALIGN_END;
+#define ENC_BUF_SIZE    MAX(OID_LIST_LENGTH * 4 + 32, sizeof(rndis_query_cmplt_t) + sizeof(stats_snapshot_t))
+static uint32_t   rndis_ctrlRequest[RNDIS_CTRL_REQUESTS][ENC_BUF_SIZE/4];     // fifo of the encapsulated commands
+static uint32_t   rndis_ctrlResponse[RNDIS_CTRL_RESPONSES][ENC_BUF_SIZE/4];   // fifo of the encapsulated responses
+static uint8_t    *rndis_request;                                             // request in process
+static uint8_t    *rndis_response;                                            // response in process
+
+// state of the control message fifos, changed by the usb irq and by the task
+// with the interrupts disabled
+static struct
+{
+   uint32_t requestHead;
+   uint32_t requestCount;
+   uint16_t requestLength[RNDIS_CTRL_REQUESTS];
+   uint32_t responseHead;
+   uint32_t responseCount;
+   bool     responseInFlight;    // the slot in front of the head is sent on ep0
+   uint32_t notified;            // queued responses with a notification
+   bool     notifyBusy;          // notification endpoint in use
+   bool     indicatePending;     // media state changed, indication not queued yet
+} ctrl;
 
 // Global variables ***********************************************************
 extern USBD_HandleTypeDef  hUsbDeviceFS;
@@ -271,13 +337,26 @@ static uint8_t    USBD_RNDIS_DataOut                        ( USBD_HandleTypeDef
 static uint8_t    *USBD_RNDIS_GetFSCfgDesc                  ( uint16_t *length );
 static uint8_t    *USBD_RNDIS_GetHSCfgDesc                  ( uint16_t *length );
 static uint8_t    *USBD_RNDIS_GetOtherSpeedCfgDesc          ( uint16_t *length );
-static uint8_t    *USBD_RNDIS_GetOtherSpeedCfgDesc          ( uint16_t *length );
+static uint8_t    *USBD_RNDIS_speedCfgDesc                  ( bool highSpeed, uint16_t *length );
 static uint8_t    *USBD_RNDIS_GetDeviceQualifierDescriptor  ( uint16_t *length );
+static bool       USBD_RNDIS_handleRequest                  ( void );
+static void       USBD_RNDIS_notify                         ( void );
 static void       USBD_RNDIS_query                          ( void *pdev );
 static void       USBD_RNDIS_handleSetMsg                   ( void *pdev );
 static void       USBD_RNDIS_handleConfigParm               ( const char *data, uint16_t keyoffset, uint16_t valoffset, uint16_t keylen, uint16_t vallen );
-static void       USBD_RNDIS_packetFilter                   ( uint32_t newfilter );
+static uint32_t   USBD_RNDIS_multicastHash                  ( const uint8_t *hwaddr );
+static bool       USBD_RNDIS_packetFilter                   ( const uint8_t *frame, uint32_t length );
+static uint32_t   USBD_RNDIS_setMulticastList               ( const uint8_t *list, uint32_t length );
 static void       USBD_RNDIS_query_cmplt                    ( uint32_t status, const void *data, uint16_t size );
+static void       USBD_RNDIS_query_cmplt64                  ( uint32_t status, uint64_t data );
+static uint8_t*   USBD_RNDIS_rxBuffer                       ( void );
+static void       USBD_RNDIS_rxArm                          ( USBD_HandleTypeDef *pdev );
+static void       USBD_RNDIS_txNext                         ( void );
+#if RNDIS_RX_CUTTHROUGH > 0u
+static bool       USBD_RNDIS_rxChunk                        ( USBD_HandleTypeDef *pdev, uint32_t *size );
+static void       USBD_RNDIS_rxStreamStart                  ( uint32_t chunk );
+static void       USBD_RNDIS_rxStreamEnd                    ( uint32_t size );
+#endif
 
 // RNDIS interface class callbacks structure
 USBD_ClassTypeDef USBD_RDNIS =
@@ -296,6 +375,9 @@ USBD_ClassTypeDef USBD_RDNIS =
   USBD_RNDIS_GetFSCfgDesc,
   USBD_RNDIS_GetOtherSpeedCfgDesc,
   USBD_RNDIS_GetDeviceQualifierDescriptor,
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+  NULL,                 // GetUsrStrDescriptor
+#endif
 };
 
 //------------------------------------------------------------------------------
@@ -326,22 +408,27 @@ static uint8_t USBD_RNDIS_Init( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
    USBD_LL_OpenEP( pdev, RNDIS_NOTIFICATION_IN_EP, USBD_EP_TYPE_INTR, RNDIS_NOTIFICATION_IN_SZ );
   
    // Open EP IN 
-   USBD_LL_OpenEP( pdev, RNDIS_DATA_IN_EP, USBD_EP_TYPE_BULK, RNDIS_DATA_IN_SZ );
+   rndis_dataInSize = ( pdev->dev_speed == USBD_SPEED_HIGH ) ? CDC_DATA_HS_IN_PACKET_SIZE : RNDIS_DATA_IN_SZ;
+   USBD_LL_OpenEP( pdev, RNDIS_DATA_IN_EP, USBD_EP_TYPE_BULK, rndis_dataInSize );
    
    // Open EP OUT
-   USBD_LL_OpenEP( pdev, RNDIS_DATA_OUT_EP, USBD_EP_TYPE_BULK, RNDIS_DATA_OUT_SZ );
-   
-   // Set the data receive pointer.
-   rndis_rx_buffer = (char*)queue_getHeadBuffer( &usbQueue );
+   rndis_dataOutSize = ( pdev->dev_speed == USBD_SPEED_HIGH ) ? CDC_DATA_HS_OUT_PACKET_SIZE : RNDIS_DATA_OUT_SZ;
+   USBD_LL_OpenEP( pdev, RNDIS_DATA_OUT_EP, USBD_EP_TYPE_BULK, rndis_dataOutSize );
    
    // Prepare Out endpoint to receive next packet
-   USBD_LL_PrepareReceive( pdev, RNDIS_DATA_OUT_EP, (uint8_t*)rndis_rx_buffer, QUEUEBUFFERLENGTH );
+   __disable_irq();
+   USBD_RNDIS_rxArm( pdev );
+   __enable_irq();
    
    // set rndis state to ready
    tx.state = TX_STATE_READY;
+   memset( &ctrl, 0, sizeof(ctrl) );
    
-   // init the queue
-   queue_init(&uartQueue);
+   // the host sets the packet filter and the multicast list again
+   oid_packet_filter = 0;
+   rndis_multicastCount = 0;
+   rndis_multicastHash[0] = 0;
+   rndis_multicastHash[1] = 0;
 
    return USBD_OK;
 }
@@ -363,9 +450,21 @@ static uint8_t USBD_RNDIS_DeInit( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
    
    // close data out endpoint
    USBD_LL_CloseEP( pdev, RNDIS_DATA_OUT_EP );
+   rndis_rx_paused = false;
+#if RNDIS_RX_CUTTHROUGH > 0u
+   USBD_RNDIS_rxStreamEnd( 0 );
+   rndis_rx_received = 0;
+#endif
+   
+   // frames in an aborted transfer are released, they would block the
+   // queue, the waiting frames are dropped
+   queue_flush( &uartQueue, ( tx.state != TX_STATE_READY && tx.state != TX_STATE_RESET ) ? tx.frames : 0u );
    
    // set transmission state to reset
    tx.state = TX_STATE_RESET;
+   tx.holdStart = 0;
+   rndis_tx_maxTransferSize = 0;
+   memset( &ctrl, 0, sizeof(ctrl) );
    
    return USBD_OK;
 }
@@ -379,19 +478,47 @@ static uint8_t USBD_RNDIS_DeInit( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
 /// \return    status
 static uint8_t USBD_RNDIS_Setup( USBD_HandleTypeDef  *pdev, USBD_SetupReqTypedef *req )
 {
+   uint32_t slot;
+   uint16_t length;
+   
    switch ( req->bmRequest & USB_REQ_TYPE_MASK )
    {
       case USB_REQ_TYPE_CLASS :
+         // a new setup ends the data stage of the response sent before
+         ctrl.responseInFlight = false;
          if (req->wLength != 0) // Is it a data setup packet?
          {
             // Check if the request is Device-to-Host
             if (req->bmRequest & 0x80)
             {
-               USBD_CtlSendData( pdev, encapsulated_buffer, ((rndis_generic_msg_t *)encapsulated_buffer)->MessageLength );
+               if( ctrl.responseCount == 0 )
+               {
+                  // nothing to fetch, the host gets a single zero byte
+                  USBD_CtlSendData( pdev, (uint8_t *)"\0", 1 );
+                  return USBD_OK;
+               }
+               slot = ctrl.responseHead;
+               length = ((rndis_generic_msg_t *)rndis_ctrlResponse[slot])->MessageLength;
+               ctrl.responseHead = ( slot + 1u ) % RNDIS_CTRL_RESPONSES;
+               ctrl.responseCount--;
+               if( ctrl.notified != 0 )
+               {
+                  ctrl.notified--;
+               }
+               ctrl.responseInFlight = true;
+               USBD_CtlSendData( pdev, (uint8_t *)rndis_ctrlResponse[slot], MIN( length, req->wLength ) );
             }
             else // Host-to-Device requeset
             {
-               USBD_CtlPrepareRx( pdev, encapsulated_buffer, req->wLength );          
+               if( ctrl.requestCount == RNDIS_CTRL_REQUESTS || req->wLength > ENC_BUF_SIZE )
+               {
+                  // the host sends the command again
+                  USBD_CtlError( pdev, req );
+                  return USBD_FAIL;
+               }
+               slot = ( ctrl.requestHead + ctrl.requestCount ) % RNDIS_CTRL_REQUESTS;
+               ctrl.requestLength[slot] = req->wLength;
+               USBD_CtlPrepareRx( pdev, (uint8_t *)rndis_ctrlRequest[slot], req->wLength );
             }
          }  
          return USBD_OK;
@@ -402,20 +529,139 @@ static uint8_t USBD_RNDIS_Setup( USBD_HandleTypeDef  *pdev, USBD_SetupReqTypedef
 
 //------------------------------------------------------------------------------
 /// \brief     Endpoint 0 (ctrl endpoint) ready function called by the usb 
-///            stack.      
+///            stack. The command is only queued, the rndis task processes
+///            it in USBD_RNDIS_ctrlManager.
 ///
 /// \param     [in/out] USBD_HandleTypeDef *pdev
 ///
 /// \return    status
 static uint8_t USBD_RNDIS_EP0_RxReady( USBD_HandleTypeDef *pdev )
 {
-   switch (((rndis_generic_msg_t *)encapsulated_buffer)->MessageType)
+   UNUSED(pdev);
+   
+   if( ctrl.requestCount < RNDIS_CTRL_REQUESTS )
+   {
+      ctrl.requestCount++;
+      on_usbCtrlRequest();
+   }
+   return USBD_OK;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Processes the queued control messages, called by the rndis
+///            task. A command waits in the fifo while all response buffers
+///            are taken, it is processed after the host fetched a response.
+///            A reset discards the responses the host has not fetched yet.
+///
+/// \param     none
+///
+/// \return    none
+void USBD_RNDIS_ctrlManager( void )
+{
+   bool respond;
+   
+   while( ctrl.requestCount != 0 && ctrl.responseCount + ctrl.responseInFlight < RNDIS_CTRL_RESPONSES )
+   {
+      rndis_request = (uint8_t *)rndis_ctrlRequest[ctrl.requestHead];
+      if( ((rndis_generic_msg_t *)rndis_request)->MessageType == REMOTE_NDIS_RESET_MSG )
+      {
+         __disable_irq();
+         ctrl.responseCount = 0;
+         ctrl.notified = 0;
+         __enable_irq();
+      }
+      rndis_response = (uint8_t *)rndis_ctrlResponse[( ctrl.responseHead + ctrl.responseCount ) % RNDIS_CTRL_RESPONSES];
+      respond = ((rndis_generic_msg_t *)rndis_request)->MessageLength <= ctrl.requestLength[ctrl.requestHead]
+                && USBD_RNDIS_handleRequest();
+      
+      __disable_irq();
+      ctrl.requestHead = ( ctrl.requestHead + 1u ) % RNDIS_CTRL_REQUESTS;
+      ctrl.requestCount--;
+      if( respond )
+      {
+         ctrl.responseCount++;
+         USBD_RNDIS_notify();
+      }
+      __enable_irq();
+   }
+   
+   // the media state is indicated once the host has initialized the device,
+   // a pending indication always carries the latest state
+   if( ctrl.indicatePending && rndis_state != rndis_uninitialized
+      && ctrl.responseCount + ctrl.responseInFlight < RNDIS_CTRL_RESPONSES )
+   {
+      rndis_indicate_status_t *m;
+      __disable_irq();
+      m = (rndis_indicate_status_t *)rndis_ctrlResponse[( ctrl.responseHead + ctrl.responseCount ) % RNDIS_CTRL_RESPONSES];
+      m->MessageType = REMOTE_NDIS_INDICATE_STATUS_MSG;
+      m->MessageLength = sizeof(rndis_indicate_status_t);
+      m->Status = rndis_mediaConnected ? RNDIS_STATUS_MEDIA_CONNECT : RNDIS_STATUS_MEDIA_DISCONNECT;
+      m->StatusBufferLength = 0;
+      m->StatusBufferOffset = 0;
+      ctrl.indicatePending = false;
+      ctrl.responseCount++;
+      USBD_RNDIS_notify();
+      __enable_irq();
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Sets the link state of the backend. A change is indicated to
+///            the host with REMOTE_NDIS_INDICATE_STATUS_MSG, queued like a
+///            response by the rndis task. Can be called from any context.
+///
+/// \param     [in]  bool connected
+///
+/// \return    none
+void USBD_RNDIS_setMediaState( bool connected )
+{
+   __disable_irq();
+   if( connected != rndis_mediaConnected )
+   {
+      rndis_mediaConnected = connected;
+      ctrl.indicatePending = true;
+   }
+   __enable_irq();
+   on_usbCtrlRequest();
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Sends RESPONSE_AVAILABLE for the next queued response, if the
+///            notification endpoint is free. A response the host fetched
+///            before its notification went out needs none, so notifications
+///            of a burst are coalesced. Called from the usb irq or with the
+///            interrupts disabled.
+///
+/// \param     none
+///
+/// \return    none
+static void USBD_RNDIS_notify( void )
+{
+   if( !ctrl.notifyBusy && ctrl.notified < ctrl.responseCount )
+   {
+      ctrl.notifyBusy = true;
+      ctrl.notified++;
+      USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Builds the response of the request in rndis_request into
+///            rndis_response.
+///
+/// \param     none
+///
+/// \return    true = response built, false = message without response
+static bool USBD_RNDIS_handleRequest( void )
+{
+   switch (((rndis_generic_msg_t *)rndis_request)->MessageType)
    {
       case REMOTE_NDIS_INITIALIZE_MSG:
          {
             rndis_initialize_cmplt_t *m;
-            m = ((rndis_initialize_cmplt_t *)encapsulated_buffer);
-            // m->MessageID is same as before
+            rndis_tx_maxTransferSize = ((rndis_initialize_msg_t *)rndis_request)->MaxTransferSize;
+            m = ((rndis_initialize_cmplt_t *)rndis_response);
+            m->RequestId = ((rndis_initialize_msg_t *)rndis_request)->RequestId;
             m->MessageType = REMOTE_NDIS_INITIALIZE_CMPLT;
             m->MessageLength = sizeof(rndis_initialize_cmplt_t);
             m->MajorVersion = RNDIS_MAJOR_VERSION;
@@ -423,54 +669,50 @@ static uint8_t USBD_RNDIS_EP0_RxReady( USBD_HandleTypeDef *pdev )
             m->Status = RNDIS_STATUS_SUCCESS;
             m->DeviceFlags = RNDIS_DF_CONNECTIONLESS;
             m->Medium = RNDIS_MEDIUM_802_3;
-            m->MaxPacketsPerTransfer = 1;
+            m->MaxPacketsPerTransfer = RNDIS_RX_PACKETS;
             m->MaxTransferSize = RNDIS_RX_BUFFER_SIZE;
-            m->PacketAlignmentFactor = 0;
+            m->PacketAlignmentFactor = RNDIS_PACKET_ALIGNMENT;
             m->AfListOffset = 0;
             m->AfListSize = 0;
             rndis_state = rndis_initialized;
-            USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
          }
-         break;
+         return true;
    
       case REMOTE_NDIS_QUERY_MSG:
-         USBD_RNDIS_query(pdev);
-         break;
+         USBD_RNDIS_query(&hUsbDeviceFS);
+         return true;
          
       case REMOTE_NDIS_SET_MSG:
-         USBD_RNDIS_handleSetMsg(pdev);
-         break;
+         USBD_RNDIS_handleSetMsg(&hUsbDeviceFS);
+         return true;
    
       case REMOTE_NDIS_RESET_MSG:
          {
             rndis_reset_cmplt_t * m;
-            m = ((rndis_reset_cmplt_t *)encapsulated_buffer);
+            m = ((rndis_reset_cmplt_t *)rndis_response);
             rndis_state = rndis_uninitialized;
             m->MessageType = REMOTE_NDIS_RESET_CMPLT;
             m->MessageLength = sizeof(rndis_reset_cmplt_t);
             m->Status = RNDIS_STATUS_SUCCESS;
             m->AddressingReset = 1; // Make it look like we did something
             // m->AddressingReset = 0; - Windows halts if set to 1 for some reason
-            USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
          }
-         break;
+         return true;
    
       case REMOTE_NDIS_KEEPALIVE_MSG:
          {
             rndis_keepalive_cmplt_t * m;
-            m = (rndis_keepalive_cmplt_t *)encapsulated_buffer;
+            m = (rndis_keepalive_cmplt_t *)rndis_response;
+            m->RequestId = ((rndis_keepalive_msg_t *)rndis_request)->RequestId;
             m->MessageType = REMOTE_NDIS_KEEPALIVE_CMPLT;
             m->MessageLength = sizeof(rndis_keepalive_cmplt_t);
             m->Status = RNDIS_STATUS_SUCCESS;
          }
-         // We have data to send back
-         USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
-         break;
+         return true;
    
       default:
-         break;
+         return false;
    }
-   return USBD_OK;
 }
 
 //------------------------------------------------------------------------------
@@ -485,25 +727,23 @@ static uint8_t USBD_RNDIS_DataIn( USBD_HandleTypeDef *pdev, uint8_t epnum )
    UNUSED(pdev);
    
 	epnum &= 0x0F;
+	if( epnum == (RNDIS_NOTIFICATION_IN_EP & 0x0F) )
+	{
+      ctrl.notifyBusy = false;
+      USBD_RNDIS_notify();
+      return USBD_OK;
+	}
 	if( epnum == (RNDIS_DATA_IN_EP & 0x0F) )
 	{
 		if( tx.state == TX_STATE_SENDING_DATA )
 		{
-			if( tx.need_padding )
+			if( tx.sent < tx.size )
 			{
-				USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_DATA_IN_EP, (uint8_t *)"\0", 1);
-				tx.state = TX_STATE_SENDING_PADDING;
+				USBD_RNDIS_txNext();
 				return USBD_OK;
 			}
 			tx.state = TX_STATE_READY;
-         on_usbInTxCplt();
-			return USBD_OK;
-		}
-		
-		if( tx.state == TX_STATE_SENDING_PADDING )
-		{
-			tx.state = TX_STATE_READY;
-         on_usbInTxCplt();
+         on_usbInTxCplt( tx.frames );
 			return USBD_OK;
 		}
 	}
@@ -511,7 +751,18 @@ static uint8_t USBD_RNDIS_DataIn( USBD_HandleTypeDef *pdev, uint8_t epnum )
 }
 
 //------------------------------------------------------------------------------
-/// \brief     Handled packet function.
+/// \brief     Handles an out transfer. The host may concatenate up to
+///            RNDIS_RX_PACKETS packet messages in one transfer, each message
+///            is walked by its MessageLength. The last frame is committed
+///            from the reservation the transfer was received into, the
+///            frames in front of it are copied into the usb queue. A transfer
+///            with a multiple of the endpoint size may carry one padding
+///            byte behind the last message. The transfer is received
+///            RNDIS_RX_OFFSET bytes into the reservation and the messages
+///            start on 2^RNDIS_PACKET_ALIGNMENT boundaries, so the headers are
+///            copied out before they are read. Frames rejected by the packet
+///            filter are neither copied nor committed, the reservation is
+///            used again for the next transfer.
 ///
 /// \param     [in]  const char *data
 /// \param     [in]  uint16_t size
@@ -519,29 +770,58 @@ static uint8_t USBD_RNDIS_DataIn( USBD_HandleTypeDef *pdev, uint8_t epnum )
 /// \return    none
 static void USBD_RNDIS_handlePacket(const char *data, uint16_t size)
 {
-	rndis_data_packet_t *p;
-	p = (rndis_data_packet_t *)data;
-	if (size < sizeof(rndis_data_packet_t) || size > QUEUEBUFFERLENGTH)
+	rndis_data_packet_t hdr;
+   const char *frame;
+   uint32_t offset = 0;
+   uint32_t packets = 0;
+   bool last;
+   
+	if (size > QUEUEBUFFERLENGTH)
    {
-		usb_eth_stat.rxbad++;
+		stats_add( STATS_USB_RX_ERRORS, 1 );
 		return;
    }
-	if (p->MessageType != REMOTE_NDIS_PACKET_MSG)
+   
+   while( size - offset >= sizeof(rndis_data_packet_t) )
    {
-		usb_eth_stat.rxbad++;
-		return;
-   }
-	if (p->DataOffset + offsetof(rndis_data_packet_t, DataOffset) + p->DataLength != size)
-	{
-      // padding?
-      if( p->MessageLength != size-1u )
+      memcpy( &hdr, &data[offset], offsetof(rndis_data_packet_t, OOBDataOffset) );
+      if (hdr.MessageType != REMOTE_NDIS_PACKET_MSG
+         || hdr.MessageLength < sizeof(rndis_data_packet_t)
+         || hdr.MessageLength > size - offset
+         || hdr.DataOffset > hdr.MessageLength || hdr.DataLength > hdr.MessageLength
+         || hdr.DataOffset + offsetof(rndis_data_packet_t, DataOffset) + hdr.DataLength > hdr.MessageLength
+         || ++packets > RNDIS_RX_PACKETS)
       {
-         usb_eth_stat.rxbad++;
+         stats_add( STATS_USB_RX_ERRORS, 1 );
          return;
       }
-	}
-	usb_eth_stat.rxok++;
-   on_usbOutRxPacket( &rndis_rx_buffer[p->DataOffset + offsetof(rndis_data_packet_t, DataOffset)], p->DataLength );
+      
+      frame = &data[offset + hdr.DataOffset + offsetof(rndis_data_packet_t, DataOffset)];
+      last = size - offset - hdr.MessageLength < sizeof(rndis_data_packet_t);
+      if( !USBD_RNDIS_packetFilter( (const uint8_t*)frame, hdr.DataLength ) )
+      {
+         stats_add( STATS_USB_RX_FILTERED, 1 );
+      }
+      else if( last )
+      {
+         // last message, the frame stays in the reservation
+         on_usbOutRxPacket( &rndis_rx_reservation, frame, hdr.DataLength );
+      }
+#if RNDIS_RX_PACKETS > 1u
+      else
+      {
+         on_usbOutRxCopy( frame, hdr.DataLength );
+      }
+#endif
+      if( last )
+      {
+         return;
+      }
+      offset += hdr.MessageLength;
+   }
+   
+   // no message at all
+   stats_add( STATS_USB_RX_ERRORS, 1 );
 }
 
 //------------------------------------------------------------------------------
@@ -559,8 +839,31 @@ static uint8_t USBD_RNDIS_DataOut( USBD_HandleTypeDef *pdev, uint8_t epnum )
 	if( epnum == RNDIS_DATA_OUT_EP )
 	{  
       PCD_EPTypeDef *ep = &((PCD_HandleTypeDef*)pdev->pData)->OUT_ep[epnum]; 
-      USBD_RNDIS_handlePacket(rndis_rx_buffer, ep->xfer_count);
-		USBD_LL_PrepareReceive(&hUsbDeviceFS, RNDIS_DATA_OUT_EP, (uint8_t*)(rndis_rx_buffer), QUEUEBUFFERLENGTH);
+      uint32_t size = ep->xfer_count;
+#if RNDIS_RX_CUTTHROUGH > 0u
+      if( USBD_RNDIS_rxChunk( pdev, &size ) )
+      {
+         // the transfer goes on behind the first chunk
+         return USBD_OK;
+      }
+      if( rndis_rx_stream != NULL )
+      {
+         USBD_RNDIS_rxStreamEnd( size );
+      }
+      else
+#endif
+      if( rndis_rx_reservation.buffer != NULL && (uint8_t*)rndis_rx_buffer == &rndis_rx_reservation.buffer[RNDIS_RX_OFFSET] )
+      {
+         USBD_RNDIS_handlePacket(rndis_rx_buffer, (uint16_t)size);
+      }
+      else
+      {
+         // received into the discard buffer, the usb queue had no room
+         stats_add( STATS_USB_RX_NOBUFFER, 1 );
+      }
+      __disable_irq();
+      USBD_RNDIS_rxArm( pdev );
+      __enable_irq();
 	}
    return USBD_OK;
 }
@@ -577,7 +880,11 @@ bool USBD_RNDIS_canSend(void)
 }
 
 //------------------------------------------------------------------------------
-/// \brief     Requests to send next packet over rndis usb.
+/// \brief     Requests to send next packet over rndis usb. The packet
+///            message header is written into the RNDIS_TX_HEADROOM bytes in
+///            front of the frame, the frame is sent without copy. A frame
+///            which is still being received is sent as far as it has
+///            arrived, USBD_RNDIS_streamResume continues the transfer.
 ///
 /// \param     [in]  const void *data
 /// \param     [in]  uint16_t size
@@ -591,31 +898,38 @@ bool USBD_RNDIS_send( const void *data, uint16_t size )
    }
    if( size > ETH_MAX_PACKET_SIZE )
    {
+      stats_add( STATS_USB_TX_ERRORS, 1 );
       return false;
    }
 
 	__disable_irq();
    
-   tx.ptr = (uint8_t *)data-44u;    // there is allocated memory in front of data for the usb header
-	tx.size = size+44u;              // add 44 byte of header for the complete length
+   tx.ptr = (uint8_t *)data - RNDIS_TX_HEADROOM;
+	tx.size = size + RNDIS_TX_HEADROOM;
 	tx.state = TX_STATE_NEED_SENDING;
+	tx.frames = 1;
 
+   // The headroom of a pool buffer still holds data of the frame it carried
+   // before, so the whole header is copied from the template instead of
+   // writing only the lengths.
    rndis_data_packet_t *hdr;
    hdr = (rndis_data_packet_t *)tx.ptr;
-   memset(hdr, 0, sizeof(rndis_data_packet_t));
-   hdr->MessageType     = REMOTE_NDIS_PACKET_MSG;
-   hdr->MessageLength   = sizeof(rndis_data_packet_t) + tx.size-44u; // substract header size
-   hdr->DataOffset      = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
-   hdr->DataLength      = tx.size-44u; // substract header size
+   memcpy(hdr, &rndis_packetTemplate, sizeof(rndis_data_packet_t));
+   hdr->MessageLength   = tx.size;
+   hdr->DataLength      = size;
    
-   tx.need_padding = (hdr->MessageLength & (RNDIS_DATA_IN_SZ - 1)) == 0;
-   if (tx.need_padding)
+   // A transfer of a multiple of the endpoint size would need a zero length
+   // packet. The byte behind the frame (tailroom of the queue) is sent along
+   // as padding instead, so the frame completes with one transfer.
+   if( (hdr->MessageLength & (rndis_dataInSize - 1)) == 0 )
    {
       hdr->MessageLength++;
+      tx.size++;
+      stats_add( STATS_USB_TX_PADDED, 1 );
    }
    
-   USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_DATA_IN_EP, tx.ptr, (uint32_t)tx.size);
-   tx.state = TX_STATE_SENDING_DATA;
+   tx.sent = 0;
+   USBD_RNDIS_txNext();
 
 	__enable_irq();
 
@@ -623,14 +937,344 @@ bool USBD_RNDIS_send( const void *data, uint16_t size )
 }
 
 //------------------------------------------------------------------------------
-/// \brief     Setting buffer for receiving next frame.
+/// \brief     Requests to send several frames in one in transfer. The frames
+///            are copied behind each other into the aggregation buffer, each
+///            with its own packet message header, as long as the transfer
+///            stays within the aggregation buffer and the MaxTransferSize of
+///            the host. Each message starts on a word, its frame
+///            RNDIS_TX_HEADROOM behind it. A single frame is sent without
+///            copy. A padding byte is appended to the transfer instead of
+///            sending it separately.
+///            With a hold-off set, a transfer which does not take all
+///            QUEUEBATCHLENGTH frames is delayed up to the hold-off to wait
+///            for more frames.
+///
+/// \param     [in]  const queue_frame_t *frames
+/// \param     [in]  uint16_t count
+///
+/// \return    uint16_t frames taken, 0 = busy
+uint16_t USBD_RNDIS_sendBatch( const queue_frame_t *frames, uint16_t count )
+{
+   rndis_data_packet_t *hdr = NULL;
+   uint8_t  *aggregate = (uint8_t *)rndis_tx_aggregate;
+   uint32_t limit = ( rndis_tx_maxTransferSize < RNDIS_TX_AGGREGATESIZE ) ? rndis_tx_maxTransferSize : RNDIS_TX_AGGREGATESIZE;
+   uint32_t length = 0;
+   uint16_t taken = 0;
+   
+	if( tx.state != TX_STATE_READY )
+   {
+      return 0;
+   }
+   
+#if RNDIS_TX_HOLDOFF > 0u
+   if( count < QUEUEBATCHLENGTH )
+   {
+      if( tx.holdStart == 0 )
+      {
+         tx.holdStart = queue_getTimestamp() | 1u;
+      }
+      if( queue_getTimestamp() - tx.holdStart < RNDIS_TX_HOLDOFF * ( SystemCoreClock / 1000000u ) )
+      {
+         return 0;
+      }
+   }
+   tx.holdStart = 0;
+#endif
+   
+   // A single frame or two frames which do not fit into one transfer are
+   // sent without copy.
+   if( count < 2u || RNDIS_TX_ALIGN(RNDIS_TX_HEADROOM + frames[0].dataLength) + RNDIS_TX_HEADROOM + frames[1].dataLength + 1u > limit )
+   {
+      return USBD_RNDIS_send( frames[0].dataStart, frames[0].dataLength ) ? 1u : 0u;
+   }
+   
+   // Pack the frames, one byte is kept free for the padding.
+   while( taken < count && RNDIS_TX_ALIGN(length) + RNDIS_TX_HEADROOM + frames[taken].dataLength + 1u <= limit )
+   {
+      if( hdr != NULL )
+      {
+         // the message in front is padded up to this one
+         hdr->MessageLength = RNDIS_TX_ALIGN(length) - ( (uint8_t *)hdr - aggregate );
+         length = RNDIS_TX_ALIGN(length);
+      }
+      hdr = (rndis_data_packet_t *)&aggregate[length];
+      memcpy(hdr, &rndis_packetTemplate, sizeof(rndis_data_packet_t));
+      hdr->MessageLength   = RNDIS_TX_HEADROOM + frames[taken].dataLength;
+      hdr->DataLength      = frames[taken].dataLength;
+      memcpy( &aggregate[length + RNDIS_TX_HEADROOM], frames[taken].dataStart, frames[taken].dataLength );
+      length += hdr->MessageLength;
+      taken++;
+   }
+   
+   // A transfer of a multiple of the endpoint size would need a zero length
+   // packet, the last message gets a padding byte instead.
+   if( ( length & (rndis_dataInSize - 1) ) == 0 )
+   {
+      aggregate[length++] = 0;
+      hdr->MessageLength++;
+      stats_add( STATS_USB_TX_PADDED, 1 );
+   }
+   
+	__disable_irq();
+   tx.ptr = aggregate;
+   tx.size = (uint16_t)length;
+   tx.sent = tx.size;
+   tx.frames = taken;
+   USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_DATA_IN_EP, tx.ptr, (uint32_t)tx.size);
+   tx.state = TX_STATE_SENDING_DATA;
+	__enable_irq();
+   
+   return taken;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Continues a transfer which waits for a frame still being
+///            received, called by the producer side when more bytes have
+///            arrived or the frame has turned out bad.
+///
+/// \param     none
+///
+/// \return    none
+void USBD_RNDIS_streamResume( void )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( tx.state == TX_STATE_WAITING_DATA )
+   {
+      USBD_RNDIS_txNext();
+   }
+   __set_PRIMASK( primask );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Hands the next part of a single frame transfer to the
+///            endpoint. A frame which has arrived completely goes in one
+///            part. Of a frame still being received only whole packets of
+///            the received bytes are sent, so the fifo never runs ahead of
+///            the producer, and the transfer waits for more. A frame which
+///            has turned out bad ends the transfer with a zero length
+///            packet, the host drops the short message. Has to be called
+///            with disabled irq's.
+///
+/// \param     none
+///
+/// \return    none
+static void USBD_RNDIS_txNext( void )
+{
+   const uint8_t *frame = tx.ptr + RNDIS_TX_HEADROOM;
+   uint16_t length = ((rndis_data_packet_t *)tx.ptr)->DataLength;
+   uint16_t streamed;
+   uint32_t part;
+   bool aborted;
+   
+   streamed = usb_getStreamed( frame, length, &aborted );
+   if( aborted )
+   {
+      usb_endStream( frame );
+      tx.sent = tx.size;
+      stats_add( STATS_USB_TX_ZLP, 1 );
+      USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_DATA_IN_EP, NULL, 0);
+      tx.state = TX_STATE_SENDING_DATA;
+      return;
+   }
+   if( streamed >= length )
+   {
+      // the rest with the padding byte
+      usb_endStream( frame );
+      part = tx.size - tx.sent;
+   }
+   else
+   {
+      part = ( RNDIS_TX_HEADROOM + streamed - tx.sent ) & ~(uint32_t)( rndis_dataInSize - 1 );
+      if( part == 0 )
+      {
+         tx.state = TX_STATE_WAITING_DATA;
+         return;
+      }
+   }
+   
+   USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_DATA_IN_EP, tx.ptr + tx.sent, part);
+   tx.sent += (uint16_t)part;
+   tx.state = TX_STATE_SENDING_DATA;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns the buffer for receiving the next transfer. The frame is
+///            received directly into a reservation of the usb queue. A
+///            reservation which has not been committed (e.g. bad packet or
+///            queue full) is used again. Without room in the usb queue the
+///            transfer goes into the discard buffer and is dropped, with flow
+///            control there is no buffer.
+///
+/// \param     none
+///
+/// \return    uint8_t* receive buffer, NULL = usb queue full
+static uint8_t* USBD_RNDIS_rxBuffer( void )
+{
+   if( queue_reserve( &rndis_rx_reservation, QUEUEBUFFERLENGTH, &usbQueue ) == NULL )
+   {
+#if RNDIS_RX_FLOWCONTROL
+      return NULL;
+#else
+      return (uint8_t*)rndis_rx_discard;
+#endif
+   }
+   
+   return &rndis_rx_reservation.buffer[RNDIS_RX_OFFSET];
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Arms the out endpoint for the next transfer. If the usb queue
+///            has no room, the endpoint is left unarmed and the host gets a
+///            NAK until USBD_RNDIS_rxResume is called. Has to be called with
+///            disabled irq's, the usb irq and the resume from the dequeue
+///            path may race for the endpoint.
 ///
-/// \param     [in]  uint8_t* buffer
+/// \param     [in/out] USBD_HandleTypeDef *pdev
 ///
 /// \return    none
-void USBD_RNDIS_setBuffer( uint8_t* buffer )
+static void USBD_RNDIS_rxArm( USBD_HandleTypeDef *pdev )
+{
+   rndis_rx_buffer = (char*)USBD_RNDIS_rxBuffer();
+   rndis_rx_paused = ( rndis_rx_buffer == NULL );
+   if( !rndis_rx_paused )
+   {
+#if RNDIS_RX_CUTTHROUGH > 0u
+      // the first chunk ends early enough to look at the frame
+      rndis_rx_received = 0;
+      USBD_LL_PrepareReceive( pdev, RNDIS_DATA_OUT_EP, (uint8_t*)rndis_rx_buffer, RNDIS_RX_CUTTHROUGH * rndis_dataOutSize );
+#else
+      USBD_LL_PrepareReceive( pdev, RNDIS_DATA_OUT_EP, (uint8_t*)rndis_rx_buffer, QUEUEBUFFERLENGTH - RNDIS_RX_OFFSET );
+#endif
+   }
+}
+
+#if RNDIS_RX_CUTTHROUGH > 0u
+//------------------------------------------------------------------------------
+/// \brief     Cut-through reception. A transfer is received as a first chunk
+///            of RNDIS_RX_CUTTHROUGH packets and the rest behind it. After a
+///            full first chunk the frame is forwarded, if it goes on behind
+///            the chunk, and the endpoint is armed for the rest.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in/out] uint32_t *size, received bytes, set to the bytes of
+///                     the whole transfer when it has ended
+///
+/// \return    bool true = the transfer goes on
+static bool USBD_RNDIS_rxChunk( USBD_HandleTypeDef *pdev, uint32_t *size )
 {
-   rndis_rx_buffer = (char*)buffer;
+   uint32_t chunk = RNDIS_RX_CUTTHROUGH * rndis_dataOutSize;
+   
+   if( rndis_rx_received == 0 )
+   {
+      // a short packet has ended the transfer within the chunk
+      if( *size < chunk )
+      {
+         return false;
+      }
+      rndis_rx_received = chunk;
+      USBD_RNDIS_rxStreamStart( chunk );
+      USBD_LL_PrepareReceive( pdev, RNDIS_DATA_OUT_EP, (uint8_t*)&rndis_rx_buffer[chunk], QUEUEBUFFERLENGTH - RNDIS_RX_OFFSET - chunk );
+      return true;
+   }
+   
+   *size += rndis_rx_received;
+   rndis_rx_received = 0;
+   return false;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Forwards the frame of the first chunk while the rest is still
+///            arriving. Only a valid packet message which goes on behind the
+///            chunk, with its ethernet header inside the chunk and passing
+///            the packet filter, is committed. Any other transfer is left to
+///            USBD_RNDIS_handlePacket when it has ended.
+///
+/// \param     [in]  uint32_t chunk, received bytes
+///
+/// \return    none
+static void USBD_RNDIS_rxStreamStart( uint32_t chunk )
+{
+   rndis_data_packet_t hdr;
+   const char *frame;
+   uint32_t frameOffset;
+   uint32_t received;
+   
+   if( rndis_rx_reservation.buffer == NULL || (uint8_t*)rndis_rx_buffer != &rndis_rx_reservation.buffer[RNDIS_RX_OFFSET] )
+   {
+      return;
+   }
+   
+   memcpy( &hdr, rndis_rx_buffer, offsetof(rndis_data_packet_t, OOBDataOffset) );
+   frameOffset = hdr.DataOffset + offsetof(rndis_data_packet_t, DataOffset);
+   if( hdr.MessageType != REMOTE_NDIS_PACKET_MSG
+      || hdr.MessageLength <= chunk
+      || hdr.MessageLength > QUEUEBUFFERLENGTH - RNDIS_RX_OFFSET
+      || hdr.DataOffset > hdr.MessageLength || hdr.DataLength > hdr.MessageLength
+      || frameOffset + hdr.DataLength > hdr.MessageLength
+      || frameOffset + ETH_HEADER_SIZE > chunk )
+   {
+      return;
+   }
+   
+   frame = &rndis_rx_buffer[frameOffset];
+   received = ( chunk - frameOffset < hdr.DataLength ) ? chunk - frameOffset : hdr.DataLength;
+   if( USBD_RNDIS_packetFilter( (const uint8_t*)frame, hdr.DataLength )
+      && on_usbOutRxStream( &rndis_rx_reservation, frame, hdr.DataLength, received ) )
+   {
+      rndis_rx_stream = frame;
+      rndis_rx_streamEnd = hdr.MessageLength;
+      rndis_rx_streamLength = (uint16_t)hdr.DataLength;
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Ends the reception of a forwarded frame. A transfer which has
+///            ended before the frame was complete aborts the frame, the
+///            output ends it with a framing error. Otherwise the output
+///            learns that the whole frame has arrived.
+///
+/// \param     [in]  uint32_t size, bytes of the whole transfer
+///
+/// \return    none
+static void USBD_RNDIS_rxStreamEnd( uint32_t size )
+{
+   if( rndis_rx_stream != NULL && size < rndis_rx_streamEnd )
+   {
+      on_usbOutRxAbort( rndis_rx_stream );
+   }
+   else if( rndis_rx_stream != NULL )
+   {
+      on_usbOutRxProgress( rndis_rx_stream, rndis_rx_streamLength );
+   }
+   rndis_rx_stream = NULL;
+   rndis_rx_streamEnd = 0;
+   rndis_rx_streamLength = 0;
+}
+#endif
+
+//------------------------------------------------------------------------------
+/// \brief     Arms the out endpoint again after it has been left unarmed
+///            because of a full usb queue. Linked as input resume of the usb
+///            queue, it is called after the queue has released slots.
+///
+/// \param     none
+///
+/// \return    none
+void USBD_RNDIS_rxResume( void )
+{
+   if( !rndis_rx_paused )
+   {
+      return;
+   }
+   
+   __disable_irq();
+   if( rndis_rx_paused )
+   {
+      USBD_RNDIS_rxArm( &hUsbDeviceFS );
+   }
+   __enable_irq();
 }
 
 //------------------------------------------------------------------------------
@@ -655,18 +1299,54 @@ static uint8_t *USBD_RNDIS_GetFSCfgDesc( uint16_t *length )
 /// \return    pointer to descriptor buffer
 static uint8_t *USBD_RNDIS_GetHSCfgDesc( uint16_t *length )
 {
-  return NULL;
+   return USBD_RNDIS_speedCfgDesc( true, length );
 }
 
 //------------------------------------------------------------------------------
 /// \brief     USBD_CDC_GetOtherSpeedCfgDesc Return configuration descriptor.
+///            Only requested by a high speed host, so the other speed is
+///            full speed. The core overwrites the descriptor type, a copy is
+///            returned.
 ///
 /// \param     [in]  uint16_t *length
 ///
 /// \return    pointer to descriptor buffer
 static uint8_t *USBD_RNDIS_GetOtherSpeedCfgDesc( uint16_t *length )
 {
-  return NULL;
+   return USBD_RNDIS_speedCfgDesc( false, length );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Builds a copy of the configuration descriptor for the speed.
+///            The bulk endpoints get 512 bytes on high speed, the interrupt
+///            endpoint keeps its 1 ms interval.
+///
+/// \param     [in]  bool highSpeed
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *USBD_RNDIS_speedCfgDesc( bool highSpeed, uint16_t *length )
+{
+   uint8_t *desc = USBD_RNDIS_SpeedCfgDesc;
+
+   memcpy( desc, USBD_RNDIS_GetFSCfgDesc( length ), sizeof(USBD_RNDIS_SpeedCfgDesc) );
+   for( uint32_t i = 0; i + 7u <= sizeof(USBD_RNDIS_SpeedCfgDesc) && desc[i] != 0; i += desc[i] )
+   {
+      if( desc[i + 1u] != USB_ENDPOINT_DESCRIPTOR_TYPE )
+      {
+         continue;
+      }
+      if( ( desc[i + 3u] & 0x03 ) == 0x02 )
+      {
+         desc[i + 4u] = LOBYTE( highSpeed ? CDC_DATA_HS_MAX_PACKET_SIZE : CDC_DATA_FS_MAX_PACKET_SIZE );
+         desc[i + 5u] = HIBYTE( highSpeed ? CDC_DATA_HS_MAX_PACKET_SIZE : CDC_DATA_FS_MAX_PACKET_SIZE );
+      }
+      else
+      {
+         desc[i + 6u] = highSpeed ? USB_NOTIFICATION_INTERVAL_HS : USB_NOTIFICATION_INTERVAL_FS;
+      }
+   }
+   return desc;
 }
 
 //------------------------------------------------------------------------------
@@ -711,14 +1391,14 @@ uint8_t USBD_RNDIS_RegisterInterface( USBD_HandleTypeDef *pdev, USBD_RNDIS_ItfTy
 void USBD_RNDIS_query_cmplt32( uint32_t status, uint32_t data )
 {
    rndis_query_cmplt_t *c;
-   c = (rndis_query_cmplt_t *)encapsulated_buffer;
+   c = (rndis_query_cmplt_t *)rndis_response;
    c->MessageType = REMOTE_NDIS_QUERY_CMPLT;
    c->MessageLength = sizeof(rndis_query_cmplt_t) + 4;
+   c->RequestId = ((rndis_query_msg_t *)rndis_request)->RequestId;
    c->InformationBufferLength = 4;
    c->InformationBufferOffset = 16;
    c->Status = status;
    *(uint32_t *)(c + 1) = data;
-   USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
 }
 
 //------------------------------------------------------------------------------
@@ -732,14 +1412,35 @@ void USBD_RNDIS_query_cmplt32( uint32_t status, uint32_t data )
 static void USBD_RNDIS_query_cmplt( uint32_t status, const void *data, uint16_t size )
 {
 	rndis_query_cmplt_t *c;
-	c = (rndis_query_cmplt_t *)encapsulated_buffer;
+	c = (rndis_query_cmplt_t *)rndis_response;
 	c->MessageType = REMOTE_NDIS_QUERY_CMPLT;
 	c->MessageLength = sizeof(rndis_query_cmplt_t) + size;
+	c->RequestId = ((rndis_query_msg_t *)rndis_request)->RequestId;
 	c->InformationBufferLength = size;
 	c->InformationBufferOffset = 16;
 	c->Status = status;
 	memcpy(c + 1, data, size);
-	USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Query response function for the 64 bit counters. The host
+///            gets 64 bits if its information buffer has room for them,
+///            otherwise the lower 32 bits.
+///
+/// \param     [in]  uint32_t status
+/// \param     [in]  uint64_t data
+///
+/// \return    none
+static void USBD_RNDIS_query_cmplt64( uint32_t status, uint64_t data )
+{
+   if( ((rndis_query_msg_t *)rndis_request)->InformationBufferLength >= sizeof(uint64_t) )
+   {
+      USBD_RNDIS_query_cmplt(status, &data, sizeof(uint64_t));
+   }
+   else
+   {
+      USBD_RNDIS_query_cmplt32(status, (uint32_t)data);
+   }
 }
 
 //------------------------------------------------------------------------------
@@ -750,7 +1451,7 @@ static void USBD_RNDIS_query_cmplt( uint32_t status, const void *data, uint16_t
 /// \return    none
 static void USBD_RNDIS_query( void *pdev )
 {
-	switch (((rndis_query_msg_t *)encapsulated_buffer)->Oid)
+	switch (((rndis_query_msg_t *)rndis_request)->Oid)
 	{
 		case OID_GEN_SUPPORTED_LIST:         USBD_RNDIS_query_cmplt(RNDIS_STATUS_SUCCESS, OIDSupportedList, 4 * OID_LIST_LENGTH); return;
 		case OID_GEN_VENDOR_DRIVER_VERSION:  USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0x00001000);  return;
@@ -760,7 +1461,7 @@ static void USBD_RNDIS_query( void *pdev )
 		case OID_GEN_MEDIA_IN_USE:           USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIUM_802_3); return;
 		case OID_GEN_PHYSICAL_MEDIUM:        USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIUM_802_3); return;
 		case OID_GEN_HARDWARE_STATUS:        USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-		case OID_GEN_LINK_SPEED:             USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, RNDIS_LINK_SPEED / 100); return;
+		case OID_GEN_LINK_SPEED:             USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, ( hUsbDeviceFS.dev_speed == USBD_SPEED_HIGH ? RNDIS_LINK_SPEED_HS : RNDIS_LINK_SPEED_FS ) / 100); return;
 		case OID_GEN_VENDOR_ID:              USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0x00FFFFFF); return;
 		case OID_GEN_VENDOR_DESCRIPTION:     USBD_RNDIS_query_cmplt(RNDIS_STATUS_SUCCESS, RNDIS_VENDOR, strlen(RNDIS_VENDOR) + 1); return;
 		case OID_GEN_CURRENT_PACKET_FILTER:  USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, oid_packet_filter); return;
@@ -768,20 +1469,27 @@ static void USBD_RNDIS_query( void *pdev )
 		case OID_GEN_MAXIMUM_TOTAL_SIZE:     USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
 		case OID_GEN_TRANSMIT_BLOCK_SIZE:    USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
 		case OID_GEN_RECEIVE_BLOCK_SIZE:     USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
-		case OID_GEN_MEDIA_CONNECT_STATUS:   USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIA_STATE_CONNECTED); return;
+		case OID_GEN_MEDIA_CONNECT_STATUS:   USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, rndis_mediaConnected ? NDIS_MEDIA_STATE_CONNECTED : NDIS_MEDIA_STATE_DISCONNECTED); return;
 		case OID_GEN_RNDIS_CONFIG_PARAMETER: USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-		case OID_802_3_MAXIMUM_LIST_SIZE:    USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 1); return;
-		case OID_802_3_MULTICAST_LIST:       USBD_RNDIS_query_cmplt32(RNDIS_STATUS_NOT_SUPPORTED, 0); return;
+		case OID_802_3_MAXIMUM_LIST_SIZE:    USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, RNDIS_MULTICAST_LIST_SIZE); return;
+		case OID_802_3_MULTICAST_LIST:       USBD_RNDIS_query_cmplt(RNDIS_STATUS_SUCCESS, rndis_multicastList, 6 * rndis_multicastCount); return;
 		case OID_802_3_MAC_OPTIONS:          USBD_RNDIS_query_cmplt32(RNDIS_STATUS_NOT_SUPPORTED, 0); return;
 		case OID_GEN_MAC_OPTIONS:            USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, /*MAC_OPT*/ 0); return;
 		case OID_802_3_RCV_ERROR_ALIGNMENT:  USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
 		case OID_802_3_XMIT_ONE_COLLISION:   USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
 		case OID_802_3_XMIT_MORE_COLLISIONS: USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-		case OID_GEN_XMIT_OK:                USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txok); return;
-		case OID_GEN_RCV_OK:                 USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxok); return;
-		case OID_GEN_RCV_ERROR:              USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxbad); return;
-		case OID_GEN_XMIT_ERROR:             USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txbad); return;
-		case OID_GEN_RCV_NO_BUFFER:          USBD_RNDIS_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
+		case OID_GEN_XMIT_OK:                USBD_RNDIS_query_cmplt64(RNDIS_STATUS_SUCCESS, stats_get(STATS_USB_TX_FRAMES)); return;
+		case OID_GEN_RCV_OK:                 USBD_RNDIS_query_cmplt64(RNDIS_STATUS_SUCCESS, stats_get(STATS_USB_RX_FRAMES)); return;
+		case OID_GEN_RCV_ERROR:              USBD_RNDIS_query_cmplt64(RNDIS_STATUS_SUCCESS, stats_get(STATS_USB_RX_ERRORS)); return;
+		case OID_GEN_XMIT_ERROR:             USBD_RNDIS_query_cmplt64(RNDIS_STATUS_SUCCESS, stats_get(STATS_USB_TX_ERRORS)); return;
+		case OID_GEN_RCV_NO_BUFFER:          USBD_RNDIS_query_cmplt64(RNDIS_STATUS_SUCCESS, stats_get(STATS_USB_RX_NOBUFFER) + atomicx_load(&usbQueue.queueFull)); return;
+		case RNDIS_OID_STATISTICS:
+			{
+				static stats_snapshot_t snapshot;   // too big for the stack of the task
+				stats_getSnapshot(&snapshot);
+				USBD_RNDIS_query_cmplt(RNDIS_STATUS_SUCCESS, &snapshot, sizeof(snapshot));
+			}
+			return;
 		default:                             USBD_RNDIS_query_cmplt(RNDIS_STATUS_FAILURE, NULL, 0); return;
 	}
 }
@@ -806,14 +1514,119 @@ static void USBD_RNDIS_handleConfigParm( const char *data, uint16_t keyoffset, u
 }
 
 //------------------------------------------------------------------------------
-/// \brief     Packetfilter function.
+/// \brief     Hashes a multicast address into the 64 bit table, the index is
+///            the upper 6 bits of the ethernet crc like the mac hash filters
+///            of the ethernet controllers.
 ///
-/// \param     [in]  uint32_t newfilter
+/// \param     [in]  const uint8_t *hwaddr
 ///
-/// \return    none
-static void USBD_RNDIS_packetFilter( uint32_t newfilter )
+/// \return    table index 0..63
+static uint32_t USBD_RNDIS_multicastHash( const uint8_t *hwaddr )
 {
-    (void)newfilter;
+   uint32_t crc = 0xFFFFFFFFu;
+   
+   for( uint32_t i = 0; i < 6u; i++ )
+   {
+      crc ^= hwaddr[i];
+      for( uint32_t bit = 0; bit < 8u; bit++ )
+      {
+         crc = ( crc >> 1 ) ^ ( 0xEDB88320u & -( crc & 1u ) );
+      }
+   }
+   return ~crc >> 26;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Packet filter on the out path. Checks the destination address
+///            of a frame from the host against OID_GEN_CURRENT_PACKET_FILTER
+///            and the multicast list, so unwanted frames take neither a queue
+///            slot nor time on the rs485 bus. A multicast address is first
+///            looked up in the hash table, only a hit is compared with the
+///            list.
+///
+/// \param     [in]  const uint8_t *frame
+/// \param     [in]  uint32_t length
+///
+/// \return    true = frame is forwarded, false = frame is dropped
+static bool USBD_RNDIS_packetFilter( const uint8_t *frame, uint32_t length )
+{
+   uint32_t hash;
+   
+   if( length < ETH_HEADER_SIZE )
+   {
+      return false;
+   }
+   if( oid_packet_filter & NDIS_PACKET_TYPE_PROMISCUOUS )
+   {
+      return true;
+   }
+   if( ( frame[0] & 0x01u ) == 0 )
+   {
+      return ( oid_packet_filter & NDIS_PACKET_TYPE_DIRECTED ) != 0;
+   }
+   if( memcmp( frame, "\xFF\xFF\xFF\xFF\xFF\xFF", 6 ) == 0 )
+   {
+      return ( oid_packet_filter & NDIS_PACKET_TYPE_BROADCAST ) != 0;
+   }
+   if( oid_packet_filter & NDIS_PACKET_TYPE_ALL_MULTICAST )
+   {
+      return true;
+   }
+   if( ( oid_packet_filter & NDIS_PACKET_TYPE_MULTICAST ) == 0 )
+   {
+      return false;
+   }
+   
+   hash = USBD_RNDIS_multicastHash( frame );
+   if( ( rndis_multicastHash[hash >> 5] & ( 1u << ( hash & 31u ) ) ) == 0 )
+   {
+      return false;
+   }
+   for( uint32_t i = 0; i < rndis_multicastCount; i++ )
+   {
+      if( memcmp( frame, rndis_multicastList[i], 6 ) == 0 )
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Replaces the multicast list and rebuilds the hash table. The
+///            list is swapped with the interrupts disabled, the out endpoint
+///            filters from the same tables.
+///
+/// \param     [in]  const uint8_t *list
+/// \param     [in]  uint32_t length
+///
+/// \return    rndis status
+static uint32_t USBD_RNDIS_setMulticastList( const uint8_t *list, uint32_t length )
+{
+   uint32_t hash;
+   
+   if( length % 6u != 0 )
+   {
+      return RNDIS_STATUS_INVALID_DATA;
+   }
+   if( length / 6u > RNDIS_MULTICAST_LIST_SIZE )
+   {
+      return NDIS_STATUS_MULTICAST_FULL;
+   }
+   
+   __disable_irq();
+   memcpy( rndis_multicastList, list, length );
+   rndis_multicastCount = length / 6u;
+   rndis_multicastHash[0] = 0;
+   rndis_multicastHash[1] = 0;
+   for( uint32_t i = 0; i < rndis_multicastCount; i++ )
+   {
+      hash = USBD_RNDIS_multicastHash( rndis_multicastList[i] );
+      rndis_multicastHash[hash >> 5] |= 1u << ( hash & 31u );
+   }
+   __enable_irq();
+   
+   return RNDIS_STATUS_SUCCESS;
 }
 
 //------------------------------------------------------------------------------
@@ -828,18 +1641,35 @@ static void USBD_RNDIS_handleSetMsg( void *pdev )
 	rndis_set_msg_t *m;
 	rndis_Oid_t oid;
 
-	c = (rndis_set_cmplt_t *)encapsulated_buffer;
-	m = (rndis_set_msg_t *)encapsulated_buffer;
+	c = (rndis_set_cmplt_t *)rndis_response;
+	m = (rndis_set_msg_t *)rndis_request;
 
 	oid = m->Oid;
+	c->RequestId = m->RequestId;
 	c->MessageType = REMOTE_NDIS_SET_CMPLT;
 	c->MessageLength = sizeof(rndis_set_cmplt_t);
 	c->Status = RNDIS_STATUS_SUCCESS;
 
+	// Offset and length of the information buffer come from the host, the
+	// buffer has to lie within the received message. The message length
+	// has been checked against the received bytes already.
+	if( m->MessageLength < sizeof(rndis_set_msg_t)
+	   || m->InformationBufferOffset > m->MessageLength - offsetof(rndis_set_msg_t, RequestId)
+	   || m->InformationBufferLength > m->MessageLength - offsetof(rndis_set_msg_t, RequestId) - m->InformationBufferOffset )
+	{
+		c->Status = RNDIS_STATUS_INVALID_DATA;
+		return;
+	}
+
 	switch (oid)
 	{
 		// Parameters set up in 'Advanced' tab
 		case OID_GEN_RNDIS_CONFIG_PARAMETER:
+			if( m->InformationBufferLength < sizeof(rndis_config_parameter_t) )
+			{
+				c->Status = RNDIS_STATUS_INVALID_DATA;
+				break;
+			}
 			{
                 rndis_config_parameter_t *p;
 				char *ptr = (char *)m;
@@ -852,10 +1682,14 @@ static void USBD_RNDIS_handleSetMsg( void *pdev )
 
 		// Mandatory general OIDs
 		case OID_GEN_CURRENT_PACKET_FILTER:
+			if( m->InformationBufferLength < sizeof(uint32_t) )
+			{
+				c->Status = RNDIS_STATUS_INVALID_DATA;
+				break;
+			}
 			oid_packet_filter = *INFBUF;
 			if (oid_packet_filter)
 			{
-				USBD_RNDIS_packetFilter(oid_packet_filter);
 				rndis_state = rndis_data_initialized;
 			} 
 			else 
@@ -872,6 +1706,7 @@ static void USBD_RNDIS_handleSetMsg( void *pdev )
 
 		// Mandatory 802_3 OIDs
 		case OID_802_3_MULTICAST_LIST:
+			c->Status = USBD_RNDIS_setMulticastList((const uint8_t *)INFBUF, m->InformationBufferLength);
 			break;
 
 		// Power Managment: fails for now
@@ -883,8 +1718,6 @@ static void USBD_RNDIS_handleSetMsg( void *pdev )
 			break;
 	}
 
-	// c->MessageID is same as before
-	USBD_LL_Transmit(&hUsbDeviceFS, RNDIS_NOTIFICATION_IN_EP, (uint8_t *)"\x01\x00\x00\x00\x00\x00\x00\x00", 8);
 	return;
 }
 
@@ -39,7 +39,10 @@
 ///
 /// \bug       
 ///
-/// \warning   
+/// \warning   With RNDIS_RX_CUTTHROUGH the output sends a frame while it is
+///            still being received. The output has to follow the progress
+///            of the frame (outputProgress of the usb queue), it learns the
+///            bytes of the first chunk and then the end of the transfer.
 ///
 /// \todo      
 ///
@@ -57,12 +60,24 @@
 #include "stm32f4xx.h"
 #include "stm32f4xx_hal.h"
 #include "usbd_ioreq.h"
+#include "queuex.h"
 
 // Exported defines ***********************************************************
 #define RNDIS_MTU        1500                           /* MTU value */
-#define RNDIS_LINK_SPEED 12000000                       /* Link baudrate (12Mbit/s for USB-FS) */
+#define RNDIS_LINK_SPEED_FS 12000000                    /* Link baudrate (12Mbit/s for USB-FS) */
+#define RNDIS_LINK_SPEED_HS 480000000                   /* Link baudrate (480Mbit/s for USB-HS) */
 #define RNDIS_VENDOR     "fetisov"                      /* NIC vendor name */
 #define RNDIS_HWADDR     0x20,0x89,0x84,0x6A,0x96,0xAB  /* MAC-address to set to host interface */
+#define RNDIS_RX_FLOWCONTROL 1                          /* 1 = NAK the host while the usb queue is full, 0 = drop the frames */
+#define RNDIS_TX_AGGREGATESIZE 2048u                    /* buffer for several frames in one in transfer, bytes */
+#define RNDIS_TX_HOLDOFF     0u                         /* us an in transfer waits for more frames, checked on each queue manager run, 0 = off */
+#define RNDIS_MULTICAST_LIST_SIZE 16u                   /* multicast addresses the host may set, reported as OID_802_3_MAXIMUM_LIST_SIZE */
+#define RNDIS_CTRL_REQUESTS  4u                         /* control messages received and waiting for the task */
+#define RNDIS_CTRL_RESPONSES 4u                         /* responses waiting to be fetched by the host */
+#define RNDIS_OID_STATISTICS 0xFF000001u                /* vendor oid, returns a stats_snapshot_t */
+#define RNDIS_RX_CUTTHROUGH  0u                         /* packets of a frame received before it is forwarded while the rest arrives, 0 = off */
+#define RNDIS_TX_HEADROOM    46u                        /* packet message header and 2 bytes padding in front of a frame of USBD_RNDIS_send */
+#define RNDIS_PACKET_ALIGNMENT 2u                       /* PacketAlignmentFactor, packet messages of the host start on 2^n byte boundaries */
 #define CDC_DATA_HS_MAX_PACKET_SIZE                 512U  /* Endpoint IN & OUT Packet size */
 #define CDC_DATA_FS_MAX_PACKET_SIZE                 64U  /* Endpoint IN & OUT Packet size */
     
@@ -83,20 +98,16 @@ typedef struct _USBD_RNDIS_Itf
   int8_t (* TransmitCplt)(uint8_t *Buf, uint32_t *Len, uint8_t epnum);
 } USBD_RNDIS_ItfTypeDef;
 
-//-----------------------------------------------------------------------------
-/// \brief     Bus uart datastructure for frame statistics.										   
-typedef struct BUS_UART_STATISTIC_s
-{
-   uint32_t                      counterRxFrame;               ///< counter for valid frames
-   uint32_t                      counterTxFrame;               ///< counter for valid frames
-}RNDIS_USB_STATISTIC_t;
-
 // Exported functions *********************************************************
 bool                 USBD_RNDIS_canSend            ( void );
 bool                 USBD_RNDIS_send               ( const void *data, uint16_t size );
-void                 USBD_RNDIS_setBuffer          ( uint8_t* buffer );
+uint16_t             USBD_RNDIS_sendBatch          ( const queue_frame_t *frames, uint16_t count );
 USBD_ClassTypeDef*   USBD_RNDIS_getClass           ( void );
 uint8_t              USBD_RNDIS_RegisterInterface  ( USBD_HandleTypeDef *pdev, USBD_RNDIS_ItfTypeDef *fops );
+void                 USBD_RNDIS_rxResume           ( void );
+void                 USBD_RNDIS_ctrlManager        ( void );
+void                 USBD_RNDIS_setMediaState      ( bool connected );
+void                 USBD_RNDIS_streamResume       ( void );
 #endif
 
 /********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
\ No newline at end of file
@@ -0,0 +1,541 @@
+// ****************************************************************************
+/// \file      queuex_stress.c
+///
+/// \brief     host stress and throughput benchmark of the queuex module
+///
+/// \details   Runs the queue_handle_t api of queuex on a pc, built with
+///            HOST_BUILD so atomicx maps to the C11 atomics. Producer threads
+///            take the place of the peripheral irqs, one thread calls the
+///            queue manager like the rndis task and one thread completes the
+///            transmissions like the tx complete irq. Every frame carries its
+///            producer and a sequence number, the completion checks that no
+///            frame is lost, duplicated or reordered per producer. With the
+///            slot backend the producers feed the queue concurrently, half of
+///            them with queue_reserve/queue_commit, the other half with
+///            queue_enqueueMulti. The bip backend has a single producer.
+///            Usage: queuex_stress [producers] [frames per producer]
+///            With "capacity" the queue is filled without output for several
+///            frame sizes instead, the frames it holds per KB of memory
+///            compare the slot ring with the bip ring.
+///            Usage: queuex_stress capacity
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre       Built with the Makefile in this directory, once per backend.
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Include ********************************************************************
+#include "queuex.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Private defines ************************************************************
+#define STRESS_MAXPRODUCERS      ( 8u )
+#define STRESS_MINLENGTH         ( 60u )      // shortest ethernet frame without crc
+#define STRESS_MAXLENGTH         ( 1514u )    // longest ethernet frame without crc
+#define STRESS_TIMEOUT           ( 5.0 )      // seconds without a completed frame until the queue counts as stalled
+#define STRESS_HEADROOM          ( 46u )      // rndis packet header in front of each frame, see RNDIS_TX_HEADROOM
+#define STRESS_TAILROOM          ( 1u )       // padding byte behind each frame
+
+// Private types **************************************************************
+// Start of every frame, the rest is filled with a pattern of the sequence.
+typedef struct stress_header
+{
+   uint32_t             producer;
+   uint32_t             sequence;
+   uint16_t             length;
+} stress_header_t;
+
+typedef struct stress_producer
+{
+   uint32_t             id;
+   uint32_t             frames;             // frames to send
+   uint32_t             sent;
+   uint32_t             dropped;
+   pthread_t            thread;
+} stress_producer_t;
+
+// Private variables **********************************************************
+static queue_handle_t   stressQueue;
+static atomicx_t        stressRunning;
+static atomicx_t        stressPending;      // frames handed to the output and not yet completed
+static atomicx_t        stressCompleted;    // frames released by the tx complete thread
+static queue_frame_t    stressInFlight[QUEUEBATCHLENGTH];
+static uint32_t         stressNextSequence[STRESS_MAXPRODUCERS];
+static uint64_t         stressReceived;
+static uint64_t         stressBytes;
+static uint64_t         stressErrors;
+static uint32_t         stressSeed = 1u;
+static bool             stressSync;         // every transmission completes at once
+
+// Private function prototypes ************************************************
+static uint16_t   stress_outputBatch     ( queue_frame_t *frames, uint16_t count );
+static uint8_t    stress_output          ( uint8_t* dataStart, uint16_t dataLength );
+static void*      stress_producerThread  ( void *argument );
+static void*      stress_managerThread   ( void *argument );
+static void*      stress_completeThread  ( void *argument );
+static void       stress_fill            ( uint8_t* frame, uint32_t producer, uint32_t sequence, uint16_t length );
+static void       stress_check           ( const uint8_t* frame, uint16_t length );
+static uint16_t   stress_length          ( uint32_t *seed );
+static double     stress_seconds         ( void );
+static int        stress_capacity        ( void );
+
+// Functions ******************************************************************
+
+//------------------------------------------------------------------------------
+/// \brief     Runs the stress test and prints the throughput.
+///
+/// \param     [in] int argc
+/// \param     [in] char *argv[]
+///
+/// \return    0 = passed, 1 = failed
+int main( int argc, char *argv[] )
+{
+   stress_producer_t producer[STRESS_MAXPRODUCERS];
+   pthread_t         manager;
+   pthread_t         complete;
+   uint32_t          producers = ( argc > 1 ) ? (uint32_t)atoi( argv[1] ) : 3u;
+   uint32_t          frames = ( argc > 2 ) ? (uint32_t)atoi( argv[2] ) : 1000000u;
+   uint64_t          sent = 0;
+   uint64_t          dropped = 0;
+   uint32_t          completed;
+   double            start;
+   double            progress;
+   double            seconds;
+
+#if QUEUE_BACKEND == QUEUE_BACKEND_BIP
+   // the ring has a single producer
+   producers = 1u;
+#endif
+   if( producers == 0 || producers > STRESS_MAXPRODUCERS )
+   {
+      producers = STRESS_MAXPRODUCERS;
+   }
+
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   bufferpool_init();
+   stressQueue.bufferQuota = (bufferpool_quota_t){ .maxBuffers = { BUFFERPOOL_SMALL_BUFFERS, BUFFERPOOL_MEDIUM_BUFFERS, BUFFERPOOL_LARGE_BUFFERS } };
+#endif
+   stressQueue.headroom    = STRESS_HEADROOM;
+   stressQueue.tailroom    = STRESS_TAILROOM;
+   stressQueue.output      = stress_output;
+   stressQueue.outputBatch = stress_outputBatch;
+   if( queue_init( &stressQueue ) != 1 )
+   {
+      printf( "queue_init failed\n" );
+      return 1;
+   }
+   if( argc > 1 && strcmp( argv[1], "capacity" ) == 0 )
+   {
+      return stress_capacity();
+   }
+
+   atomicx_store( &stressRunning, 1 );
+   pthread_create( &manager, NULL, stress_managerThread, NULL );
+   pthread_create( &complete, NULL, stress_completeThread, NULL );
+
+   start = stress_seconds();
+   for( uint32_t p = 0; p < producers; p++ )
+   {
+      producer[p] = (stress_producer_t){ .id = p, .frames = frames };
+      pthread_create( &producer[p].thread, NULL, stress_producerThread, &producer[p] );
+   }
+   for( uint32_t p = 0; p < producers; p++ )
+   {
+      pthread_join( producer[p].thread, NULL );
+      sent += producer[p].sent;
+      dropped += producer[p].dropped;
+   }
+
+   // wait until the queue is drained, a lost frame stops the progress
+   progress = stress_seconds();
+   completed = 0;
+   while( atomicx_loadAcquire( &stressCompleted ) + dropped != sent )
+   {
+      if( atomicx_load( &stressCompleted ) != completed )
+      {
+         completed = atomicx_load( &stressCompleted );
+         progress = stress_seconds();
+      }
+      else if( stress_seconds() - progress > STRESS_TIMEOUT )
+      {
+         printf( "queue stalled, %llu frames missing\n", (unsigned long long)( sent - dropped - completed ) );
+         stressErrors++;
+         break;
+      }
+      sched_yield();
+   }
+   seconds = stress_seconds() - start;
+   atomicx_storeRelease( &stressRunning, 0 );
+   pthread_join( manager, NULL );
+   pthread_join( complete, NULL );
+
+   if( stressReceived + dropped != sent )
+   {
+      stressErrors++;
+   }
+   printf( "backend %s, %u producers, %llu frames sent, %llu dropped, %llu received, %llu errors\n",
+           ( QUEUE_BACKEND == QUEUE_BACKEND_SLOT ) ? "slot" : "bip", (unsigned)producers,
+           (unsigned long long)sent, (unsigned long long)dropped,
+           (unsigned long long)stressReceived, (unsigned long long)stressErrors );
+   printf( "%.0f frames/s, %.1f Mbit/s, spurious %u, tail errors %u\n",
+           (double)stressReceived / seconds, (double)stressBytes * 8.0 / seconds / 1e6,
+           (unsigned)stressQueue.spuriousError, (unsigned)stressQueue.tailError );
+
+   return ( stressErrors == 0 && stressQueue.spuriousError == 0 && stressQueue.tailError == 0 ) ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Fills the queue with frames of one size until it drops, without
+///            output, and prints the frames it holds per KB of memory. The
+///            memory of the slot backend is the queue handle with its slots
+///            plus the buffers of the pool the quota may draw, the bip
+///            backend has its ring inside the handle. The queue is drained
+///            after each size.
+///
+/// \param     none
+///
+/// \return    0 = passed, 1 = failed
+static int stress_capacity( void )
+{
+   static const uint16_t size[] = { 64u, 128u, 256u, 512u, 1024u, 1514u };
+   queue_reservation_t  reservation = { 0 };
+   uint8_t*             dataStart;
+   uint16_t             maxLength;
+   uint32_t             frames;
+   uint32_t             sequence = 0;
+   uint32_t             memory = sizeof(queue_handle_t);
+
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   memory += BUFFERPOOL_SMALL_LENGTH * BUFFERPOOL_SMALL_BUFFERS
+           + BUFFERPOOL_MEDIUM_LENGTH * BUFFERPOOL_MEDIUM_BUFFERS
+           + BUFFERPOOL_LARGE_LENGTH * BUFFERPOOL_LARGE_BUFFERS;
+#endif
+   printf( "backend %s, %u bytes, headroom %u, tailroom %u\n",
+           ( QUEUE_BACKEND == QUEUE_BACKEND_SLOT ) ? "slot" : "bip", (unsigned)memory,
+           (unsigned)STRESS_HEADROOM, (unsigned)STRESS_TAILROOM );
+   printf( "frame bytes  frames in flight  frames per KB\n" );
+
+   stressSync = true;
+   for( uint32_t s = 0; s < sizeof(size) / sizeof(size[0]); s++ )
+   {
+      // fill like a dma producer, the reservation is taken for a full frame
+      frames = 0;
+      for( ;; )
+      {
+         dataStart = NULL;
+         if( queue_reserve( &reservation, QUEUEBUFFERLENGTH, &stressQueue ) != NULL )
+         {
+            dataStart = queue_getFrameStart( &reservation, &maxLength, &stressQueue );
+         }
+         if( dataStart == NULL || size[s] > maxLength )
+         {
+            break;
+         }
+         stress_fill( dataStart, 0, sequence, size[s] );
+         if( queue_commit( &reservation, dataStart, size[s], &stressQueue ) != 1 )
+         {
+            break;
+         }
+         sequence++;
+         frames++;
+      }
+      if( reservation.buffer != NULL )
+      {
+         queue_abort( &reservation, &stressQueue );
+      }
+      printf( "%11u  %16u  %13.2f\n", (unsigned)size[s], (unsigned)frames, (double)frames * 1024.0 / (double)memory );
+
+      // drain
+      atomicx_store( &stressCompleted, 0 );
+      while( atomicx_load( &stressCompleted ) != frames )
+      {
+         queue_manager( &stressQueue );
+      }
+   }
+
+   return ( stressErrors == 0 && stressQueue.spuriousError == 0 && stressQueue.tailError == 0 ) ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Batch output of the queue, takes a random part of the frames
+///            like a peripheral whose transfer is full. Returns 0 while the
+///            last transmission is not completed. Some transmissions complete
+///            at once, like a tx complete irq which fires before the output
+///            has returned.
+///
+/// \param     [in] queue_frame_t *frames
+/// \param     [in] uint16_t count
+///
+/// \return    uint16_t frames taken
+static uint16_t stress_outputBatch( queue_frame_t *frames, uint16_t count )
+{
+   uint16_t taken;
+
+   if( atomicx_loadAcquire( &stressPending ) != 0 )
+   {
+      return 0;
+   }
+   stressSeed = stressSeed * 1103515245u + 12345u;
+   taken = stressSync ? count : (uint16_t)( 1u + ( stressSeed >> 16 ) % count );
+   if( stressSync || ( stressSeed >> 24 ) % 4u == 0 )
+   {
+      for( uint32_t i = 0; i < taken; i++ )
+      {
+         stress_check( frames[i].dataStart, frames[i].dataLength );
+      }
+      queue_dequeueBatch( &stressQueue, taken );
+      atomicx_fetchAdd( &stressCompleted, taken );
+      return taken;
+   }
+   memcpy( stressInFlight, frames, taken * sizeof(queue_frame_t) );
+   atomicx_storeRelease( &stressPending, taken );
+
+   return taken;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Single frame output of the queue.
+///
+/// \param     [in] uint8_t* dataStart
+/// \param     [in] uint16_t dataLength
+///
+/// \return    0 = busy, 1 = taken
+static uint8_t stress_output( uint8_t* dataStart, uint16_t dataLength )
+{
+   queue_frame_t frame = { dataStart, dataLength };
+
+   return (uint8_t)stress_outputBatch( &frame, 1 );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Producer thread, the counterpart of a receiving peripheral irq.
+///
+/// \param     [in/out] void *argument, stress_producer_t*
+///
+/// \return    NULL
+static void* stress_producerThread( void *argument )
+{
+   stress_producer_t    *producer = argument;
+   queue_reservation_t  reservation = { 0 };
+   uint8_t              frame[STRESS_MAXLENGTH];
+   uint8_t*             dataStart;
+   uint16_t             maxLength;
+   uint16_t             length;
+   uint32_t             seed = producer->id + 1u;
+   uint8_t              enqueued;
+
+   (void)frame;
+   while( producer->sent < producer->frames )
+   {
+      length = stress_length( &seed );
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+      if( producer->id & 1u )
+      {
+         // copying multi producer path
+         stress_fill( frame, producer->id, producer->sent, length );
+         enqueued = queue_enqueueMulti( frame, length, &stressQueue );
+      }
+      else
+#endif
+      {
+         // zero copy path, the frame is written into the reservation
+         dataStart = NULL;
+         if( queue_reserve( &reservation, QUEUEBUFFERLENGTH, &stressQueue ) != NULL )
+         {
+            dataStart = queue_getFrameStart( &reservation, &maxLength, &stressQueue );
+         }
+         enqueued = 0;
+         if( dataStart != NULL && length <= maxLength )
+         {
+            stress_fill( dataStart, producer->id, producer->sent, length );
+            enqueued = queue_commit( &reservation, dataStart, length, &stressQueue );
+         }
+      }
+
+      producer->sent++;
+      if( enqueued != 1 )
+      {
+         producer->dropped++;
+         sched_yield();
+      }
+   }
+   if( reservation.buffer != NULL )
+   {
+      queue_abort( &reservation, &stressQueue );
+   }
+
+   return NULL;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Queue manager thread, the counterpart of the rndis task.
+///
+/// \param     none
+///
+/// \return    NULL
+static void* stress_managerThread( void *argument )
+{
+   while( atomicx_loadAcquire( &stressRunning ) != 0 )
+   {
+      queue_manager( &stressQueue );
+      sched_yield();
+   }
+
+   return argument;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Tx complete thread, the counterpart of the usb in irq. Checks
+///            the frames in transmission and releases them.
+///
+/// \param     none
+///
+/// \return    NULL
+static void* stress_completeThread( void *argument )
+{
+   uint32_t taken;
+
+   while( atomicx_loadAcquire( &stressRunning ) != 0 )
+   {
+      taken = atomicx_loadAcquire( &stressPending );
+      if( taken == 0 )
+      {
+         sched_yield();
+         continue;
+      }
+      for( uint32_t i = 0; i < taken; i++ )
+      {
+         stress_check( stressInFlight[i].dataStart, stressInFlight[i].dataLength );
+      }
+      atomicx_storeRelease( &stressPending, 0 );
+      queue_dequeueBatch( &stressQueue, (uint16_t)taken );
+      atomicx_fetchAdd( &stressCompleted, taken );
+   }
+
+   return argument;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Writes the header and the pattern of a frame.
+///
+/// \param     [out] uint8_t* frame
+/// \param     [in]  uint32_t producer
+/// \param     [in]  uint32_t sequence
+/// \param     [in]  uint16_t length
+///
+/// \return    none
+static void stress_fill( uint8_t* frame, uint32_t producer, uint32_t sequence, uint16_t length )
+{
+   stress_header_t header = { producer, sequence, length };
+
+   memcpy( frame, &header, sizeof(header) );
+   for( uint32_t i = sizeof(header); i < length; i++ )
+   {
+      frame[i] = (uint8_t)( sequence + i );
+   }
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Checks a frame: length and pattern intact, sequence behind the
+///            last frame of its producer. Frames may be missing only if the
+///            producer has counted them as dropped.
+///
+/// \param     [in] const uint8_t* frame
+/// \param     [in] uint16_t length
+///
+/// \return    none
+static void stress_check( const uint8_t* frame, uint16_t length )
+{
+   stress_header_t header;
+
+   memcpy( &header, frame, sizeof(header) );
+   if( header.producer >= STRESS_MAXPRODUCERS || header.length != length
+      || header.sequence < stressNextSequence[header.producer] )
+   {
+      stressErrors++;
+      return;
+   }
+   for( uint32_t i = sizeof(header); i < length; i++ )
+   {
+      if( frame[i] != (uint8_t)( header.sequence + i ) )
+      {
+         stressErrors++;
+         return;
+      }
+   }
+   stressNextSequence[header.producer] = header.sequence + 1u;
+   stressReceived++;
+   stressBytes += length;
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns a random frame length, mostly short frames like tcp
+///            acks and modbus polls, some full frames.
+///
+/// \param     [in/out] uint32_t *seed
+///
+/// \return    uint16_t frame length
+static uint16_t stress_length( uint32_t *seed )
+{
+   *seed = *seed * 1103515245u + 12345u;
+   if( ( *seed >> 16 ) % 4u == 0 )
+   {
+      return STRESS_MAXLENGTH;
+   }
+   return (uint16_t)( STRESS_MINLENGTH + ( *seed >> 8 ) % 200u );
+}
+
+//------------------------------------------------------------------------------
+/// \brief     Returns a monotonic time.
+///
+/// \param     none
+///
+/// \return    double seconds
+static double stress_seconds( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,278 @@
+// ****************************************************************************
+/// \file      rndis_in.c
+///
+/// \brief     host benchmark of the rndis in path
+///
+/// \details   Runs USBD_RNDIS_send and USBD_RNDIS_DataIn of usbd_rndis.c on
+///            a pc with single frames whose packet message length is a
+///            multiple of the endpoint size, the sizes which need a padding
+///            byte. The stubbed USBD_LL_Transmit completes each transfer at
+///            once and the harness calls the DataIn of the class, like the
+///            in irq. Per message length it prints the transfers, the DataIn
+///            callbacks and the bulk transactions per frame, the frames/s
+///            the class path reaches on the host and the frames/s of a full
+///            speed bus. The bus figure is a model: each bulk transaction
+///            takes its data plus 13 bytes of protocol overhead at 12 Mbit/s,
+///            and each transfer costs a re-arm time in which the device
+///            NAKs, the in irq and the DataIn up to the next USBD_LL_Transmit.
+///            Usage: rndis_in [frames per size] [re-arm time in us]
+///
+/// \author    Nico Korn
+///
+/// \version   0.2.0.0
+///
+/// \date      17102026
+///
+/// \copyright Copyright 2021 Reichle & De-Massari AG
+///
+///            Permission is hereby granted, free of charge, to any person
+///            obtaining a copy of this software and associated documentation
+///            files (the "Software"), to deal in the Software without
+///            restriction, including without limitation the rights to use,
+///            copy, modify, merge, publish, distribute, sublicense, and/or sell
+///            copies of the Software, and to permit persons to whom the
+///            Software is furnished to do so, subject to the following
+///            conditions:
+///
+///            The above copyright notice and this permission notice shall be
+///            included in all copies or substantial portions of the Software.
+///
+///            THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+///            EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+///            OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+///            NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+///            HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+///            WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+///            FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+///            OTHER DEALINGS IN THE SOFTWARE.
+///
+/// \pre       Built with the Makefile in this directory, once against this
+///            tree and once against the tree before the padding byte was
+///            folded into the frame transfer.
+///
+/// \bug
+///
+/// \warning
+///
+/// \todo
+///
+// ****************************************************************************
+
+// Include ********************************************************************
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbd_rndis.h"
+#include "usb_device.h"
+#include "rndis_protocol.h"
+#include "queuex.h"
+#include "stats.h"
+
+// Private define *************************************************************
+#define BENCH_FRAMES             ( 1000000u ) // default frames per message length
+#if defined(RNDIS_TX_HEADROOM)
+#define BENCH_HEADROOM           RNDIS_TX_HEADROOM
+#else
+#define BENCH_HEADROOM           sizeof(rndis_data_packet_t)   // trees before RNDIS_TX_HEADROOM
+#endif
+#define BENCH_EPSIZE             ( 64u )      // full speed bulk endpoint
+#define BENCH_OVERHEAD           ( 13u )      // protocol bytes of a full speed bulk transaction, usb 2.0 table 5-9
+#define BENCH_BITRATE            ( 12.0e6 )   // full speed
+#define BENCH_REARM              ( 10.0 )     // default us from the end of a transfer to the next USBD_LL_Transmit
+
+// Private types     **********************************************************
+
+// Private variables **********************************************************
+static PCD_HandleTypeDef   benchPcd;
+static uint32_t            benchBuffer[( 64u + 1536u + 4u ) / 4u];
+static bool                benchTxPending;      // a transfer waits for its DataIn
+static uint32_t            benchTransfers;      // USBD_LL_Transmit calls of the data endpoint
+static uint32_t            benchTransactions;   // bulk packets of the data endpoint
+static uint32_t            benchDataIn;         // DataIn callbacks of the data endpoint
+static uint32_t            benchCompleted;      // frames of on_usbInTxCplt
+static uint32_t            benchBytes;          // bytes on the data endpoint
+static uint64_t            benchBusBytes;       // bytes on the bus with the protocol overhead
+static double              benchRearm = BENCH_REARM;
+
+// Global variables ***********************************************************
+USBD_HandleTypeDef         hUsbDeviceFS;
+queue_handle_t             uartQueue;
+queue_handle_t             usbQueue;
+uint32_t                   SystemCoreClock = 100000000u;
+uint32_t                   hostPrimask = 0;
+
+// Private function prototypes ************************************************
+static double     bench_seconds          ( void );
+static int        bench_size             ( uint32_t messageLength, uint32_t frames );
+
+// Functions ******************************************************************
+
+// ----------------------------------------------------------------------------
+/// \brief     Main function, initialises the class and runs the message
+///            lengths 64 to 1536.
+///
+/// \param     [in] int argc
+/// \param     [in] char *argv[]
+///
+/// \return    int 0 = passed, 1 = failed
+int main( int argc, char *argv[] )
+{
+   uint32_t frames = ( argc > 1 ) ? (uint32_t)strtoul( argv[1], NULL, 0 ) : BENCH_FRAMES;
+   int      result = 0;
+   
+   if( argc > 2 )
+   {
+      benchRearm = strtod( argv[2], NULL );
+   }
+   
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+   bufferpool_init();
+#endif
+   if( queue_init( &uartQueue ) != 1 || queue_init( &usbQueue ) != 1 )
+   {
+      printf( "queue_init failed\n" );
+      return 1;
+   }
+   hUsbDeviceFS.pData = &benchPcd;
+   hUsbDeviceFS.dev_speed = USBD_SPEED_FULL;
+   USBD_RNDIS_getClass()->Init( &hUsbDeviceFS, 0 );
+   
+   printf( "re-arm %.1f us\n", benchRearm );
+   printf( "message bytes  transfers/frame  datain/frame  transactions/frame  host frames/s  fs frames/s\n" );
+   for( uint32_t k = 1; k <= 24u; k *= 2u )
+   {
+      result |= bench_size( k * BENCH_EPSIZE, frames );
+      if( k == 16u )
+      {
+         k = 12u;    // 1536 is the biggest multiple within a 1514 byte frame
+      }
+   }
+   return result;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Sends single frames of one message length and prints the
+///            counts per frame and the frames/s.
+///
+/// \param     [in] uint32_t messageLength, multiple of the endpoint size
+/// \param     [in] uint32_t frames
+///
+/// \return    int 0 = passed, 1 = failed
+static int bench_size( uint32_t messageLength, uint32_t frames )
+{
+   uint8_t* frame = (uint8_t*)benchBuffer + BENCH_HEADROOM;
+   uint16_t length = (uint16_t)( messageLength - BENCH_HEADROOM );
+   double   start;
+   double   seconds;
+   double   busSeconds;
+   
+   memset( frame, 0x5a, length + 1u );
+   benchTransfers = 0;
+   benchTransactions = 0;
+   benchDataIn = 0;
+   benchCompleted = 0;
+   benchBytes = 0;
+   benchBusBytes = 0;
+   
+   start = bench_seconds();
+   for( uint32_t i = 0; i < frames; i++ )
+   {
+      if( !USBD_RNDIS_send( frame, length ) )
+      {
+         printf( "USBD_RNDIS_send refused the frame\n" );
+         return 1;
+      }
+      
+      // the in irq, each completed transfer calls the DataIn of the class
+      while( benchTxPending )
+      {
+         benchTxPending = false;
+         benchDataIn++;
+         USBD_RNDIS_getClass()->DataIn( &hUsbDeviceFS, RNDIS_DATA_IN_EP & 0x0F );
+      }
+   }
+   seconds = bench_seconds() - start;
+   busSeconds = (double)benchBusBytes * 8.0 / BENCH_BITRATE + (double)benchTransfers * benchRearm * 1e-6;
+   
+   printf( "%13u  %15.2f  %12.2f  %18.2f  %13.0f  %11.0f\n", (unsigned)messageLength,
+           (double)benchTransfers / frames, (double)benchDataIn / frames,
+           (double)benchTransactions / frames, (double)frames / seconds, (double)frames / busSeconds );
+   if( benchCompleted != frames || benchBytes / frames <= messageLength - 1u )
+   {
+      printf( "%u frames completed, %u bytes per frame\n", (unsigned)benchCompleted, (unsigned)( benchBytes / frames ) );
+      return 1;
+   }
+   return 0;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns a monotonic time.
+///
+/// \param     none
+///
+/// \return    double seconds
+static double bench_seconds( void )
+{
+   struct timespec ts;
+   
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Stubs of the usb driver ****************************************************
+
+USBD_StatusTypeDef USBD_LL_Transmit( USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size )
+{
+   if( ep_addr == RNDIS_DATA_IN_EP )
+   {
+      // a transfer of a multiple of the endpoint size ends without a zero
+      // length packet, the driver does not add one
+      uint32_t transactions = ( size == 0u ) ? 1u : ( size + BENCH_EPSIZE - 1u ) / BENCH_EPSIZE;
+      
+      benchTxPending = true;
+      benchTransfers++;
+      benchTransactions += transactions;
+      benchBytes += size;
+      benchBusBytes += size + (uint64_t)transactions * BENCH_OVERHEAD;
+   }
+   return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive( USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size ) { return USBD_OK; }
+USBD_StatusTypeDef USBD_LL_OpenEP( USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps ) { return USBD_OK; }
+USBD_StatusTypeDef USBD_LL_CloseEP( USBD_HandleTypeDef *pdev, uint8_t ep_addr ) { return USBD_OK; }
+USBD_StatusTypeDef USBD_CtlSendData( USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint32_t len ) { return USBD_OK; }
+USBD_StatusTypeDef USBD_CtlPrepareRx( USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint32_t len ) { return USBD_OK; }
+void               USBD_CtlError( USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req ) {}
+void               HAL_Delay( uint32_t delay ) {}
+void               Error_Handler( void ) { abort(); }
+
+// Stubs of usb_device.c ******************************************************
+
+void on_usbInTxCplt( uint16_t frames )
+{
+   benchCompleted += frames;
+}
+
+void     on_usbCtrlRequest( void ) {}
+void     on_usbOutRxPacket( queue_reservation_t *reservation, const char *data, int size ) {}
+void     on_usbOutRxCopy( const char *data, int size ) {}
+bool     on_usbOutRxStream( queue_reservation_t *reservation, const char *data, int size, int received ) { return false; }
+void     on_usbOutRxAbort( const char *data ) {}
+void     on_usbOutRxProgress( const char *data, int received ) {}
+void     usb_endStream( const uint8_t* dataStart ) {}
+
+uint16_t usb_getStreamed( const uint8_t* dataStart, uint16_t length, bool *aborted )
+{
+   *aborted = false;
+   return length;
+}
+
+// Stubs of stats.c ***********************************************************
+
+void     stats_add( stats_counter_t counter, uint32_t value ) {}
+uint64_t stats_get( stats_counter_t counter ) { return 0; }
+void     stats_getSnapshot( stats_snapshot_t *snapshot ) { memset( snapshot, 0, sizeof(*snapshot) ); }
+
+/********************** (C) COPYRIGHT Reichle & De-Massari *****END OF FILE****/
@@ -0,0 +1,18 @@
+// ****************************************************************************
+/// \file      main.h
+///
+/// \brief     host stub of the application header
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __MAIN_H
+#define __MAIN_H
+
+// Include ********************************************************************
+#include "stm32f4xx_hal.h"
+
+// Exported functions *********************************************************
+void     Error_Handler           ( void );
+
+#endif // __MAIN_H
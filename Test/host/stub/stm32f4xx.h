@@ -0,0 +1,37 @@
+// ****************************************************************************
+/// \file      stm32f4xx.h
+///
+/// \brief     host stub of the device header
+///
+/// \details   Replaces the cmsis device header for the host builds in
+///            Test/host. The interrupt mask is a plain variable, the host
+///            harness runs the irq handlers from its own thread.
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __STM32F4xx_H
+#define __STM32F4xx_H
+
+// Include ********************************************************************
+#include <stdint.h>
+
+// Exported defines ***********************************************************
+#define __IO                     volatile
+#define __STATIC_INLINE          static inline
+#define __ALIGN_BEGIN
+#define __ALIGN_END
+#define UNUSED(x)                ( (void)(x) )
+
+// Exported variables *********************************************************
+extern uint32_t            SystemCoreClock;
+extern uint32_t            hostPrimask;
+
+// Exported functions *********************************************************
+static inline void     __disable_irq  ( void )             { hostPrimask = 1u; }
+static inline void     __enable_irq   ( void )             { hostPrimask = 0u; }
+static inline uint32_t __get_PRIMASK  ( void )             { return hostPrimask; }
+static inline void     __set_PRIMASK  ( uint32_t primask ) { hostPrimask = primask; }
+static inline uint32_t __CLZ          ( uint32_t value )   { return value == 0u ? 32u : (uint32_t)__builtin_clz( value ); }
+
+#endif // __STM32F4xx_H
@@ -0,0 +1,32 @@
+// ****************************************************************************
+/// \file      stm32f4xx_hal.h
+///
+/// \brief     host stub of the hal header
+///
+/// \details   Only the parts of the pcd driver the usb classes look at.
+///
+// ****************************************************************************
+
+// Define to prevent recursive inclusion **************************************
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+// Include ********************************************************************
+#include "stm32f4xx.h"
+
+// Exported types *************************************************************
+typedef struct
+{
+   uint32_t             xfer_count;          // bytes of the last out transfer
+} PCD_EPTypeDef;
+
+typedef struct
+{
+   PCD_EPTypeDef        IN_ep[16];
+   PCD_EPTypeDef        OUT_ep[16];
+} PCD_HandleTypeDef;
+
+// Exported functions *********************************************************
+void     HAL_Delay               ( uint32_t delay );
+
+#endif // __STM32F4xx_HAL_H
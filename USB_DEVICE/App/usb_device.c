@@ -51,14 +51,26 @@
 #include "usbd_core.h"
 #include "usbd_desc.h"
 #include "usbd_rndis.h"
+#include "usbd_ncm.h"
 #include "queuex.h"
+#include "stats.h"
 
 // Private defines ************************************************************
 
 // Private types     **********************************************************
 
 // Private variables **********************************************************
-static RNDIS_USB_STATISTIC_t rndis_statistic;
+static volatile bool       usb_linkUp = true;   // link state of the backend, frames from the host are dropped while down
+static struct
+{
+   uint8_t* volatile       frame;               // frame of the uart queue still being received, NULL = none
+   volatile uint16_t       received;            // bytes of the frame received so far
+   volatile bool           aborted;             // the frame has turned out bad
+} usb_stream;
+#if USBD_CLASS == USBD_CLASS_RNDIS_ECM
+static USBD_ClassTypeDef*  usb_compositeClass[USBD_MAX_NUM_CONFIGURATION];  // class of each configuration
+static USBD_ClassTypeDef*  usb_compositeActive = NULL;                      // class of the selected configuration
+#endif
 
 // Global variables ***********************************************************
 USBD_HandleTypeDef         hUsbDeviceFS = {0};  // USB Device Core handle declaration
@@ -66,6 +78,44 @@ extern queue_handle_t      uartQueue;
 extern queue_handle_t      usbQueue;
 
 // Private function prototypes ************************************************
+#if USBD_CLASS != USBD_CLASS_RNDIS
+static bool       usb_streamWait                    ( const uint8_t* dataStart, uint16_t *length );
+#endif
+#if USBD_CLASS == USBD_CLASS_RNDIS_ECM
+static uint8_t    usb_compositeInit                 ( USBD_HandleTypeDef *pdev, uint8_t cfgidx );
+static uint8_t    usb_compositeDeInit               ( USBD_HandleTypeDef *pdev, uint8_t cfgidx );
+static uint8_t    usb_compositeSetup                ( USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req );
+static uint8_t    usb_compositeEP0_RxReady          ( USBD_HandleTypeDef *pdev );
+static uint8_t    usb_compositeDataIn               ( USBD_HandleTypeDef *pdev, uint8_t epnum );
+static uint8_t    usb_compositeDataOut              ( USBD_HandleTypeDef *pdev, uint8_t epnum );
+static uint8_t    *usb_compositeGetFSCfgDesc        ( uint16_t *length );
+static uint8_t    *usb_compositeGetHSCfgDesc        ( uint16_t *length );
+static uint8_t    *usb_compositeGetOtherSpeedCfgDesc( uint16_t *length );
+static USBD_ClassTypeDef* usb_compositeRequested    ( void );
+static uint8_t    *usb_compositeGetQualifierDesc    ( uint16_t *length );
+static uint8_t    *usb_compositeGetUsrStrDesc       ( USBD_HandleTypeDef *pdev, uint8_t index, uint16_t *length );
+
+// Class with one configuration per host driver, the callbacks are passed to
+// the class of the selected configuration.
+static USBD_ClassTypeDef usb_composite =
+{
+  usb_compositeInit,
+  usb_compositeDeInit,
+  usb_compositeSetup,
+  NULL,                 // EP0_TxSent
+  usb_compositeEP0_RxReady,
+  usb_compositeDataIn,
+  usb_compositeDataOut,
+  NULL,
+  NULL,
+  NULL,
+  usb_compositeGetHSCfgDesc,
+  usb_compositeGetFSCfgDesc,
+  usb_compositeGetOtherSpeedCfgDesc,
+  usb_compositeGetQualifierDesc,
+  usb_compositeGetUsrStrDesc,
+};
+#endif
 
 // Functions ******************************************************************
 /**
@@ -82,7 +132,15 @@ void usb_init( void )
    {
       Error_Handler();
    }
+#if USBD_CLASS == USBD_CLASS_NCM
+   if( USBD_RegisterClass(&hUsbDeviceFS, USBD_NCM_getClass() ) != USBD_OK )
+#elif USBD_CLASS == USBD_CLASS_RNDIS_ECM
+   usb_compositeClass[0] = USBD_RNDIS_getClass();  // windows takes the first configuration
+   usb_compositeClass[1] = USBD_ECM_getClass();
+   if( USBD_RegisterClass(&hUsbDeviceFS, &usb_composite ) != USBD_OK )
+#else
    if( USBD_RegisterClass(&hUsbDeviceFS, USBD_RNDIS_getClass() ) != USBD_OK )
+#endif
    {
       Error_Handler();
    }
@@ -104,33 +162,141 @@ void usb_deinit( void )
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     Called if a complete frame has been received.
+/// \brief     Called if a complete frame has been received into the
+///            reservation of the usb queue. The frame is committed with its
+///            real length, the rndis class takes a new reservation for the
+///            next transfer.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     const char *data
+/// \param     [in]     int size
+///
+/// \return    none
+inline void on_usbOutRxPacket( queue_reservation_t *reservation, const char *data, int size )
+{
+   if( !usb_linkUp )
+   {
+      // not committed, the reservation is used again
+      stats_add( STATS_USB_RX_LINKDOWN, 1 );
+      return;
+   }
+   
+   // a frame the queue drops is counted by its drop counters, not as received
+   if( queue_commit( reservation, (uint8_t*)data, (uint16_t)size, &usbQueue ) == 1 )
+   {
+      stats_add( STATS_USB_RX_FRAMES, 1 );
+      stats_add( STATS_USB_RX_BYTES, (uint32_t)size );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Called if the first part of a frame has been received and the
+///            frame is forwarded while the rest is still arriving. The frame
+///            is committed with its full length.
+///
+/// \param     [in/out] queue_reservation_t *reservation
+/// \param     [in]     const char *data
+/// \param     [in]     int size, the full length of the frame
+/// \param     [in]     int received, bytes of the frame received so far
+///
+/// \return    bool true = committed, false = left to on_usbOutRxPacket
+bool on_usbOutRxStream( queue_reservation_t *reservation, const char *data, int size, int received )
+{
+   if( !usb_linkUp || queue_commitStream( reservation, (uint8_t*)data, (uint16_t)size, &usbQueue ) != 1 )
+   {
+      return false;
+   }
+   
+   // the output is told before the queue manager, it runs after the irq
+   queue_progressStream( (uint8_t*)data, (uint16_t)received, &usbQueue );
+   stats_add( STATS_USB_RX_FRAMES, 1 );
+   stats_add( STATS_USB_RX_BYTES, (uint32_t)size );
+   return true;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Called if a frame of on_usbOutRxStream has ended short, the
+///            output ends it with a framing error.
+///
+/// \param     [in]     const char *data
+///
+/// \return    none
+void on_usbOutRxAbort( const char *data )
+{
+   stats_add( STATS_USB_RX_ERRORS, 1 );
+   queue_abortStream( (uint8_t*)data, &usbQueue );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Called with the bytes of a frame of on_usbOutRxStream received
+///            so far, the output does not send beyond them.
 ///
-/// \param     [in]  const char *data
-/// \param     [in]  int size
+/// \param     [in]     const char *data
+/// \param     [in]     int received
 ///
 /// \return    none
-inline void on_usbOutRxPacket(const char *data, int size)
+void on_usbOutRxProgress( const char *data, int received )
 {
-   rndis_statistic.counterRxFrame++;
-   queue_enqueue( (uint8_t*)data, size, &usbQueue );
-   USBD_RNDIS_setBuffer( queue_getHeadBuffer( &usbQueue ) );
+   queue_progressStream( (uint8_t*)data, (uint16_t)received, &usbQueue );
 }
 
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
 // ----------------------------------------------------------------------------
-/// \brief     Called if a frame has been send.
+/// \brief     Called for a frame which shares its transfer with further
+///            frames. The reservation can only hand over one of them, this
+///            one is copied into the usb queue.
+///
+/// \param     [in]     const char *data
+/// \param     [in]     int size
+///
+/// \return    none
+void on_usbOutRxCopy( const char *data, int size )
+{
+   if( !usb_linkUp )
+   {
+      stats_add( STATS_USB_RX_LINKDOWN, 1 );
+      return;
+   }
+   if( queue_enqueueMulti( (const uint8_t*)data, (uint16_t)size, &usbQueue ) == 1 )
+   {
+      stats_add( STATS_USB_RX_FRAMES, 1 );
+      stats_add( STATS_USB_RX_BYTES, (uint32_t)size );
+   }
+}
+#endif
+
+// ----------------------------------------------------------------------------
+/// \brief     Called if a transfer has been send.
+///
+/// \param     [in]  uint16_t frames in the transfer
+///
+/// \return    none
+inline void on_usbInTxCplt( uint16_t frames )
+{
+   stats_add( STATS_USB_TX_FRAMES, frames );
+   stats_add( STATS_USB_TX_TRANSFERS, 1 );
+   queue_dequeueBatch( &uartQueue, frames );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Called from the usb irq if a control message has been queued,
+///            wakes up the task which serves the usb.
 ///
 /// \param     none
 ///
 /// \return    none
-inline void on_usbInTxCplt( void )
+void on_usbCtrlRequest( void )
 {
-   rndis_statistic.counterTxFrame++;
-   queue_dequeue(&uartQueue);
+   if( usbQueue.wakeup != NULL )
+   {
+      usbQueue.wakeup( &usbQueue );
+   }
 }
 
 // ----------------------------------------------------------------------------
-/// \brief     Start a new usb transmission.
+/// \brief     Start a new usb transmission. The rndis class starts a frame
+///            which is still being received and sends it while it arrives,
+///            the ncm and ecm framing wait for the whole frame.
 ///
 /// \param     [in]  uint8_t* dpointer
 /// \param     [in]  uint16_t length
@@ -138,14 +304,458 @@ inline void on_usbInTxCplt( void )
 /// \return    none
 uint8_t usb_output( uint8_t* dpointer, uint16_t length )
 {
+#if USBD_CLASS == USBD_CLASS_NCM
+   if( usb_streamWait(dpointer, &length) || !USBD_NCM_send(dpointer, length) )
+#elif USBD_CLASS == USBD_CLASS_RNDIS_ECM
+   if(!( usb_compositeActive == USBD_ECM_getClass() ? !usb_streamWait(dpointer, &length) && USBD_NCM_send(dpointer, length) : USBD_RNDIS_send(dpointer, length) ))
+#else
    if(!USBD_RNDIS_send(dpointer, length))
+#endif
    {
       return 0;
    }
    
+   stats_add( STATS_USB_TX_BYTES, length );
    return 1;
 }
 
+// ----------------------------------------------------------------------------
+/// \brief     Start a new usb transmission with several frames in one
+///            transfer.
+///
+/// \param     [in]  queue_frame_t* frames
+/// \param     [in]  uint16_t count
+///
+/// \return    uint16_t frames taken, 0 = busy
+uint16_t usb_outputBatch( queue_frame_t* frames, uint16_t count )
+{
+   uint16_t taken;
+   uint32_t bytes = 0;
+   
+   // A frame which is still being received is not packed with others, it
+   // goes alone as soon as it is in front.
+   for( taken = 0; taken < count; taken++ )
+   {
+      if( frames[taken].dataStart == usb_stream.frame )
+      {
+         break;
+      }
+   }
+   if( taken == 0 )
+   {
+      return usb_output( frames[0].dataStart, frames[0].dataLength );
+   }
+   count = taken;
+   
+#if USBD_CLASS == USBD_CLASS_NCM
+   taken = USBD_NCM_sendBatch( frames, count );
+#elif USBD_CLASS == USBD_CLASS_RNDIS_ECM
+   if( usb_compositeActive == USBD_ECM_getClass() )
+   {
+      taken = USBD_NCM_sendBatch( frames, count );
+   }
+   else
+   {
+      taken = USBD_RNDIS_sendBatch( frames, count );
+   }
+#else
+   taken = USBD_RNDIS_sendBatch( frames, count );
+#endif
+   
+   for( uint16_t i = 0; i < taken; i++ )
+   {
+      bytes += frames[i].dataLength;
+   }
+   stats_add( STATS_USB_TX_BYTES, bytes );
+   return taken;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Resumes the reception of the usb out endpoint, which is paused
+///            while the usb queue is full (see RNDIS_RX_FLOWCONTROL).
+///
+/// \param     none
+///
+/// \return    none
+void usb_rxResume( void )
+{
+#if USBD_CLASS == USBD_CLASS_NCM
+   USBD_NCM_rxResume();
+#elif USBD_CLASS == USBD_CLASS_RNDIS_ECM
+   if( usb_compositeActive == USBD_ECM_getClass() )
+   {
+      USBD_NCM_rxResume();
+   }
+   else
+   {
+      USBD_RNDIS_rxResume();
+   }
+#else
+   USBD_RNDIS_rxResume();
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Sets the link state of the backend the usb frames are forwarded
+///            to. The host is told with a media indication and stops sending,
+///            frames still arriving while the link is down are dropped
+///            instead of filling the usb queue. Can be called from any
+///            context.
+///
+/// \param     [in]  bool up
+///
+/// \return    none
+void usb_setLinkState( bool up )
+{
+   usb_linkUp = up;
+#if USBD_CLASS == USBD_CLASS_NCM
+   USBD_NCM_setMediaState( up );
+#elif USBD_CLASS == USBD_CLASS_RNDIS_ECM
+   USBD_NCM_setMediaState( up );
+   USBD_RNDIS_setMediaState( up );
+#else
+   USBD_RNDIS_setMediaState( up );
+#endif
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Takes the receive progress of a frame of the uart queue which
+///            is forwarded while it is received. Linked as output progress
+///            of the uart queue, called from the irq of the producer. A
+///            transmission waiting for the bytes goes on.
+///
+/// \param     [in]  uint8_t* dataStart of the frame
+/// \param     [in]  uint16_t received bytes of the frame
+///
+/// \return    none
+void usb_outputProgress( uint8_t* dataStart, uint16_t received )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( usb_stream.frame != dataStart )
+   {
+      usb_stream.frame = dataStart;
+      usb_stream.aborted = false;
+   }
+   usb_stream.received = received;
+   __set_PRIMASK( primask );
+   
+#if USBD_CLASS != USBD_CLASS_NCM
+   USBD_RNDIS_streamResume();
+#endif
+   if( uartQueue.wakeup != NULL )
+   {
+      uartQueue.wakeup( &uartQueue );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Marks a frame of the uart queue which has turned out bad while
+///            it was forwarded. Linked as output abort of the uart queue. The
+///            rndis class ends its transfer short, the host drops it.
+///
+/// \param     [in]  uint8_t* dataStart of the frame
+///
+/// \return    none
+void usb_outputAbort( uint8_t* dataStart )
+{
+   if( usb_stream.frame != dataStart )
+   {
+      return;
+   }
+   usb_stream.aborted = true;
+   stats_add( STATS_USB_TX_ERRORS, 1 );
+   
+#if USBD_CLASS != USBD_CLASS_NCM
+   USBD_RNDIS_streamResume();
+#endif
+   if( uartQueue.wakeup != NULL )
+   {
+      uartQueue.wakeup( &uartQueue );
+   }
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Forgets a frame of the uart queue which is dropped before it
+///            has been sent. Linked as output drop of the uart queue, its
+///            buffer may be handed out again for a frame which is not
+///            forwarded while it is received.
+///
+/// \param     [in]  uint8_t* dataStart of the frame
+///
+/// \return    none
+void usb_outputDrop( uint8_t* dataStart )
+{
+   usb_endStream( dataStart );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns how many bytes of a frame can be sent, all of them
+///            unless the frame is still being received.
+///
+/// \param     [in]  const uint8_t* dataStart of the frame
+/// \param     [in]  uint16_t length of the frame
+/// \param     [out] bool *aborted, the frame has turned out bad
+///
+/// \return    uint16_t bytes which can be sent
+uint16_t usb_getStreamed( const uint8_t* dataStart, uint16_t length, bool *aborted )
+{
+   uint32_t primask = __get_PRIMASK();
+   uint16_t streamed = length;
+   
+   *aborted = false;
+   __disable_irq();
+   if( dataStart == usb_stream.frame )
+   {
+      *aborted = usb_stream.aborted;
+      if( usb_stream.received < length )
+      {
+         streamed = usb_stream.received;
+      }
+   }
+   __set_PRIMASK( primask );
+   
+   return streamed;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Forgets a frame which was forwarded while it was received, once
+///            the output has sent all of it or has ended it.
+///
+/// \param     [in]  const uint8_t* dataStart of the frame
+///
+/// \return    none
+void usb_endStream( const uint8_t* dataStart )
+{
+   uint32_t primask = __get_PRIMASK();
+   
+   __disable_irq();
+   if( dataStart == usb_stream.frame )
+   {
+      usb_stream.frame = NULL;
+   }
+   __set_PRIMASK( primask );
+}
+
+#if USBD_CLASS != USBD_CLASS_RNDIS
+// ----------------------------------------------------------------------------
+/// \brief     Checks if the ncm or ecm framing has to wait for a frame which
+///            is still being received. A frame which has turned out bad is
+///            sent short with the bytes received, the host drops it.
+///
+/// \param     [in]     const uint8_t* dataStart of the frame
+/// \param     [in/out] uint16_t *length of the frame, the bytes to send
+///
+/// \return    bool true = wait
+static bool usb_streamWait( const uint8_t* dataStart, uint16_t *length )
+{
+   bool     aborted;
+   uint16_t streamed;
+   
+   streamed = usb_getStreamed( dataStart, *length, &aborted );
+   if( streamed < *length && !aborted )
+   {
+      return true;
+   }
+   *length = streamed;
+   usb_endStream( dataStart );
+   return false;
+}
+#endif
+
+// ----------------------------------------------------------------------------
+/// \brief     Processes the control messages queued by the usb irq, called
+///            by the task. The cdc classes answer their requests directly.
+///
+/// \param     none
+///
+/// \return    none
+void usb_ctrlManager( void )
+{
+#if USBD_CLASS != USBD_CLASS_NCM
+   USBD_RNDIS_ctrlManager();
+#endif
+}
+
+#if USBD_CLASS == USBD_CLASS_RNDIS_ECM
+// ----------------------------------------------------------------------------
+/// \brief     Starts the class of the configuration selected by the host.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t cfgidx, configuration value 1..n
+///
+/// \return    status
+static uint8_t usb_compositeInit( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
+{
+   if( cfgidx == 0 || cfgidx > USBD_MAX_NUM_CONFIGURATION )
+   {
+      return USBD_FAIL;
+   }
+   usb_compositeActive = usb_compositeClass[cfgidx - 1u];
+   return usb_compositeActive->Init( pdev, cfgidx );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Stops the active class. cfgidx does not tell which class that
+///            is: USBD_SetConfig passes 0 when the host deconfigures, the
+///            old value when it switches the configuration and the new value
+///            when the new class failed to start. The active class is
+///            therefore taken from usb_compositeActive, not from cfgidx.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t cfgidx
+///
+/// \return    status
+static uint8_t usb_compositeDeInit( USBD_HandleTypeDef *pdev, uint8_t cfgidx )
+{
+   uint8_t status = USBD_OK;
+
+   if( usb_compositeActive != NULL )
+   {
+      status = usb_compositeActive->DeInit( pdev, cfgidx );
+      usb_compositeActive = NULL;
+   }
+   return status;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Passes a setup request to the active class.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     USBD_SetupReqTypedef *req
+///
+/// \return    status
+static uint8_t usb_compositeSetup( USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req )
+{
+   return ( usb_compositeActive != NULL ) ? usb_compositeActive->Setup( pdev, req ) : USBD_OK;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Passes the data stage of a control request to the active class.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+///
+/// \return    status
+static uint8_t usb_compositeEP0_RxReady( USBD_HandleTypeDef *pdev )
+{
+   return ( usb_compositeActive != NULL ) ? usb_compositeActive->EP0_RxReady( pdev ) : USBD_OK;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Passes an in complete to the active class.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t epnum
+///
+/// \return    status
+static uint8_t usb_compositeDataIn( USBD_HandleTypeDef *pdev, uint8_t epnum )
+{
+   return ( usb_compositeActive != NULL ) ? usb_compositeActive->DataIn( pdev, epnum ) : USBD_OK;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Passes an out transfer to the active class.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t epnum
+///
+/// \return    status
+static uint8_t usb_compositeDataOut( USBD_HandleTypeDef *pdev, uint8_t epnum )
+{
+   return ( usb_compositeActive != NULL ) ? usb_compositeActive->DataOut( pdev, epnum ) : USBD_OK;
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the class of the configuration index in the current get
+///            descriptor request, the descriptor getters of the core have no
+///            index. An unknown index returns the first configuration.
+///
+/// \param     none
+///
+/// \return    USBD_ClassTypeDef*
+static USBD_ClassTypeDef* usb_compositeRequested( void )
+{
+   uint8_t index = LOBYTE( hUsbDeviceFS.request.wValue );
+
+   if( index >= USBD_MAX_NUM_CONFIGURATION )
+   {
+      index = 0;
+   }
+   return usb_compositeClass[index];
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the full speed configuration descriptor.
+///
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *usb_compositeGetFSCfgDesc( uint16_t *length )
+{
+   return usb_compositeRequested()->GetFSConfigDescriptor( length );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the high speed configuration descriptor.
+///
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *usb_compositeGetHSCfgDesc( uint16_t *length )
+{
+   return usb_compositeRequested()->GetHSConfigDescriptor( length );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the other speed configuration descriptor.
+///
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *usb_compositeGetOtherSpeedCfgDesc( uint16_t *length )
+{
+   return usb_compositeRequested()->GetOtherSpeedConfigDescriptor( length );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the device qualifier descriptor.
+///
+/// \param     [out] uint16_t *length
+///
+/// \return    pointer to descriptor buffer
+static uint8_t *usb_compositeGetQualifierDesc( uint16_t *length )
+{
+   return usb_compositeClass[0]->GetDeviceQualifierDescriptor( length );
+}
+
+// ----------------------------------------------------------------------------
+/// \brief     Returns the class specific strings, the MAC-address string of
+///            the ecm configuration is requested in any configuration.
+///
+/// \param     [in/out] USBD_HandleTypeDef *pdev
+/// \param     [in]     uint8_t index
+/// \param     [out]    uint16_t *length
+///
+/// \return    pointer to descriptor buffer, NULL = unknown index
+static uint8_t *usb_compositeGetUsrStrDesc( USBD_HandleTypeDef *pdev, uint8_t index, uint16_t *length )
+{
+   for( uint32_t i = 0; i < USBD_MAX_NUM_CONFIGURATION; i++ )
+   {
+      if( usb_compositeClass[i]->GetUsrStrDescriptor != NULL )
+      {
+         uint8_t *desc = usb_compositeClass[i]->GetUsrStrDescriptor( pdev, index, length );
+         if( desc != NULL )
+         {
+            return desc;
+         }
+      }
+   }
+   *length = 0;
+   return NULL;
+}
+#endif
+
 // ----------------------------------------------------------------------------
 /// \brief     Pull D+ down to trigger an enum process by the host
 ///
@@ -53,17 +53,42 @@
 #include "stm32f4xx.h"
 #include "stm32f4xx_hal.h"
 #include "usbd_def.h"
+#include "queuex.h"
+#include "usbd_rndis.h"
+#include "usbd_ncm.h"
 
 // Exported defines ***********************************************************
+#if USBD_CLASS == USBD_CLASS_NCM
+#define USB_TX_HEADROOM          NCM_TX_HEADROOM     // room for the usb header in front of a frame of usb_output
+#else
+#define USB_TX_HEADROOM          RNDIS_TX_HEADROOM   // ecm of the composite device needs none
+#endif
+#define USB_TX_TAILROOM          ( 1u )              // padding byte of a transfer with a multiple of the endpoint size
     
 // Exported types *************************************************************
     
 // Exported functions *********************************************************
 void     usb_init                ( void );
 void     usb_deinit              ( void );
-void     on_usbOutRxPacket       ( const char *data, int size );
-void     on_usbInTxCplt          ( void );
+void     on_usbOutRxPacket       ( queue_reservation_t *reservation, const char *data, int size );
+bool     on_usbOutRxStream       ( queue_reservation_t *reservation, const char *data, int size, int received );
+void     on_usbOutRxAbort        ( const char *data );
+void     on_usbOutRxProgress     ( const char *data, int received );
+#if QUEUE_BACKEND == QUEUE_BACKEND_SLOT
+void     on_usbOutRxCopy         ( const char *data, int size );
+#endif
+void     on_usbInTxCplt          ( uint16_t frames );
+void     on_usbCtrlRequest       ( void );
 uint8_t  usb_output              ( uint8_t* dpointer, uint16_t length );
+uint16_t usb_outputBatch         ( queue_frame_t* frames, uint16_t count );
+void     usb_outputProgress      ( uint8_t* dataStart, uint16_t received );
+void     usb_outputAbort         ( uint8_t* dataStart );
+void     usb_outputDrop          ( uint8_t* dataStart );
+uint16_t usb_getStreamed         ( const uint8_t* dataStart, uint16_t length, bool *aborted );
+void     usb_endStream           ( const uint8_t* dataStart );
+void     usb_rxResume            ( void );
+void     usb_ctrlManager         ( void );
+void     usb_setLinkState        ( bool up );
 void     usb_forceHostEnum       ( void );
 
 #endif /* __USB_DEVICE__H__ */
@@ -66,9 +66,14 @@
 #define USBD_PID                        0x4953
 #define USBD_LANGID_STRING              0x409
 #define USBD_MANUFACTURER_STRING        "RDM"
+#if USBD_CLASS == USBD_CLASS_NCM
+#define USBD_PRODUCT_STRING_HS          "INTELIPHY NCM"
+#define USBD_PRODUCT_STRING_FS          "INTELIPHY NCM"
+#else
 #define USBD_PRODUCT_STRING_HS          "INTELIPHY RNDIS"
-#define USBD_SERIALNUMBER_STRING_HS     "00000000123B"
 #define USBD_PRODUCT_STRING_FS          "INTELIPHY RNDIS"
+#endif
+#define USBD_SERIALNUMBER_STRING_HS     "00000000123B"
 #define USBD_SERIALNUMBER_STRING_FS     "00000000123C"
 #define USBD_CONFIGURATION_STRING_HS    "RNDIS Config"
 #define USBD_INTERFACE_STRING_HS        "RNDIS Interface"
@@ -162,9 +167,15 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
     18,                                 /* bLength = 18 bytes */
     0x01,                               /* bDescriptorType = DEVICE */
     0x00, 0x02,                         /* bcdUSB          = 1.1 0x10,0x01  2.0 0x00,0x02 */
+#if USBD_CLASS != USBD_CLASS_RNDIS
+    0xEF,                               /* bDeviceClass    = Miscellaneous */
+    0x02,                               /* bDeviceSubClass = Common Class */
+    0x01,                               /* bDeviceProtocol = Interface Association Descriptor */
+#else
     0xE0,                               /* bDeviceClass    = Wireless Controller */
     0x00,                               /* bDeviceSubClass = Unused at this time */
     0x00,                               /* bDeviceProtocol = Unused at this time */
+#endif
     0x40,                               /* bMaxPacketSize0 = EP0 buffer size */
     LOBYTE(USBD_VID), HIBYTE(USBD_VID), /* Vendor ID */
     LOBYTE(USBD_PID), HIBYTE(USBD_PID), /* Product ID */
@@ -172,7 +183,7 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
     USBD_IDX_MFC_STR,
     USBD_IDX_PRODUCT_STR,
     USBD_IDX_SERIAL_STR,
-    1
+    USBD_MAX_NUM_CONFIGURATION
 };
 
 /* USB Standard Device Descriptor */
@@ -186,7 +197,7 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __
     0x00,
     0x00,
     0x40,
-    0x01,
+    USBD_MAX_NUM_CONFIGURATION,
     0x00,
 };
 
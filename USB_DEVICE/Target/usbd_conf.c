@@ -26,6 +26,7 @@
 #include "usbd_core.h"
 
 #include "usbd_rndis.h"
+#include "stats.h"
 //#include "usbd_cdc.h"
 
 /* USER CODE BEGIN Includes */
@@ -152,8 +153,7 @@ static void PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
-   static uint32_t llCbDataOut;
-   llCbDataOut++;
+   stats_add( STATS_USB_LL_DATAOUT, 1 );
   USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->OUT_ep[epnum].xfer_buff);
 }
 
@@ -169,8 +169,7 @@ static void PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
-   static uint32_t llCbDataIn;
-   llCbDataIn++;
+   stats_add( STATS_USB_LL_DATAIN, 1 );
    
    USBD_LL_DataInStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->IN_ep[epnum].xfer_buff);
 }
@@ -63,10 +63,22 @@
   * @{
   */
 
+/* usb class, selected at build time */
+#define USBD_CLASS_RNDIS         0u    // remote ndis, windows
+#define USBD_CLASS_NCM           1u    // cdc network control model, linux/macos
+#define USBD_CLASS_RNDIS_ECM     2u    // configuration 1 rndis for windows, configuration 2 cdc-ecm for linux/macos
+#ifndef USBD_CLASS
+#define USBD_CLASS               USBD_CLASS_RNDIS
+#endif
+
 /*---------- -----------*/
 #define USBD_MAX_NUM_INTERFACES     1U
 /*---------- -----------*/
+#if USBD_CLASS == USBD_CLASS_RNDIS_ECM
+#define USBD_MAX_NUM_CONFIGURATION     2U
+#else
 #define USBD_MAX_NUM_CONFIGURATION     1U
+#endif
 /*---------- -----------*/
 #define USBD_MAX_STR_DESC_SIZ     512U
 /*---------- -----------*/
@@ -75,6 +87,8 @@
 #define USBD_LPM_ENABLED     0U
 /*---------- -----------*/
 #define USBD_SELF_POWERED     1U
+/*---------- -----------*/
+#define USBD_SUPPORT_USER_STRING_DESC     1U
 
 /****************************************/
 /* #define for FS and HS identification */
@@ -93,6 +107,15 @@
 #define RNDIS_DATA_IN_SZ         64u
 #define RNDIS_DATA_OUT_SZ        64u
 
+/* NCM */
+#define NCM_NOTIFICATION_IN_EP   0x81
+#define NCM_DATA_IN_EP           0x82
+#define NCM_DATA_OUT_EP          0x03
+
+#define NCM_NOTIFICATION_IN_SZ   16u   // connection speed change notification
+#define NCM_DATA_IN_SZ           64u
+#define NCM_DATA_OUT_SZ          64u
+
 #define USBD_CFG_MAX_NUM         1
 #define USBD_ITF_MAX_NUM         1
 #define USB_MAX_STR_DESC_SIZ     64